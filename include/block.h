@@ -0,0 +1,156 @@
+#ifndef RISCV_BLOCK
+#define RISCV_BLOCK
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "instr.h"
+#include "memmap.h"
+
+/* A block is a straight-line run of instructions which ends at the first
+ * instruction that may change the control flow or the privileged state, for
+ * example branch, jump, CSR access and trap return. The instructions of a
+ * block are decoded once and kept in the block cache, so the following
+ * execution of the same code can skip the fetching and decoding. */
+
+#define BLOCK_MAX_INSTR 64
+
+#define BLOCK_INDEX_BIT 14
+#define BLOCK_CNT (1 << BLOCK_INDEX_BIT)
+
+/* The blocks are also chained by the physical page where they start, so the
+ * blocks in an overwritten page can be found without searching the whole
+ * cache. The pages are hashed into the buckets of the lists. */
+#define BLOCK_PAGE_BIT 12
+#define BLOCK_PAGE_CNT (1 << BLOCK_PAGE_BIT)
+
+// the memory pool which the blocks are allocated from
+#define BLOCK_POOL_SIZE (8 << 20)
+
+/* To find out the blocks which are overwritten by a store, the DRAM is split
+ * into chunks and we record which of them contain the instructions of blocks.
+ * The chunk should be small enough, so a store to the data that lives next to
+ * the code doesn't hit a chunk with instructions easily. */
+#define BLOCK_CHUNK_SHIFT 6
+
+/* How the block is left, which decides where the next block is linked from.
+ * The jumps which write the link register are calls, and the indirect jumps
+ * which read the link register are returns. */
+typedef enum {
+    // the next block is always searched in the block cache
+    BLOCK_EXIT_NONE,
+    BLOCK_EXIT_FALL,
+    BLOCK_EXIT_BRANCH,
+    BLOCK_EXIT_JUMP,
+    BLOCK_EXIT_CALL,
+    BLOCK_EXIT_RETURN,
+} riscv_block_exit;
+
+typedef struct riscv_block riscv_block;
+
+/* The link to the next block, so it can be found without translating the
+ * address and searching the block cache. The link is only used if the next
+ * block starts at the expected address and the link is created under the same
+ * generation, which is increased when the address translation is changed or
+ * all the blocks are dropped. */
+typedef struct {
+    // the virtual address of the next block
+    uint64_t pc;
+    uint64_t gen;
+    riscv_block *block;
+} riscv_block_link;
+
+struct riscv_block {
+    // the physical address of the first instruction
+    uint64_t paddr;
+    // the translation mode, ASID and privilege level where the block is built
+    uint64_t tag;
+    // the size of the instructions in bytes
+    uint16_t size;
+    uint16_t instr_cnt;
+    // the number of fused pairs in the block
+    uint16_t fused_cnt;
+    bool valid;
+    uint8_t exit;
+
+    /* link[0] is the target of the jump or the taken branch, which works as
+     * an inline cache for the indirect jump. link[1] is the next instruction
+     * of the block, which is also where a call returns to. */
+    riscv_block_link link[2];
+    // the next block in the list of the page
+    riscv_block *page_next;
+
+    // the times the block is executed before it is translated by JIT
+    uint32_t exec_cnt;
+    void *jit_code;
+
+    riscv_instr instr[];
+};
+
+typedef struct {
+    riscv_block *table[BLOCK_CNT];
+    // the lists of blocks by the page, where the dropped blocks are skipped
+    riscv_block *page[BLOCK_PAGE_CNT];
+
+    uint8_t *pool;
+    uint64_t pool_used;
+
+    // one bit for each chunk of DRAM, which is set if it contains code
+    uint64_t *code_map;
+    uint64_t dram_size;
+    uint64_t chunk_cnt;
+    /* Increased whenever the decoded instructions are dropped because of the
+     * overwritten code, so the other caches of decoded instructions can find
+     * out that they should be dropped too. */
+    uint64_t epoch;
+    // the generation of the links between blocks
+    uint64_t link_gen;
+} riscv_block_cache;
+
+bool init_block_cache(riscv_block_cache *cache, uint64_t dram_size);
+riscv_block *read_block_cache(riscv_block_cache *cache,
+                              uint64_t paddr,
+                              uint64_t tag);
+riscv_block *alloc_block(riscv_block_cache *cache);
+void write_block_cache(riscv_block_cache *cache, riscv_block *block);
+void mark_block_cache_code(riscv_block_cache *cache,
+                           uint64_t paddr,
+                           uint64_t len);
+void invalid_block_cache(riscv_block_cache *cache);
+void __invalid_block_cache_by_paddr(riscv_block_cache *cache,
+                                    uint64_t paddr,
+                                    uint64_t len);
+void free_block_cache(riscv_block_cache *cache);
+
+/* Drop the links between the blocks, which should be called whenever the
+ * address translation is changed */
+static inline void unlink_block_cache(riscv_block_cache *cache)
+{
+    cache->link_gen++;
+}
+
+static inline bool block_chunk_has_code(riscv_block_cache *cache,
+                                        uint64_t chunk)
+{
+    return cache->code_map[chunk >> 6] & (1UL << (chunk & 63));
+}
+
+/* Invalidate the blocks which contain the instructions in range [paddr, paddr
+ * + len). This should be called whenever the DRAM is written. */
+static inline void invalid_block_cache_by_paddr(riscv_block_cache *cache,
+                                                uint64_t paddr,
+                                                uint64_t len)
+{
+    if (paddr < DRAM_BASE || paddr - DRAM_BASE >= cache->dram_size || len == 0)
+        return;
+
+    uint64_t first = (paddr - DRAM_BASE) >> BLOCK_CHUNK_SHIFT;
+    uint64_t last = (paddr - DRAM_BASE + len - 1) >> BLOCK_CHUNK_SHIFT;
+    // the common case is a small store to the data, which is checked quickly
+    if (first == last && !block_chunk_has_code(cache, first))
+        return;
+
+    __invalid_block_cache_by_paddr(cache, paddr, len);
+}
+
+#endif /* RISCV_BLOCK */
@@ -5,6 +5,7 @@
 #include "clint.h"
 #include "memory.h"
 #include "plic.h"
+#include "sched.h"
 #include "uart.h"
 #include "virtio_blk.h"
 
@@ -15,9 +16,15 @@ typedef struct {
     riscv_uart uart;
     riscv_virtio_blk virtio_blk;
     riscv_boot boot;
+    riscv_sched sched;
 } riscv_bus;
 
-bool init_bus(riscv_bus *bus, const char *filename, const char *rfs_name);
+bool init_bus(riscv_bus *bus,
+              const char *filename,
+              const char *rfs_name,
+              uint64_t mem_size,
+              bool host_clock);
+bool restore_bus(riscv_bus *bus);
 uint64_t read_bus(riscv_bus *bus,
                   uint64_t addr,
                   uint8_t size,
@@ -27,6 +34,22 @@ bool write_bus(riscv_bus *bus,
                uint8_t size,
                uint64_t value,
                riscv_exception *exc);
-void tick_bus(riscv_bus *bus, riscv_csr *csr);
+void __tick_bus(riscv_bus *bus, riscv_csr *csr);
+uint64_t idle_bus(riscv_bus *bus, bool warp);
 void free_bus(riscv_bus *bus);
+
+// Read the value of mtime, which is also the value of CSR TIME
+static inline uint64_t read_mtime(riscv_bus *bus)
+{
+    return clint_mtime(&bus->clint, sched_time(&bus->sched));
+}
+
+/* Advance the time of devices by the executed cycles. The devices are only
+ * visited if the deadline of any event is reached. */
+static inline void tick_bus(riscv_bus *bus, riscv_csr *csr, uint64_t cycles)
+{
+    bus->sched.now += cycles;
+    if (bus->sched.now >= sched_deadline(&bus->sched))
+        __tick_bus(bus, csr);
+}
 #endif
@@ -21,20 +21,35 @@
 #define CLINT_MTIMECMP (CLINT_BASE + 0x4000)
 #define CLINT_MTIME (CLINT_BASE + 0XBFF8)
 
+// the frequency of mtime, which is the timebase-frequency in device tree
+#define CLINT_FREQ 10000000
+
+/* The mtime register isn't counted by CLINT itself. Instead, it is derived
+ * from the time of the bus, which is given as 'now' to the functions below. */
 typedef struct {
     uint32_t msip;
     uint64_t mtimecmp;
-    uint64_t mtime;
+    // the difference between mtime and the time of bus since mtime is writable
+    uint64_t mtime_offset;
 } riscv_clint;
 
 uint64_t read_clint(riscv_clint *clint,
                     uint64_t addr,
                     uint8_t size,
+                    uint64_t now,
                     riscv_exception *exc);
 bool write_clint(riscv_clint *clint,
                  uint64_t addr,
                  uint8_t size,
                  uint64_t value,
+                 uint64_t now,
                  riscv_exception *exc);
-void tick_clint(riscv_clint *clint, riscv_csr *csr);
+void update_clint(riscv_clint *clint, riscv_csr *csr);
+uint64_t clint_timer_delay(riscv_clint *clint, uint64_t now);
+void fire_clint_timer(riscv_clint *clint, riscv_csr *csr, uint64_t now);
+
+static inline uint64_t clint_mtime(riscv_clint *clint, uint64_t now)
+{
+    return now + clint->mtime_offset;
+}
 #endif
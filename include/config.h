@@ -0,0 +1,31 @@
+#ifndef RISCV_CONFIG
+#define RISCV_CONFIG
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The options to configure the emulator, which are given by the command line
+ * arguments */
+typedef struct {
+    // translate the frequently executed blocks into host instructions
+    bool jit;
+    // use the threaded interpreter to execute the blocks
+    bool threaded;
+    // fuse the common pairs of instructions when building the blocks
+    bool fusion;
+    // report how many instructions are fused when the emulator exits
+    bool fusion_stats;
+    // the size of DRAM in bytes
+    uint64_t memory_size;
+    // keep the initial state, so the emulator can be reset by reset_emu
+    bool snapshot;
+    // skip the idle time of the hart instead of waiting for it on the host
+    bool time_warp;
+    // count mtime by the monotonic clock of host instead of the instructions
+    bool host_clock;
+    // the geometry of I-cache, which is only used if ICACHE_CONFIG is set
+    uint32_t icache_sets;
+    uint32_t icache_ways;
+} riscv_config;
+
+#endif
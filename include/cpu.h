@@ -1,15 +1,20 @@
 #ifndef RISCV_CPU
 #define RISCV_CPU
 
+#include "block.h"
 #include "bus.h"
+#include "config.h"
 #include "csr.h"
 #include "exception.h"
 #include "icache.h"
 #include "irq.h"
+#include "jit.h"
 #include "pte.h"
+#include "tlb.h"
 
 typedef enum access Access;
 enum access { Access_Instr, Access_Load, Access_Store };
+#define ACCESS_CNT (Access_Store + 1)
 
 typedef struct {
     enum { USER = 0x0, SUPERVISOR = 0x1, MACHINE = 0x3 } mode;
@@ -29,24 +34,70 @@ typedef union {
     uint64_t u;
 } float64_reg_t;
 
+// the number of the entries in the return address stack, which is a power of 2
+#define RAS_SIZE 16
+
+/* The entry of the return address stack, which keeps the link where the call
+ * returns to */
+typedef struct {
+    riscv_block_link *link;
+    uint64_t gen;
+} riscv_ras_entry;
+
+/* The writes to x0 are redirected to this register, so x0 is always zero
+ * without being reset after each instruction */
+#define XREG_DISCARD 32
+
 typedef struct CPU {
     riscv_mode mode;
     riscv_exception exc;
     riscv_irq irq;
-    riscv_instr instr;
+    /* The instruction being executed, which points to either the decoding
+     * buffer 'instr_buf' or the pre-decoded instruction in cache */
+    riscv_instr *instr;
+    riscv_instr instr_buf;
     riscv_bus bus;
     riscv_csr csr;
 #ifdef ICACHE_CONFIG
     riscv_icache icache;
 #endif
+    riscv_block_cache block_cache;
+    riscv_jit jit;
+    // the TLB for each type of access
+    riscv_tlb tlb[ACCESS_CNT];
+    // the page-walk cache shared by all types of access
+    riscv_pwc pwc;
+
+    /* The link where the next block is found from, which is set after a
+     * block is executed completely. The link belongs to a block, so it is
+     * only used in the generation that the link is found. */
+    riscv_block_link *link;
+    uint64_t link_gen;
+    riscv_ras_entry ras[RAS_SIZE];
+    uint32_t ras_top;
 
-    uint64_t xreg[32];
+    uint64_t xreg[32 + 1];
     float64_reg_t freg[32];
     uint64_t pc;
     // FIXME: we should maintain a reservation set but not a single u64
     uint64_t reservation;
+    // whether the hart is stalled by WFI until an interrupt is pending
+    bool wfi;
 
     bool debug_mode;
+    bool jit_mode;
+    bool threaded_mode;
+    bool fusion_mode;
+    bool warp_mode;
+    // report the statistics of fusion when the emulator exits
+    bool fusion_stats;
+
+    /* The times each kind of fused pair is built into the blocks, where a pair
+     * is counted again if its block is dropped and decoded again */
+    uint64_t fusion_cnt[OP_FUSED_CNT];
+    // the times the fused pairs are executed, and all the executed instructions
+    uint64_t fused_exec_cnt;
+    uint64_t instr_cnt;
 } riscv_cpu;
 
 /* the *_S type means a special form of index to map the instruction. You can
@@ -54,11 +105,8 @@ typedef struct CPU {
 typedef struct {
     enum {
         OPCODE,
-        FUNC2_S,
         FUNC3,
-        FUNC4_S,
         FUNC5,
-        FUNC6_S,
         FUNC7,
         FUNC7_S,
         RS2,
@@ -77,12 +125,23 @@ typedef struct INSTR_ENTRY {
     void (*exec_func)(riscv_cpu *cpu);
     riscv_instr_desc *next;
     char *entry_name;
+    riscv_op op;
 } riscv_instr_entry;
 
-bool init_cpu(riscv_cpu *cpu, const char *filename, const char *rfs_name);
+bool init_cpu(riscv_cpu *cpu,
+              const char *filename,
+              const char *rfs_name,
+              const riscv_config *config);
+bool restore_cpu(riscv_cpu *cpu);
 void cpu_set_debug_mode(riscv_cpu *cpu, bool debug_mode);
 uint64_t read_cpu(riscv_cpu *cpu, uint64_t addr, uint8_t size);
 bool write_cpu(riscv_cpu *cpu, uint64_t addr, uint8_t size, uint64_t value);
+uint64_t read_cpu_debug(riscv_cpu *cpu, uint64_t addr, uint8_t size);
+bool write_cpu_debug(riscv_cpu *cpu,
+                     uint64_t addr,
+                     uint8_t size,
+                     uint64_t value);
 bool step_cpu(riscv_cpu *cpu);
+riscv_exec_func instr_exec_func(riscv_instr *instr);
 void free_cpu(riscv_cpu *cpu);
 #endif
@@ -68,10 +68,8 @@
 
 // Cycle counter for RDCYCLE instruction.
 #define CYCLE 0xc00
-/* FIXME:
- * 1. timer should be simulated for this register
- * 2. should we invalid write for this register? */
-// Timer for RDTIME instruction.
+/* FIXME: should we invalid write for this register? */
+// Timer for RDTIME instruction, which is read from mtime in Clint.
 #define TIME 0xc01
 
 // SSTATUS fields
@@ -121,6 +119,9 @@
 
 // SATP fields
 #define SATP_PPN 0xfffffffffffUL
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID (0xffffUL << SATP_ASID_SHIFT)
+#define SATP_MODE_SHIFT 60
 
 // mask for csr delegable interrupt:
 // - https://github.com/qemu/qemu/blob/master/target/riscv/csr.c
@@ -141,12 +142,15 @@
 #define check_csr_bit(csr, reg, mask) (!!((read_csr(csr, reg) & mask)))
 
 typedef struct {
+    /* Whether the registers which decide the interrupt to take have been
+     * written since the last check. The privilege mode is always changed
+     * together with the status register, so it's covered as well. */
+    bool irq_changed;
     uint64_t reg[CSR_CAPACITY];
 } riscv_csr;
 
 bool init_csr(riscv_csr *csr);
 uint64_t read_csr(riscv_csr *csr, uint16_t addr);
 void write_csr(riscv_csr *csr, uint16_t addr, uint64_t value);
-void tick_csr(riscv_csr *csr);
 
 #endif
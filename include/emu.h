@@ -2,10 +2,15 @@
 #define RISCV_EMU
 
 #include "common.h"
+#include "config.h"
 
 typedef struct Emu riscv_emu;
 
-riscv_emu *create_emu(const char *filename, const char *rfs_name);
+riscv_emu *create_emu(const char *filename,
+                      const char *rfs_name,
+                      const riscv_config *config);
+bool reset_emu(riscv_emu *emu);
+void fetch_dirty_emu(riscv_emu *emu, uint64_t *bitmap);
 void run_emu(riscv_emu *emu);
 void run_emu_debug(riscv_emu *emu);
 int test_emu(riscv_emu *emu);
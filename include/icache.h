@@ -5,34 +5,38 @@
 
 #ifdef ICACHE_CONFIG
 
-#define CACHE_INDEX_BIT 3
-#define CACHE_SET_CNT (1 << CACHE_INDEX_BIT)
-#define CACHE_WAY_CNT 4
-
 #include <stdbool.h>
 
-struct ICACHE_ENTRY {
+// the pseudo-LRU bits of a set are kept in a 64 bits integer
+#define ICACHE_MAX_WAY_CNT 64
+
+typedef struct {
     riscv_instr instr;
-    bool valid;
+    // the physical address of the instruction
     uint64_t tag;
+    bool valid;
+} riscv_icache_entry;
 
-    struct ICACHE_ENTRY *next;
-};
-typedef struct ICACHE_ENTRY riscv_icache_entry;
-
+/* The entries are kept in a contiguous array, where the ways of a set are
+ * next to each other. The replacement policy is the bit pseudo-LRU: each set
+ * has one bit for each way, which is set when the way is accessed. If all of
+ * the bits are set, the others are cleared. The victim is then the first way
+ * whose bit is cleared. */
 typedef struct {
-    riscv_icache_entry *head;
-} riscv_icache_set;
+    riscv_icache_entry *entry;
+    uint64_t *mru;
 
-typedef struct {
-    riscv_icache_set set[CACHE_SET_CNT];
+    uint32_t set_cnt;
+    uint32_t way_cnt;
+
+    // the epoch of block cache when the cache is flushed last time
+    uint64_t epoch;
 } riscv_icache;
 
-bool init_icache(riscv_icache *icache);
-riscv_instr *read_icache(riscv_icache *icache, uint64_t addr);
-void write_icache(riscv_icache *icache, uint64_t addr, riscv_instr instr);
+bool init_icache(riscv_icache *icache, uint32_t set_cnt, uint32_t way_cnt);
+riscv_instr *read_icache(riscv_icache *icache, uint64_t paddr);
+void write_icache(riscv_icache *icache, uint64_t paddr, riscv_instr *instr);
 void invalid_icache(riscv_icache *icache);
-void invalid_icache_by_vaddr(riscv_icache *icache, uint64_t vaddr);
 void free_icache(riscv_icache *icache);
 
 #endif /* ICACHE_CONFIG */
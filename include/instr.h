@@ -1,30 +1,151 @@
 #ifndef RISCV_INSTR
 #define RISCV_INSTR
 
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef struct CPU riscv_cpu;
 
-/* FIXME: we are able to consider space complexity here:
- *  1. save more space by bit field
- *  2. we don't need that many funct* for each bits length */
+/* The operations which are handled specially by the JIT compiler and the
+ * threaded interpreter. The other instructions are all OP_CALL, which are
+ * executed by calling their handler. */
+typedef enum {
+    OP_CALL = 0,
+    OP_LUI,
+    OP_AUIPC,
+    OP_ADDI,
+    OP_SLTI,
+    OP_SLTIU,
+    OP_XORI,
+    OP_ORI,
+    OP_ANDI,
+    OP_SLLI,
+    OP_SRLI,
+    OP_SRAI,
+    OP_ADD,
+    OP_SUB,
+    OP_SLL,
+    OP_SLT,
+    OP_SLTU,
+    OP_XOR,
+    OP_SRL,
+    OP_SRA,
+    OP_OR,
+    OP_AND,
+    OP_MUL,
+    OP_ADDIW,
+    OP_SLLIW,
+    OP_SRLIW,
+    OP_SRAIW,
+    OP_ADDW,
+    OP_SUBW,
+    OP_SLLW,
+    OP_SRLW,
+    OP_SRAW,
+    OP_MULW,
+    OP_LB,
+    OP_LH,
+    OP_LW,
+    OP_LD,
+    OP_LBU,
+    OP_LHU,
+    OP_LWU,
+    OP_SB,
+    OP_SH,
+    OP_SW,
+    OP_SD,
+    OP_BEQ,
+    OP_BNE,
+    OP_BLT,
+    OP_BGE,
+    OP_BLTU,
+    OP_BGEU,
+    OP_JAL,
+    OP_JALR,
+
+    /* The specialized forms of the instructions with special operands, which
+     * are selected by the decoder */
+    OP_NOP,  // write x0 without other side effect
+    OP_LI,   // addi rd, x0, imm
+    OP_MV,   // addi rd, rs1, 0 and add rd, rs1, x0
+    OP_J,    // jal x0, offset
+    OP_JR,   // jalr x0, offset(rs1), which includes ret
+
+    /* The pairs of adjacent instructions which are fused into one operation.
+     * The first instruction of the pair is replaced by the fused operation,
+     * and the second one is executed along with it. */
+    OP_LUI_ADDI,
+    OP_LUI_ADDIW,
+    OP_AUIPC_ADDI,
+    OP_AUIPC_LD,
+    OP_AUIPC_JALR,
+    OP_SLLI_SRLI,
+    OP_SLT_BEQ,
+    OP_SLT_BNE,
+    OP_SLTU_BEQ,
+    OP_SLTU_BNE,
+} riscv_op;
+
+#define OP_SPECIAL_START OP_NOP
+#define OP_SPECIAL_CNT (OP_JR - OP_NOP + 1)
+
+#define OP_FUSED_START OP_LUI_ADDI
+#define OP_FUSED_CNT (OP_SLTU_BNE - OP_LUI_ADDI + 1)
+
+typedef void (*riscv_exec_func)(riscv_cpu *cpu);
+
+/* The decoded instruction, which is kept small so more of them can fit in a
+ * cache line. The fields which are only used to find out the instruction,
+ * for example funct3 and funct7, are dropped after decoding. */
 typedef struct {
+    // the raw bits of the instruction
     uint32_t instr;
-    uint8_t opcode;
+    /* The sign-extended immediate. Note that it is the zero-extended CSR
+     * address for the CSR instructions. */
+    int32_t imm;
+    // the index of the handler in the handler table of CPU
+    uint16_t handler;
+    uint8_t op;
     uint8_t rd;
     uint8_t rs1;
     uint8_t rs2;
-    uint64_t imm;
-    uint8_t funct2;
-    uint8_t funct3;
-    uint8_t width;
-    uint8_t funct4;
-    uint8_t funct6;
-    uint8_t funct7;
-
-    void (*exec_func)(riscv_cpu *cpu);
 } riscv_instr;
 
+static inline bool is_fused_op(uint8_t op)
+{
+    return op >= OP_FUSED_START;
+}
+
+// the operation of the first instruction in the fused pair
+static inline riscv_op fused_first_op(uint8_t op)
+{
+    switch (op) {
+    case OP_LUI_ADDI:
+    case OP_LUI_ADDIW:
+        return OP_LUI;
+    case OP_AUIPC_ADDI:
+    case OP_AUIPC_LD:
+    case OP_AUIPC_JALR:
+        return OP_AUIPC;
+    case OP_SLLI_SRLI:
+        return OP_SLLI;
+    case OP_SLT_BEQ:
+    case OP_SLT_BNE:
+        return OP_SLT;
+    case OP_SLTU_BEQ:
+    case OP_SLTU_BNE:
+        return OP_SLTU;
+    default:
+        return op;
+    }
+}
+
+// the length of instruction in bytes
+static inline int instr_len(riscv_instr *instr)
+{
+    return (instr->instr & 0x3) == 0x3 ? 4 : 2;
+}
+
 void R_decode(riscv_instr *instr);
 void I_decode(riscv_instr *instr);
 void P_decode(riscv_instr *instr);
@@ -32,17 +153,7 @@ void S_decode(riscv_instr *instr);
 void B_decode(riscv_instr *instr);
 void U_decode(riscv_instr *instr);
 void J_decode(riscv_instr *instr);
-void Cx_decode(riscv_instr *instr);
-void Cxx_decode(riscv_instr *instr);
-void CIW_decode(riscv_instr *instr);
-void CL_decode(riscv_instr *instr);
-void CS_decode(riscv_instr *instr);
-void CI_decode(riscv_instr *instr);
-void CSS_decode(riscv_instr *instr);
-void CJ_decode(riscv_instr *instr);
-void CB_decode(riscv_instr *instr);
-void CA_decode(riscv_instr *instr);
-void CR_decode(riscv_instr *instr);
 void FS_decode(riscv_instr *instr);
+uint32_t C_expand(uint16_t instr);
 
 #endif
@@ -0,0 +1,31 @@
+#ifndef RISCV_JIT
+#define RISCV_JIT
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "block.h"
+
+/* The JIT compiler translates a block into host instructions after the block
+ * has been executed JIT_HOT_THRESHOLD times by the interpreter. Only the
+ * x86-64 host is supported now. */
+
+#define JIT_HOT_THRESHOLD 32
+// the size of the executable memory where the translated code lives
+#define JIT_CODE_SIZE (16 << 20)
+
+/* The translated block returns the number of the executed instructions. If an
+ * exception is raised, the faulting instruction is also counted. */
+typedef uint64_t (*jit_func)(riscv_cpu *cpu);
+
+typedef struct {
+    uint8_t *code;
+    uint64_t used;
+} riscv_jit;
+
+bool init_jit(riscv_jit *jit);
+jit_func translate_jit(riscv_jit *jit, riscv_block *block);
+void invalid_jit(riscv_jit *jit);
+void free_jit(riscv_jit *jit);
+
+#endif
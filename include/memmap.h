@@ -4,10 +4,9 @@
 /* We define the memory mapping and mapping size according this:
  * - https://github.com/qemu/qemu/blob/master/hw/riscv/virt.c*/
 
-/// Default memory size (128 MiB)
-#define DRAM_SIZE 0x8000000UL
+/// Default memory size (128 MiB), which can be changed by option --memory
+#define DRAM_DEFAULT_SIZE 0x8000000UL
 #define DRAM_BASE 0x80000000UL
-#define DRAM_END (DRAM_BASE + DRAM_SIZE)
 
 #define CLINT_BASE 0x2000000UL
 #define CLINT_END (CLINT_BASE + 0x10000)
@@ -1,22 +1,40 @@
 #ifndef RISCV_MEM
 #define RISCV_MEM
 
+#include <assert.h>
+#include <endian.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "elf_parser.h"
 #include "exception.h"
+#include "memmap.h"
+
+// the size of page which is tracked by the dirty bitmap
+#define MEM_DIRTY_SHIFT 12
 
 typedef struct {
     elf_t elf;
     uint8_t *mem;
+    // the size of DRAM, which is a multiple of page size
+    uint64_t size;
+    // the end of the loaded image from the start of DRAM
+    uint64_t image_size;
+    // whether DRAM is mapped from the snapshot
+    bool snapshot;
+    // one bit for each page of DRAM, which is set if the page is written
+    uint64_t *dirty_map;
     uint64_t sig_start;
     uint64_t sig_end;
     uint64_t tohost_addr;
 } riscv_mem;
 
 uint64_t get_entry_addr();
-bool init_mem(riscv_mem *mem, const char *filename);
+bool init_mem(riscv_mem *mem, const char *filename, uint64_t size);
+bool snapshot_mem(riscv_mem *mem);
+bool restore_mem(riscv_mem *mem);
+void fetch_dirty_mem(riscv_mem *mem, uint64_t *bitmap);
 uint64_t read_mem(riscv_mem *mem,
                   uint64_t addr,
                   uint64_t size,
@@ -27,4 +45,101 @@ bool write_mem(riscv_mem *mem,
                uint64_t value,
                riscv_exception *exc);
 void free_memory(riscv_mem *mem);
+
+// the end of physical address of DRAM
+static inline uint64_t mem_end(riscv_mem *mem)
+{
+    return DRAM_BASE + mem->size;
+}
+
+// the number of 64 bits words in the dirty bitmap of DRAM
+static inline uint64_t mem_dirty_words(riscv_mem *mem)
+{
+    return ((mem->size >> MEM_DIRTY_SHIFT) + 63) / 64;
+}
+
+/* Record that the range [addr, addr + len) of DRAM is written. It should be
+ * called by every path which writes to DRAM. */
+static inline void mark_mem_dirty(riscv_mem *mem, uint64_t addr, uint64_t len)
+{
+    uint64_t first = (addr - DRAM_BASE) >> MEM_DIRTY_SHIFT;
+    uint64_t last = (addr - DRAM_BASE + len - 1) >> MEM_DIRTY_SHIFT;
+
+    for (uint64_t page = first; page <= last; page++)
+        mem->dirty_map[page >> 6] |= 1UL << (page & 63);
+}
+
+/* Whether the range [addr, addr + len) is in DRAM entirely. The host memory
+ * after DRAM is not mapped, so an access across the end must not reach it. */
+static inline bool mem_contains(riscv_mem *mem, uint64_t addr, uint64_t len)
+{
+    return addr >= DRAM_BASE && addr < mem_end(mem) &&
+           len <= mem_end(mem) - addr;
+}
+
+/* Return the host address of the physical address if the range of 'len' bytes
+ * from it is in DRAM, otherwise return NULL */
+static inline uint8_t *mem_host_addr(riscv_mem *mem,
+                                     uint64_t addr,
+                                     uint64_t len)
+{
+    if (!mem_contains(mem, addr, len))
+        return NULL;
+
+    return mem->mem + (addr - DRAM_BASE);
+}
+
+/* Access the DRAM by the host address directly, which is the fast path of
+ * read_mem and write_mem */
+static inline uint64_t load_host(uint8_t *ptr, uint8_t size)
+{
+    uint16_t val16;
+    uint32_t val32;
+    uint64_t val64;
+
+    switch (size) {
+    case 8:
+        return *ptr;
+    case 16:
+        memcpy(&val16, ptr, sizeof(val16));
+        return le16toh(val16);
+    case 32:
+        memcpy(&val32, ptr, sizeof(val32));
+        return le32toh(val32);
+    case 64:
+        memcpy(&val64, ptr, sizeof(val64));
+        return le64toh(val64);
+    default:
+        assert(0);
+        return -1;
+    }
+}
+
+static inline void store_host(uint8_t *ptr, uint8_t size, uint64_t value)
+{
+    uint16_t val16;
+    uint32_t val32;
+    uint64_t val64;
+
+    switch (size) {
+    case 8:
+        *ptr = value;
+        break;
+    case 16:
+        val16 = htole16(value);
+        memcpy(ptr, &val16, sizeof(val16));
+        break;
+    case 32:
+        val32 = htole32(value);
+        memcpy(ptr, &val32, sizeof(val32));
+        break;
+    case 64:
+        val64 = htole64(value);
+        memcpy(ptr, &val64, sizeof(val64));
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
 #endif
@@ -3,6 +3,10 @@
 
 #define PAGE_SHIFT 12
 
+// the bits of PTE which are updated by the page walker
+#define PTE_A (1UL << 6)
+#define PTE_D (1UL << 7)
+
 typedef struct {
     uint8_t v : 1;
     uint8_t r : 1;
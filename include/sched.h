@@ -0,0 +1,75 @@
+#ifndef RISCV_SCHED
+#define RISCV_SCHED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The scheduler keeps the deadlines of the device events, so the devices are
+ * only visited when something may happen instead of after every block. The
+ * events are kept in a min-heap ordered by the deadline, where each type of
+ * event is scheduled at most once.
+ *
+ * The time of scheduler is the clock of mtime and CSR TIME. By default, it is
+ * counted by the executed instructions. Under the host clock, it's computed
+ * from the monotonic clock of host at the frequency of mtime instead, which
+ * is only read when the time is needed. The executed instructions are still
+ * counted then, so the deadlines are checked at the blocks as usual, but the
+ * time is synchronized with the host before any event is handled. Since the
+ * emulation may be slower than mtime, the time is also synchronized by a
+ * periodic event, so the deadlines are not reached late for too long. */
+
+typedef enum {
+    // the timer interrupt of CLINT, when mtime reaches mtimecmp
+    EVENT_TIMER,
+    // the completion of the request which is notified to the virtio disk
+    EVENT_DISK,
+    // the periodic poll of the input of UART
+    EVENT_UART,
+    /* The state of devices is changed by the guest, so the interrupt lines
+     * should be updated */
+    EVENT_DEVICE,
+    // the periodic synchronization with the host, only under the host clock
+    EVENT_SYNC,
+    EVENT_CNT,
+} riscv_event_type;
+
+typedef struct {
+    uint64_t deadline;
+    riscv_event_type type;
+} riscv_event;
+
+typedef struct {
+    uint64_t now;
+    bool host_clock;
+    // the time of host in nanoseconds when the time of scheduler is 0
+    uint64_t host_base;
+    riscv_event heap[EVENT_CNT];
+    // the index of each type of event in the heap, or -1 if not scheduled
+    int pos[EVENT_CNT];
+    int cnt;
+} riscv_sched;
+
+void init_sched(riscv_sched *sched, bool host_clock);
+void sync_sched(riscv_sched *sched);
+void warp_sched(riscv_sched *sched, uint64_t ticks);
+void schedule_event(riscv_sched *sched,
+                    riscv_event_type type,
+                    uint64_t deadline);
+void cancel_event(riscv_sched *sched, riscv_event_type type);
+bool pop_event(riscv_sched *sched, riscv_event_type *type);
+
+// the current time, which is synchronized with the host under the host clock
+static inline uint64_t sched_time(riscv_sched *sched)
+{
+    if (sched->host_clock)
+        sync_sched(sched);
+    return sched->now;
+}
+
+// the earliest deadline of the events, which is never reached if there is none
+static inline uint64_t sched_deadline(riscv_sched *sched)
+{
+    return (sched->cnt > 0) ? sched->heap[0].deadline : UINT64_MAX;
+}
+
+#endif
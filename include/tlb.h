@@ -0,0 +1,145 @@
+#ifndef RISCV_TLB
+#define RISCV_TLB
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pte.h"
+
+/* The software TLB keeps the recent results of address translation, so the
+ * page table doesn't need to be walked for each memory access. The TLB is
+ * direct-mapped and indexed by the virtual page number. Since the result also
+ * depends on the type of access, each type of access has its own TLB.
+ *
+ * The entries are tagged with the ASID, so they can survive the switch of
+ * address space. A global mapping matches any ASID.
+ *
+ * The superpages are kept in a small fully-associative array, where each entry
+ * covers the whole superpage. When a superpage is hit, the 4 KiB page being
+ * accessed is also filled into the direct-mapped entries, so the following
+ * accesses to the page can be found by the fast path. */
+
+#define TLB_INDEX_BIT 8
+#define TLB_CNT (1 << TLB_INDEX_BIT)
+
+#define TLB_SUPER_CNT 16
+
+// the virtual page number of an unused entry, which never matches an address
+#define TLB_INVALID_VPN (~0UL)
+
+#define PAGE_OFFSET_MASK ((1UL << PAGE_SHIFT) - 1)
+
+typedef struct {
+    /* The virtual address shifted by the size of the page, which is 4 KiB for
+     * the direct-mapped entries and the size of superpage for the others */
+    uint64_t vpn;
+    // the physical address of the page
+    uint64_t page;
+    // the host address of the 4 KiB page if it is in DRAM, otherwise NULL
+    uint8_t *host;
+    uint16_t asid;
+    bool global;
+    // the level of the leaf PTE, which is larger than 0 for superpages
+    uint8_t level;
+} riscv_tlb_entry;
+
+typedef struct {
+    riscv_tlb_entry entry[TLB_CNT];
+    riscv_tlb_entry super[TLB_SUPER_CNT];
+    // the next superpage entry to be replaced
+    uint32_t super_victim;
+} riscv_tlb;
+
+/* The page-walk cache keeps the addresses of the page tables which are found
+ * by the non-leaf PTEs, so a walk can start from the last level table it
+ * needs instead of the root. The entry of the table at a level is keyed by the
+ * root table and the virtual page numbers of the higher levels. It is direct-
+ * mapped and shared by all types of access. */
+
+#define PWC_INDEX_BIT 6
+#define PWC_CNT (1 << PWC_INDEX_BIT)
+
+typedef struct {
+    // the physical address of the root table
+    uint64_t root;
+    // the virtual address shifted by the range covered by the table
+    uint64_t prefix;
+    // the physical address of the table
+    uint64_t table;
+    uint8_t level;
+    // whether any of the non-leaf PTEs on the way is global
+    bool global;
+    bool valid;
+} riscv_pwc_entry;
+
+typedef struct {
+    riscv_pwc_entry entry[PWC_CNT];
+} riscv_pwc;
+
+void invalid_tlb(riscv_tlb *tlb);
+void fence_tlb(riscv_tlb *tlb,
+               bool by_vaddr,
+               uint64_t vaddr,
+               bool by_asid,
+               uint16_t asid);
+riscv_tlb_entry *read_tlb_super(riscv_tlb *tlb, uint64_t vaddr, uint16_t asid);
+void invalid_pwc(riscv_pwc *pwc);
+riscv_pwc_entry *read_pwc(riscv_pwc *pwc,
+                          uint64_t root,
+                          uint64_t vaddr,
+                          int levels);
+void write_pwc(riscv_pwc *pwc,
+               uint64_t root,
+               uint64_t vaddr,
+               uint8_t level,
+               uint64_t table,
+               bool global);
+void write_tlb_super(riscv_tlb *tlb,
+                     uint64_t vaddr,
+                     uint16_t asid,
+                     bool global,
+                     uint8_t level,
+                     uint64_t page);
+
+// the shift of the page size for the leaf PTE at the level
+static inline int tlb_page_shift(uint8_t level)
+{
+    return PAGE_SHIFT + 9 * level;
+}
+
+static inline riscv_tlb_entry *read_tlb(riscv_tlb *tlb,
+                                        uint64_t vaddr,
+                                        uint16_t asid)
+{
+    uint64_t vpn = vaddr >> PAGE_SHIFT;
+    riscv_tlb_entry *entry = &tlb->entry[vpn & (TLB_CNT - 1)];
+
+    if (entry->vpn != vpn || (!entry->global && entry->asid != asid))
+        return NULL;
+
+    return entry;
+}
+
+/* Fill the entry of the 4 KiB page, which may be a part of a superpage if
+ * 'level' is larger than 0 */
+static inline riscv_tlb_entry *write_tlb(riscv_tlb *tlb,
+                                         uint64_t vaddr,
+                                         uint16_t asid,
+                                         bool global,
+                                         uint8_t level,
+                                         uint64_t page,
+                                         uint8_t *host)
+{
+    uint64_t vpn = vaddr >> PAGE_SHIFT;
+    riscv_tlb_entry *entry = &tlb->entry[vpn & (TLB_CNT - 1)];
+
+    entry->vpn = vpn;
+    entry->page = page;
+    entry->host = host;
+    entry->asid = asid;
+    entry->global = global;
+    entry->level = level;
+    return entry;
+}
+
+#endif /* RISCV_TLB */
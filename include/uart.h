@@ -109,6 +109,7 @@ uint64_t read_uart(riscv_uart *uart,
                    uint8_t size,
                    riscv_exception *exc);
 void tick_uart(riscv_uart *uart);
+bool wait_uart(riscv_uart *uart, int timeout);
 bool write_uart(riscv_uart *uart,
                 uint64_t addr,
                 uint8_t size,
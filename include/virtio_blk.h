@@ -104,9 +104,6 @@ typedef struct {
 } riscv_virtq;
 
 typedef struct {
-    uint64_t clock;
-    uint64_t notify_clock;
-
     riscv_virtq vq[1];
     uint16_t queue_sel;
     uint32_t host_features[2];
@@ -121,9 +118,11 @@ typedef struct {
     uint8_t config[8];
 
     uint8_t *rfsimg;
+    uint64_t rfsimg_size;
 } riscv_virtio_blk;
 
 bool init_virtio_blk(riscv_virtio_blk *virtio_blk, const char *rfs_name);
+bool restore_virtio_blk(riscv_virtio_blk *virtio_blk);
 uint64_t read_virtio_blk(riscv_virtio_blk *virtio_blk,
                          uint64_t addr,
                          uint8_t size,
@@ -134,7 +133,7 @@ bool write_virtio_blk(riscv_virtio_blk *virtio_blk,
                       uint64_t value,
                       riscv_exception *exc);
 bool virtio_is_interrupted(riscv_virtio_blk *virtio_blk);
-void tick_virtio_blk(riscv_virtio_blk *virtio_blk);
+void complete_virtio_blk(riscv_virtio_blk *virtio_blk);
 void free_virtio_blk(riscv_virtio_blk *virtio_blk);
 
 #endif
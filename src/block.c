@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "pte.h"
+
+#define BLOCK_ALLOC_SIZE \
+    (sizeof(riscv_block) + BLOCK_MAX_INSTR * sizeof(riscv_instr))
+
+static inline uint64_t block_index(uint64_t paddr)
+{
+    // since the address is a least 2 bytes, 1 bit is for offset
+    return ((paddr >> 1) ^ (paddr >> (1 + BLOCK_INDEX_BIT))) & (BLOCK_CNT - 1);
+}
+
+static inline uint64_t block_page_index(uint64_t paddr)
+{
+    return (paddr >> PAGE_SHIFT) & (BLOCK_PAGE_CNT - 1);
+}
+
+bool init_block_cache(riscv_block_cache *cache, uint64_t dram_size)
+{
+    memset(cache->table, 0, sizeof(cache->table));
+    memset(cache->page, 0, sizeof(cache->page));
+
+    cache->pool = malloc(BLOCK_POOL_SIZE);
+    if (cache->pool == NULL)
+        return false;
+    cache->pool_used = 0;
+    cache->epoch = 0;
+    cache->link_gen = 0;
+
+    cache->dram_size = dram_size;
+    cache->chunk_cnt = dram_size >> BLOCK_CHUNK_SHIFT;
+    cache->code_map = calloc(cache->chunk_cnt / 64, sizeof(uint64_t));
+    if (cache->code_map == NULL) {
+        free(cache->pool);
+        return false;
+    }
+
+    return true;
+}
+
+riscv_block *read_block_cache(riscv_block_cache *cache,
+                              uint64_t paddr,
+                              uint64_t tag)
+{
+    riscv_block *block = cache->table[block_index(paddr)];
+
+    if (block != NULL && block->valid && block->paddr == paddr &&
+        block->tag == tag)
+        return block;
+
+    return NULL;
+}
+
+/* Return the space for a block with at most BLOCK_MAX_INSTR instructions. The
+ * space is only taken after the block is written by write_block_cache, so
+ * it is fine to drop the returned block if we fail to build it. */
+riscv_block *alloc_block(riscv_block_cache *cache)
+{
+    // drop all the blocks if there is no enough space for a new one
+    if (cache->pool_used + BLOCK_ALLOC_SIZE > BLOCK_POOL_SIZE)
+        invalid_block_cache(cache);
+
+    return (riscv_block *) (cache->pool + cache->pool_used);
+}
+
+void write_block_cache(riscv_block_cache *cache, riscv_block *block)
+{
+    uint64_t index = block_index(block->paddr);
+
+    // the replaced block may still be referenced, mark it as stale
+    if (cache->table[index] != NULL)
+        cache->table[index]->valid = false;
+
+    block->valid = true;
+    cache->table[index] = block;
+
+    uint64_t page_index = block_page_index(block->paddr);
+    block->page_next = cache->page[page_index];
+    cache->page[page_index] = block;
+
+    uint64_t block_size =
+        sizeof(riscv_block) + block->instr_cnt * sizeof(riscv_instr);
+    cache->pool_used += (block_size + 7) & ~7UL;
+
+    // record the chunks which contain the instructions of the block
+    mark_block_cache_code(cache, block->paddr, block->size);
+}
+
+/* Record that the range [paddr, paddr + len) contains decoded instructions, so
+ * the writes to the range will be noticed */
+void mark_block_cache_code(riscv_block_cache *cache,
+                           uint64_t paddr,
+                           uint64_t len)
+{
+    if (paddr < DRAM_BASE || paddr - DRAM_BASE >= cache->dram_size || len == 0)
+        return;
+
+    uint64_t first = (paddr - DRAM_BASE) >> BLOCK_CHUNK_SHIFT;
+    uint64_t last = (paddr - DRAM_BASE + len - 1) >> BLOCK_CHUNK_SHIFT;
+    if (last >= cache->chunk_cnt)
+        last = cache->chunk_cnt - 1;
+
+    for (uint64_t chunk = first; chunk <= last; chunk++)
+        cache->code_map[chunk >> 6] |= 1UL << (chunk & 63);
+}
+
+void invalid_block_cache(riscv_block_cache *cache)
+{
+    for (int i = 0; i < BLOCK_CNT; i++) {
+        if (cache->table[i] != NULL)
+            cache->table[i]->valid = false;
+    }
+    memset(cache->table, 0, sizeof(cache->table));
+    memset(cache->page, 0, sizeof(cache->page));
+    memset(cache->code_map, 0, cache->chunk_cnt / 8);
+    cache->pool_used = 0;
+    cache->epoch++;
+    // the space of the linked blocks will be reused
+    unlink_block_cache(cache);
+}
+
+/* Drop the blocks in the list of the page which overlap with the range
+ * [start, end). The blocks which are dropped already are removed from the list
+ * along the way. */
+static void invalid_block_page(riscv_block_cache *cache,
+                               uint64_t page,
+                               uint64_t start,
+                               uint64_t end)
+{
+    riscv_block **next = &cache->page[block_page_index(page)];
+
+    while (*next != NULL) {
+        riscv_block *block = *next;
+
+        if (block->valid && block->paddr < end &&
+            block->paddr + block->size > start) {
+            uint64_t index = block_index(block->paddr);
+            if (cache->table[index] == block)
+                cache->table[index] = NULL;
+            block->valid = false;
+        }
+
+        if (!block->valid)
+            *next = block->page_next;
+        else
+            next = &block->page_next;
+    }
+}
+
+void __invalid_block_cache_by_paddr(riscv_block_cache *cache,
+                                    uint64_t paddr,
+                                    uint64_t len)
+{
+    uint64_t first = (paddr - DRAM_BASE) >> BLOCK_CHUNK_SHIFT;
+    uint64_t last = (paddr - DRAM_BASE + len - 1) >> BLOCK_CHUNK_SHIFT;
+    if (last >= cache->chunk_cnt)
+        last = cache->chunk_cnt - 1;
+
+    bool has_code = false;
+    for (uint64_t chunk = first; chunk <= last; chunk++) {
+        if (block_chunk_has_code(cache, chunk)) {
+            has_code = true;
+            break;
+        }
+    }
+    if (!has_code)
+        return;
+
+    cache->epoch++;
+
+    /* Drop all the blocks in the written pages instead of only the written
+     * chunks. Once a page is overwritten, it is likely that the rest of the
+     * page will be overwritten soon, so we don't have to search the cache
+     * again for each of the following stores. */
+    uint64_t page_start = paddr & ~((1UL << PAGE_SHIFT) - 1);
+    uint64_t page_end = ((paddr + len - 1) | ((1UL << PAGE_SHIFT) - 1)) + 1;
+
+    /* The last instruction of a block may cross the page, so the blocks which
+     * start in the previous page are checked too */
+    uint64_t page = page_start - (1UL << PAGE_SHIFT);
+    for (; page < page_end; page += 1UL << PAGE_SHIFT)
+        invalid_block_page(cache, page, page_start, page_end);
+
+    first = (page_start - DRAM_BASE) >> BLOCK_CHUNK_SHIFT;
+    last = (page_end - DRAM_BASE - 1) >> BLOCK_CHUNK_SHIFT;
+    if (last >= cache->chunk_cnt)
+        last = cache->chunk_cnt - 1;
+
+    for (uint64_t chunk = first; chunk <= last; chunk++)
+        cache->code_map[chunk >> 6] &= ~(1UL << (chunk & 63));
+}
+
+void free_block_cache(riscv_block_cache *cache)
+{
+    free(cache->pool);
+    free(cache->code_map);
+}
@@ -1,10 +1,32 @@
 #include <string.h>
+#include <time.h>
 
 #include "bus.h"
 
-bool init_bus(riscv_bus *bus, const char *filename, const char *rfs_name)
+// the interval to poll the input of UART, which is 1 ms for 10 MHz timebase
+#define UART_POLL_INTERVAL 10000
+// the longest time to wait on the host at once, which is 100 ms
+#define IDLE_MAX_INTERVAL 1000000
+/* The interval to synchronize the time with the host clock, which is 100 us.
+ * It bounds how late an event is handled if the emulation is slow. */
+#define SYNC_INTERVAL 1000
+
+static void init_bus_events(riscv_bus *bus, bool host_clock)
+{
+    init_sched(&bus->sched, host_clock);
+    // the input is polled on the first tick
+    schedule_event(&bus->sched, EVENT_UART, 0);
+    if (host_clock)
+        schedule_event(&bus->sched, EVENT_SYNC, SYNC_INTERVAL);
+}
+
+bool init_bus(riscv_bus *bus,
+              const char *filename,
+              const char *rfs_name,
+              uint64_t mem_size,
+              bool host_clock)
 {
-    if (!init_mem(&bus->memory, filename))
+    if (!init_mem(&bus->memory, filename, mem_size))
         return false;
 
     /* since the initialize of CLINT / PLIC is simple, we don't put it to
@@ -21,28 +43,76 @@ bool init_bus(riscv_bus *bus, const char *filename, const char *rfs_name)
     if (!init_boot(&bus->boot, get_entry_addr()))
         return false;
 
+    init_bus_events(bus, host_clock);
     return true;
 }
 
+/* Restore the devices to the state after initialization, where DRAM is
+ * restored to its snapshot. The boot ROM is never written, so it is kept. */
+bool restore_bus(riscv_bus *bus)
+{
+    if (!restore_mem(&bus->memory))
+        return false;
+
+    memset(&bus->clint, 0, sizeof(riscv_clint));
+    memset(&bus->plic, 0, sizeof(riscv_plic));
+
+    if (!init_uart(&bus->uart))
+        return false;
+
+    init_bus_events(bus, bus->sched.host_clock);
+    return restore_virtio_blk(&bus->virtio_blk);
+}
+
+/* The access to a device may change its state, so the interrupt lines of the
+ * devices are updated after the block. The deadline is always reached, even
+ * if the time is synchronized with the host clock then. */
+static inline void touch_device(riscv_bus *bus)
+{
+    schedule_event(&bus->sched, EVENT_DEVICE, 0);
+}
+
+/* Schedule the timer interrupt at the time when mtime reaches mtimecmp. If
+ * mtime is not less than mtimecmp already, the interrupt is posted after the
+ * current block. */
+static void schedule_timer(riscv_bus *bus)
+{
+    uint64_t now = sched_time(&bus->sched);
+    uint64_t delay = clint_timer_delay(&bus->clint, now);
+
+    if (delay != UINT64_MAX)
+        schedule_event(&bus->sched, EVENT_TIMER, now + delay);
+    else
+        cancel_event(&bus->sched, EVENT_TIMER);
+}
+
 uint64_t read_bus(riscv_bus *bus,
                   uint64_t addr,
                   uint8_t size,
                   riscv_exception *exc)
 {
+    // DRAM is the most frequently accessed, so it is checked first
+    if (mem_contains(&bus->memory, addr, size >> 3))
+        return read_mem(&bus->memory, addr, size, exc);
+
     if (addr >= CLINT_BASE && addr < CLINT_END)
-        return read_clint(&bus->clint, addr, size, exc);
+        return read_clint(&bus->clint, addr, size, sched_time(&bus->sched),
+                          exc);
 
-    if (addr >= PLIC_BASE && addr < PLIC_END)
+    if (addr >= PLIC_BASE && addr < PLIC_END) {
+        touch_device(bus);
         return read_plic(&bus->plic, addr, size, exc);
+    }
 
-    if (addr >= UART_BASE && addr < UART_END)
+    if (addr >= UART_BASE && addr < UART_END) {
+        touch_device(bus);
         return read_uart(&bus->uart, addr, size, exc);
+    }
 
-    if (addr >= VIRTIO_BASE && addr < VIRTIO_END)
+    if (addr >= VIRTIO_BASE && addr < VIRTIO_END) {
+        touch_device(bus);
         return read_virtio_blk(&bus->virtio_blk, addr, size, exc);
-
-    if (addr >= DRAM_BASE && addr < DRAM_END)
-        return read_mem(&bus->memory, addr, size, exc);
+    }
 
     if ((addr >= BOOT_ROM_BASE) &&
         (addr < (BOOT_ROM_BASE + bus->boot.boot_mem_size)))
@@ -60,33 +130,131 @@ bool write_bus(riscv_bus *bus,
                uint64_t value,
                riscv_exception *exc)
 {
-    if (addr >= CLINT_BASE && addr < CLINT_END)
-        return write_clint(&bus->clint, addr, size, value, exc);
+    if (mem_contains(&bus->memory, addr, size >> 3))
+        return write_mem(&bus->memory, addr, size, value, exc);
+
+    if (addr >= CLINT_BASE && addr < CLINT_END) {
+        bool ret = write_clint(&bus->clint, addr, size, value,
+                               sched_time(&bus->sched), exc);
+        schedule_timer(bus);
+        touch_device(bus);
+        return ret;
+    }
 
-    if (addr >= PLIC_BASE && addr < PLIC_END)
+    if (addr >= PLIC_BASE && addr < PLIC_END) {
+        touch_device(bus);
         return write_plic(&bus->plic, addr, size, value, exc);
+    }
 
-    if (addr >= UART_BASE && addr < UART_END)
+    if (addr >= UART_BASE && addr < UART_END) {
+        touch_device(bus);
         return write_uart(&bus->uart, addr, size, value, exc);
+    }
 
-    if (addr >= VIRTIO_BASE && addr < VIRTIO_END)
+    if (addr >= VIRTIO_BASE && addr < VIRTIO_END) {
+        // the requests are completed after a delay since they are notified
+        if (addr == VIRTIO_BASE + VIRTIO_MMIO_QUEUE_NOTIFY)
+            schedule_event(&bus->sched, EVENT_DISK,
+                           sched_time(&bus->sched) + DISK_DELAY);
+        touch_device(bus);
         return write_virtio_blk(&bus->virtio_blk, addr, size, value, exc);
-
-    if (addr >= DRAM_BASE && addr < DRAM_END)
-        return write_mem(&bus->memory, addr, size, value, exc);
+    }
 
     exc->exception = StoreAMOAccessFault;
     exc->value = addr;
     return false;
 }
 
-void tick_bus(riscv_bus *bus, riscv_csr *csr)
+/* Handle the events whose deadlines are reached. The interrupt lines of the
+ * devices are updated then, since any of the events may change them. */
+void __tick_bus(riscv_bus *bus, riscv_csr *csr)
 {
-    tick_uart(&bus->uart);
-    tick_clint(&bus->clint, csr);
+    riscv_event_type type;
+
+    // the events are checked against the actual time under the host clock
+    sched_time(&bus->sched);
+
+    while (pop_event(&bus->sched, &type)) {
+        switch (type) {
+        case EVENT_TIMER:
+            fire_clint_timer(&bus->clint, csr, bus->sched.now);
+            break;
+        case EVENT_DISK:
+            complete_virtio_blk(&bus->virtio_blk);
+            break;
+        case EVENT_UART:
+            tick_uart(&bus->uart);
+            schedule_event(&bus->sched, EVENT_UART,
+                           bus->sched.now + UART_POLL_INTERVAL);
+            break;
+        case EVENT_SYNC:
+            schedule_event(&bus->sched, EVENT_SYNC,
+                           bus->sched.now + SYNC_INTERVAL);
+            break;
+        default:
+            break;
+        }
+    }
+
+    update_clint(&bus->clint, csr);
     tick_plic(&bus->plic, csr, uart_is_interrupted(&bus->uart),
               virtio_is_interrupted(&bus->virtio_blk));
-    tick_virtio_blk(&bus->virtio_blk);
+}
+
+/* Wait on the host for the interval or any input of UART, and return the time
+ * passed in the cycles of mtime, which is at most the interval */
+static uint64_t wait_bus(riscv_bus *bus, uint64_t interval)
+{
+    struct timespec start, end;
+    uint64_t cycles_per_ms = CLINT_FREQ / 1000;
+
+    if (interval > IDLE_MAX_INTERVAL)
+        interval = IDLE_MAX_INTERVAL;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // round up the timeout, so the deadline is reached after the waiting
+    wait_uart(&bus->uart, (interval + cycles_per_ms - 1) / cycles_per_ms);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec -
+                  start.tv_nsec;
+    uint64_t cycles = ns / (1000000000UL / CLINT_FREQ);
+    return (cycles > interval) ? interval : cycles;
+}
+
+/* Let the time pass until the deadline of the next event or any input of UART,
+ * and return the time passed in the cycles of mtime. The host waits for them
+ * normally, while the time jumps to the deadline directly under time warp if
+ * there is no input to receive. The input is waited directly, so UART isn't
+ * polled periodically during the idle time, and the time doesn't need to be
+ * synchronized with the host periodically either. */
+uint64_t idle_bus(riscv_bus *bus, bool warp)
+{
+    riscv_sched *sched = &bus->sched;
+
+    cancel_event(sched, EVENT_UART);
+    cancel_event(sched, EVENT_SYNC);
+
+    uint64_t now = sched_time(sched);
+    uint64_t deadline = sched_deadline(sched);
+    uint64_t interval = 0;
+    if (deadline > now)
+        interval = deadline - now;
+
+    uint64_t cycles;
+    // without any event, only the input can wake up the hart
+    if (warp && deadline != UINT64_MAX && !wait_uart(&bus->uart, 0)) {
+        cycles = interval;
+        warp_sched(sched, cycles);
+    } else {
+        cycles = wait_bus(bus, interval);
+    }
+
+    // the input is received as soon as the idle time is over
+    schedule_event(sched, EVENT_UART, sched->now + cycles);
+    if (sched->host_clock)
+        schedule_event(sched, EVENT_SYNC, sched->now + cycles + SYNC_INTERVAL);
+    return cycles;
 }
 
 void free_bus(riscv_bus *bus)
@@ -4,8 +4,11 @@
 uint64_t read_clint(riscv_clint *clint,
                     uint64_t addr,
                     uint8_t size,
+                    uint64_t now,
                     riscv_exception *exc)
 {
+    uint64_t mtime = clint_mtime(clint, now);
+
     if (size == 32) {
         if (addr & 0x3)
             goto read_clint_fail;
@@ -17,9 +20,9 @@ uint64_t read_clint(riscv_clint *clint,
         else if (addr == CLINT_MTIMECMP + 4)
             return (clint->mtimecmp >> 32) & 0xFFFFFFFF;
         else if (addr == CLINT_MTIME)
-            return clint->mtime & 0xFFFFFFFF;
+            return mtime & 0xFFFFFFFF;
         else if (addr == CLINT_MTIME + 4)
-            return (clint->mtime >> 32) & 0xFFFFFFFF;
+            return (mtime >> 32) & 0xFFFFFFFF;
         else
             goto read_clint_fail;
     } else if (size == 64) {
@@ -29,7 +32,7 @@ uint64_t read_clint(riscv_clint *clint,
         if (addr == CLINT_MTIMECMP)
             return clint->mtimecmp;
         else if (addr == CLINT_MTIME)
-            return clint->mtime;
+            return mtime;
         else
             goto read_clint_fail;
     } else {
@@ -46,8 +49,11 @@ bool write_clint(riscv_clint *clint,
                  uint64_t addr,
                  uint8_t size,
                  uint64_t value,
+                 uint64_t now,
                  riscv_exception *exc)
 {
+    uint64_t mtime = clint_mtime(clint, now);
+
     if (size == 32) {
         if (addr & 0x3)
             goto write_clint_fail;
@@ -61,11 +67,11 @@ bool write_clint(riscv_clint *clint,
             uint64_t timecmp_lo = clint->mtimecmp & 0xFFFFFFFF;
             clint->mtimecmp = timecmp_lo | value << 32;
         } else if (addr == CLINT_MTIME) {
-            uint64_t time_hi = clint->mtime >> 32;
-            clint->mtime = time_hi << 32 | value;
+            uint64_t time_hi = mtime >> 32;
+            clint->mtime_offset = (time_hi << 32 | value) - now;
         } else if (addr == CLINT_MTIME + 4) {
-            uint64_t time_lo = clint->mtime & 0xFFFFFFFF;
-            clint->mtime = time_lo | value << 32;
+            uint64_t time_lo = mtime & 0xFFFFFFFF;
+            clint->mtime_offset = (time_lo | value << 32) - now;
         } else {
             goto write_clint_fail;
         }
@@ -76,7 +82,7 @@ bool write_clint(riscv_clint *clint,
         if (addr == CLINT_MTIMECMP)
             clint->mtimecmp = value;
         else if (addr == CLINT_MTIME)
-            clint->mtime = value;
+            clint->mtime_offset = value - now;
         else
             goto write_clint_fail;
     } else {
@@ -91,19 +97,33 @@ write_clint_fail:
     return false;
 }
 
-void tick_clint(riscv_clint *clint, riscv_csr *csr)
+void update_clint(riscv_clint *clint, riscv_csr *csr)
 {
-    clint->mtime++;
-
     if (clint->msip & 1)
         set_csr_bits(csr, MIP, MIP_MSIP);
+}
+
+/* A timer interrupt is posted when the mtime register contains a value
+ * greater than or equal to the value in the mtimecmp register. The interrupt
+ * remains posted until it is cleared by writing the mtimecmp register.
+ *
+ * This returns the ticks until mtime reaches mtimecmp, which is 0 if it is
+ * reached already, e.g. the host clock passes the new mtimecmp before it is
+ * written. UINT64_MAX is returned if the timer is never set. */
+uint64_t clint_timer_delay(riscv_clint *clint, uint64_t now)
+{
+    uint64_t mtime = clint_mtime(clint, now);
+
+    if (clint->mtimecmp == 0)
+        return UINT64_MAX;
+    if (mtime >= clint->mtimecmp)
+        return 0;
 
-    /* A timer interrupt is posted when the mtime register contains a value
-     * greater than or equal to the value in the mtimecmp register. The
-     * interrupt remains posted until it is cleared by writing the mtimecmp
-     * register. */
+    return clint->mtimecmp - mtime;
+}
 
-    if ((clint->mtimecmp > 0) && (clint->mtime == clint->mtimecmp)) {
+void fire_clint_timer(riscv_clint *clint, riscv_csr *csr, uint64_t now)
+{
+    if (clint->mtimecmp > 0 && clint_mtime(clint, now) >= clint->mtimecmp)
         set_csr_bits(csr, MIP, MIP_MTIP);
-    }
 }
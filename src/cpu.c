@@ -48,81 +48,89 @@
  * On the other words, use compiler other than gcc may result error!
  */
 
+/* The address of the executing instruction. Note that the pc already moved on
+ * when the instruction is executed, and the compressed instructions share the
+ * same handler with their equivalent 32 bits instructions. */
+static inline uint64_t instr_pc(riscv_cpu *cpu)
+{
+    return cpu->pc - instr_len(cpu->instr);
+}
+
 static void instr_lb(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
     uint64_t value = read_cpu(cpu, addr, 8);
     if (cpu->exc.exception != NoException) {
         assert(value == (uint64_t) -1);
         return;
     }
-    cpu->xreg[cpu->instr.rd] = ((int8_t) (value));
+    cpu->xreg[cpu->instr->rd] = ((int8_t) (value));
 }
 
 static void instr_lh(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
     uint64_t value = read_cpu(cpu, addr, 16);
     if (cpu->exc.exception != NoException) {
         assert(value == (uint64_t) -1);
         return;
     }
-    cpu->xreg[cpu->instr.rd] = ((int16_t) (value));
+    cpu->xreg[cpu->instr->rd] = ((int16_t) (value));
 }
 
 static void instr_lw(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
     uint64_t value = read_cpu(cpu, addr, 32);
     if (cpu->exc.exception != NoException) {
         assert(value == (uint64_t) -1);
         return;
     }
-    cpu->xreg[cpu->instr.rd] = ((int32_t) (value));
+    cpu->xreg[cpu->instr->rd] = ((int32_t) (value));
 }
 
 static void instr_ld(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
     uint64_t value = read_cpu(cpu, addr, 64);
     if (cpu->exc.exception != NoException) {
         assert(value == (uint64_t) -1);
         return;
     }
-    cpu->xreg[cpu->instr.rd] = value;
+    cpu->xreg[cpu->instr->rd] = value;
 }
 
 static void instr_lbu(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
     uint64_t value = read_cpu(cpu, addr, 8);
     if (cpu->exc.exception != NoException) {
         assert(value == (uint64_t) -1);
         return;
     }
-    cpu->xreg[cpu->instr.rd] = value;
+    cpu->xreg[cpu->instr->rd] = value;
 }
 
 static void instr_lhu(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
     uint64_t value = read_cpu(cpu, addr, 16);
     if (cpu->exc.exception != NoException) {
         assert(value == (uint64_t) -1);
         return;
     }
-    cpu->xreg[cpu->instr.rd] = value;
+    cpu->xreg[cpu->instr->rd] = value;
 }
 
 static void instr_lwu(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
     uint64_t value = read_cpu(cpu, addr, 32);
     if (cpu->exc.exception != NoException) {
         assert(value == (uint64_t) -1);
         return;
     }
-    cpu->xreg[cpu->instr.rd] = value;
+    cpu->xreg[cpu->instr->rd] = value;
 }
 
 static void instr_fence(__attribute__((unused)) riscv_cpu *cpu)
@@ -136,7 +144,10 @@ static void instr_fencei(__attribute__((unused)) riscv_cpu *cpu)
     /* A FENCE.I instruction ensures that a subsequent instruction fetch on a
      * RISC-V
      * hart will see any previous data stores already visible to the same RISC-V
-     * hart. */
+     * hart.
+     *
+     * The blocks are dropped as soon as their instructions are overwritten,
+     * so only the instruction cache should be flushed here. */
 #ifdef ICACHE_CONFIG
     invalid_icache(&cpu->icache);
 #endif
@@ -144,97 +155,97 @@ static void instr_fencei(__attribute__((unused)) riscv_cpu *cpu)
 
 static void instr_addi(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
+    cpu->xreg[cpu->instr->rd] = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
 }
 
 static void instr_slli(riscv_cpu *cpu)
 {
     // shift amount is the lower 6 bits of immediate
-    uint32_t shamt = (cpu->instr.imm & 0x3f);
-    cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rs1] << shamt;
+    uint32_t shamt = (cpu->instr->imm & 0x3f);
+    cpu->xreg[cpu->instr->rd] = cpu->xreg[cpu->instr->rs1] << shamt;
 }
 
 static void instr_mulh(riscv_cpu *cpu)
 {
     /* FIXME: we are using the gcc extension, maybe we'll need another
      * portable version */
-    int64_t rs1 = cpu->xreg[cpu->instr.rs1];
-    int64_t rs2 = cpu->xreg[cpu->instr.rs2];
+    int64_t rs1 = cpu->xreg[cpu->instr->rs1];
+    int64_t rs2 = cpu->xreg[cpu->instr->rs2];
 
     __int128_t result = (__int128_t) rs1 * (__int128_t) rs2;
-    cpu->xreg[cpu->instr.rd] = result >> 64;
+    cpu->xreg[cpu->instr->rd] = result >> 64;
 }
 
 static void instr_slti(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] =
-        ((int64_t) cpu->xreg[cpu->instr.rs1] < (int64_t) cpu->instr.imm) ? 1
+    cpu->xreg[cpu->instr->rd] =
+        ((int64_t) cpu->xreg[cpu->instr->rs1] < (int64_t) cpu->instr->imm) ? 1
                                                                          : 0;
 }
 
 static void instr_sltiu(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] =
-        (cpu->xreg[cpu->instr.rs1] < cpu->instr.imm) ? 1 : 0;
+    cpu->xreg[cpu->instr->rd] =
+        (cpu->xreg[cpu->instr->rs1] < (uint64_t) cpu->instr->imm) ? 1 : 0;
 }
 
 static void instr_xori(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rs1] ^ cpu->instr.imm;
+    cpu->xreg[cpu->instr->rd] = cpu->xreg[cpu->instr->rs1] ^ cpu->instr->imm;
 }
 
 static void instr_srli(riscv_cpu *cpu)
 {
     // shift amount is the lower 6 bits of immediate
-    uint32_t shamt = (cpu->instr.imm & 0x3f);
-    cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rs1] >> shamt;
+    uint32_t shamt = (cpu->instr->imm & 0x3f);
+    cpu->xreg[cpu->instr->rd] = cpu->xreg[cpu->instr->rs1] >> shamt;
 }
 
 static void instr_srai(riscv_cpu *cpu)
 {
     // shift amount is the lower 6 bits of immediate
-    uint32_t shamt = (cpu->instr.imm & 0x3f);
-    cpu->xreg[cpu->instr.rd] = (int64_t) (cpu->xreg[cpu->instr.rs1]) >> shamt;
+    uint32_t shamt = (cpu->instr->imm & 0x3f);
+    cpu->xreg[cpu->instr->rd] = (int64_t) (cpu->xreg[cpu->instr->rs1]) >> shamt;
 }
 
 static void instr_ori(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rs1] | cpu->instr.imm;
+    cpu->xreg[cpu->instr->rd] = cpu->xreg[cpu->instr->rs1] | cpu->instr->imm;
 }
 
 static void instr_andi(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rs1] & cpu->instr.imm;
+    cpu->xreg[cpu->instr->rd] = cpu->xreg[cpu->instr->rs1] & cpu->instr->imm;
 }
 
 static void instr_add(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] =
-        cpu->xreg[cpu->instr.rs1] + cpu->xreg[cpu->instr.rs2];
+    cpu->xreg[cpu->instr->rd] =
+        cpu->xreg[cpu->instr->rs1] + cpu->xreg[cpu->instr->rs2];
 }
 
 static void instr_mul(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] =
-        cpu->xreg[cpu->instr.rs1] * cpu->xreg[cpu->instr.rs2];
+    cpu->xreg[cpu->instr->rd] =
+        cpu->xreg[cpu->instr->rs1] * cpu->xreg[cpu->instr->rs2];
 }
 
 static void instr_sub(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] =
-        cpu->xreg[cpu->instr.rs1] - cpu->xreg[cpu->instr.rs2];
+    cpu->xreg[cpu->instr->rd] =
+        cpu->xreg[cpu->instr->rs1] - cpu->xreg[cpu->instr->rs2];
 }
 
 static void instr_sll(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rs1]
-                               << cpu->xreg[cpu->instr.rs2];
+    cpu->xreg[cpu->instr->rd] = cpu->xreg[cpu->instr->rs1]
+                               << cpu->xreg[cpu->instr->rs2];
 }
 
 static void instr_slt(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] = ((int64_t) cpu->xreg[cpu->instr.rs1] <
-                                (int64_t) cpu->xreg[cpu->instr.rs2])
+    cpu->xreg[cpu->instr->rd] = ((int64_t) cpu->xreg[cpu->instr->rs1] <
+                                (int64_t) cpu->xreg[cpu->instr->rs2])
                                    ? 1
                                    : 0;
 }
@@ -243,348 +254,350 @@ static void instr_mulhsu(riscv_cpu *cpu)
 {
     /* FIXME: we are using the gcc extension, maybe we'll need another
      * portable version */
-    int64_t rs1 = cpu->xreg[cpu->instr.rs1];
-    uint64_t rs2 = cpu->xreg[cpu->instr.rs2];
+    int64_t rs1 = cpu->xreg[cpu->instr->rs1];
+    uint64_t rs2 = cpu->xreg[cpu->instr->rs2];
 
     __int128_t result = (__int128_t) rs1 * (__uint128_t) rs2;
-    cpu->xreg[cpu->instr.rd] = result >> 64;
+    cpu->xreg[cpu->instr->rd] = result >> 64;
 }
 
 static void instr_sltu(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] =
-        (cpu->xreg[cpu->instr.rs1] < cpu->xreg[cpu->instr.rs2]) ? 1 : 0;
+    cpu->xreg[cpu->instr->rd] =
+        (cpu->xreg[cpu->instr->rs1] < cpu->xreg[cpu->instr->rs2]) ? 1 : 0;
 }
 
 static void instr_mulhu(riscv_cpu *cpu)
 {
     /* FIXME: we are using the gcc extension, maybe we'll need another
      * portable version */
-    uint64_t rs1 = cpu->xreg[cpu->instr.rs1];
-    uint64_t rs2 = cpu->xreg[cpu->instr.rs2];
+    uint64_t rs1 = cpu->xreg[cpu->instr->rs1];
+    uint64_t rs2 = cpu->xreg[cpu->instr->rs2];
 
     __uint128_t result = (__uint128_t) rs1 * (__uint128_t) rs2;
-    cpu->xreg[cpu->instr.rd] = result >> 64;
+    cpu->xreg[cpu->instr->rd] = result >> 64;
 }
 
 static void instr_xor(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] =
-        cpu->xreg[cpu->instr.rs1] ^ cpu->xreg[cpu->instr.rs2];
+    cpu->xreg[cpu->instr->rd] =
+        cpu->xreg[cpu->instr->rs1] ^ cpu->xreg[cpu->instr->rs2];
 }
 
 static void instr_div(riscv_cpu *cpu)
 {
-    int64_t dividend = cpu->xreg[cpu->instr.rs1];
-    int64_t divisor = cpu->xreg[cpu->instr.rs2];
+    int64_t dividend = cpu->xreg[cpu->instr->rs1];
+    int64_t divisor = cpu->xreg[cpu->instr->rs2];
 
     if (divisor == 0) {
         /* TODO: set DZ (Divide by Zero) in the FCSR */
 
         // the quotient of division by zero has all bits set
-        cpu->xreg[cpu->instr.rd] = -1;
+        cpu->xreg[cpu->instr->rd] = -1;
     } else if (dividend == INT64_MIN && divisor == -1) {
         /* 1. Signed division overflow occurs only when the most-negative
          * integer is divided by −1
          *
          * 2. The quotient of a signed division with overflow is equal to the
          * dividend*/
-        cpu->xreg[cpu->instr.rd] = dividend;
+        cpu->xreg[cpu->instr->rd] = dividend;
     } else {
-        cpu->xreg[cpu->instr.rd] = dividend / divisor;
+        cpu->xreg[cpu->instr->rd] = dividend / divisor;
     }
 }
 
 static void instr_srl(riscv_cpu *cpu)
 {
-    uint32_t shamt = (cpu->xreg[cpu->instr.rs2] & 0x3f);
-    cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rs1] >> shamt;
+    uint32_t shamt = (cpu->xreg[cpu->instr->rs2] & 0x3f);
+    cpu->xreg[cpu->instr->rd] = cpu->xreg[cpu->instr->rs1] >> shamt;
 }
 
 static void instr_divu(riscv_cpu *cpu)
 {
-    uint64_t dividend = cpu->xreg[cpu->instr.rs1];
-    uint64_t divisor = cpu->xreg[cpu->instr.rs2];
+    uint64_t dividend = cpu->xreg[cpu->instr->rs1];
+    uint64_t divisor = cpu->xreg[cpu->instr->rs2];
 
     if (divisor == 0) {
         /* TODO: set DZ (Divide by Zero) in the FCSR */
 
         // the quotient of division by zero has all bits set
-        cpu->xreg[cpu->instr.rd] = -1;
+        cpu->xreg[cpu->instr->rd] = -1;
     } else {
-        cpu->xreg[cpu->instr.rd] = dividend / divisor;
+        cpu->xreg[cpu->instr->rd] = dividend / divisor;
     }
 }
 
 static void instr_sra(riscv_cpu *cpu)
 {
     // shift amount is the low 6 bits of rs2
-    uint32_t shamt = (cpu->xreg[cpu->instr.rs2] & 0x3f);
-    cpu->xreg[cpu->instr.rd] = (int64_t) cpu->xreg[cpu->instr.rs1] >> shamt;
+    uint32_t shamt = (cpu->xreg[cpu->instr->rs2] & 0x3f);
+    cpu->xreg[cpu->instr->rd] = (int64_t) cpu->xreg[cpu->instr->rs1] >> shamt;
 }
 
 static void instr_or(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] =
-        cpu->xreg[cpu->instr.rs1] | cpu->xreg[cpu->instr.rs2];
+    cpu->xreg[cpu->instr->rd] =
+        cpu->xreg[cpu->instr->rs1] | cpu->xreg[cpu->instr->rs2];
 }
 
 static void instr_rem(riscv_cpu *cpu)
 {
-    int64_t dividend = cpu->xreg[cpu->instr.rs1];
-    int64_t divisor = cpu->xreg[cpu->instr.rs2];
+    int64_t dividend = cpu->xreg[cpu->instr->rs1];
+    int64_t divisor = cpu->xreg[cpu->instr->rs2];
 
     if (divisor == 0) {
         // the remainder of division by zero equals the dividend
-        cpu->xreg[cpu->instr.rd] = dividend;
+        cpu->xreg[cpu->instr->rd] = dividend;
     } else if (dividend == INT64_MIN && divisor == -1) {
         /* The remainder with overflow is zero. */
-        cpu->xreg[cpu->instr.rd] = 0;
+        cpu->xreg[cpu->instr->rd] = 0;
     } else {
-        cpu->xreg[cpu->instr.rd] = dividend % divisor;
+        cpu->xreg[cpu->instr->rd] = dividend % divisor;
     }
 }
 
 static void instr_and(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] =
-        cpu->xreg[cpu->instr.rs1] & cpu->xreg[cpu->instr.rs2];
+    cpu->xreg[cpu->instr->rd] =
+        cpu->xreg[cpu->instr->rs1] & cpu->xreg[cpu->instr->rs2];
 }
 
 static void instr_remu(riscv_cpu *cpu)
 {
-    uint64_t dividend = cpu->xreg[cpu->instr.rs1];
-    uint64_t divisor = cpu->xreg[cpu->instr.rs2];
+    uint64_t dividend = cpu->xreg[cpu->instr->rs1];
+    uint64_t divisor = cpu->xreg[cpu->instr->rs2];
 
     if (divisor == 0) {
         /* TODO: set DZ (Divide by Zero) in the FCSR */
 
         // the quotient of division by zero has all bits set
-        cpu->xreg[cpu->instr.rd] = dividend;
+        cpu->xreg[cpu->instr->rd] = dividend;
     } else {
-        cpu->xreg[cpu->instr.rd] = dividend % divisor;
+        cpu->xreg[cpu->instr->rd] = dividend % divisor;
     }
 }
 
 static void instr_auipc(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] = cpu->pc + cpu->instr.imm - 4;
+    cpu->xreg[cpu->instr->rd] = instr_pc(cpu) + cpu->instr->imm;
 }
 
 static void instr_addiw(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] = (int32_t) ((
-        (uint32_t) cpu->xreg[cpu->instr.rs1] + (uint32_t) cpu->instr.imm));
+    cpu->xreg[cpu->instr->rd] = (int32_t) ((
+        (uint32_t) cpu->xreg[cpu->instr->rs1] + (uint32_t) cpu->instr->imm));
 }
 
 static void instr_slliw(riscv_cpu *cpu)
 {
-    uint32_t shamt = (cpu->instr.imm & 0x1f);
-    cpu->xreg[cpu->instr.rd] =
-        (int32_t) (((uint32_t) cpu->xreg[cpu->instr.rs1] << shamt));
+    uint32_t shamt = (cpu->instr->imm & 0x1f);
+    cpu->xreg[cpu->instr->rd] =
+        (int32_t) (((uint32_t) cpu->xreg[cpu->instr->rs1] << shamt));
 }
 
 static void instr_srliw(riscv_cpu *cpu)
 {
-    uint32_t shamt = (cpu->instr.imm & 0x1f);
-    cpu->xreg[cpu->instr.rd] =
-        (int32_t) ((uint32_t) cpu->xreg[cpu->instr.rs1] >> shamt);
+    uint32_t shamt = (cpu->instr->imm & 0x1f);
+    cpu->xreg[cpu->instr->rd] =
+        (int32_t) ((uint32_t) cpu->xreg[cpu->instr->rs1] >> shamt);
 }
 
 static void instr_sraiw(riscv_cpu *cpu)
 {
-    uint32_t shamt = (cpu->instr.imm & 0x1f);
-    cpu->xreg[cpu->instr.rd] =
-        (int32_t) ((uint32_t) cpu->xreg[cpu->instr.rs1]) >> shamt;
+    uint32_t shamt = (cpu->instr->imm & 0x1f);
+    cpu->xreg[cpu->instr->rd] =
+        (int32_t) ((uint32_t) cpu->xreg[cpu->instr->rs1]) >> shamt;
 }
 
 static void instr_sb(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
-    write_cpu(cpu, addr, 8, cpu->xreg[cpu->instr.rs2]);
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
+    write_cpu(cpu, addr, 8, cpu->xreg[cpu->instr->rs2]);
 }
 
 static void instr_sh(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
-    write_cpu(cpu, addr, 16, cpu->xreg[cpu->instr.rs2]);
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
+    write_cpu(cpu, addr, 16, cpu->xreg[cpu->instr->rs2]);
 }
 
 static void instr_sw(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
-    write_cpu(cpu, addr, 32, cpu->xreg[cpu->instr.rs2]);
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
+    write_cpu(cpu, addr, 32, cpu->xreg[cpu->instr->rs2]);
 }
 
 static void instr_sd(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
-    write_cpu(cpu, addr, 64, cpu->xreg[cpu->instr.rs2]);
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
+    write_cpu(cpu, addr, 64, cpu->xreg[cpu->instr->rs2]);
 }
 
 static void instr_fsw(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
     float32_reg_t f32;
-    f32.f = cpu->freg[cpu->instr.rs2].f;
+    f32.f = cpu->freg[cpu->instr->rs2].f;
     write_cpu(cpu, addr, 32, f32.u);
 }
 
 static void instr_fsd(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + cpu->instr.imm;
-    write_cpu(cpu, addr, 64, cpu->freg[cpu->instr.rs2].u);
+    uint64_t addr = cpu->xreg[cpu->instr->rs1] + cpu->instr->imm;
+    write_cpu(cpu, addr, 64, cpu->freg[cpu->instr->rs2].u);
 }
 
 static void instr_lui(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] = cpu->instr.imm;
+    cpu->xreg[cpu->instr->rd] = cpu->instr->imm;
 }
 
 static void instr_addw(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] = (int32_t) ((uint32_t) cpu->xreg[cpu->instr.rs1] +
-                                          (uint32_t) cpu->xreg[cpu->instr.rs2]);
+    cpu->xreg[cpu->instr->rd] =
+        (int32_t) ((uint32_t) cpu->xreg[cpu->instr->rs1] +
+                   (uint32_t) cpu->xreg[cpu->instr->rs2]);
 }
 
 static void instr_mulw(riscv_cpu *cpu)
 {
-    int32_t rs1 = cpu->xreg[cpu->instr.rs1] & 0xffffffff;
-    int32_t rs2 = cpu->xreg[cpu->instr.rs2] & 0xffffffff;
-    cpu->xreg[cpu->instr.rd] = rs1 * rs2;
+    int32_t rs1 = cpu->xreg[cpu->instr->rs1] & 0xffffffff;
+    int32_t rs2 = cpu->xreg[cpu->instr->rs2] & 0xffffffff;
+    cpu->xreg[cpu->instr->rd] = rs1 * rs2;
 }
 
 static void instr_subw(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] = (int32_t) ((uint32_t) cpu->xreg[cpu->instr.rs1] -
-                                          (uint32_t) cpu->xreg[cpu->instr.rs2]);
+    cpu->xreg[cpu->instr->rd] =
+        (int32_t) ((uint32_t) cpu->xreg[cpu->instr->rs1] -
+                   (uint32_t) cpu->xreg[cpu->instr->rs2]);
 }
 
 static void instr_sllw(riscv_cpu *cpu)
 {
-    uint32_t shamt = (cpu->xreg[cpu->instr.rs2] & 0x1f);
-    cpu->xreg[cpu->instr.rd] =
-        (int32_t) ((uint32_t) cpu->xreg[cpu->instr.rs1] << shamt);
+    uint32_t shamt = (cpu->xreg[cpu->instr->rs2] & 0x1f);
+    cpu->xreg[cpu->instr->rd] =
+        (int32_t) ((uint32_t) cpu->xreg[cpu->instr->rs1] << shamt);
 }
 
 static void instr_divw(riscv_cpu *cpu)
 {
-    int32_t dividend = cpu->xreg[cpu->instr.rs1] & 0xffffffff;
-    int32_t divisor = cpu->xreg[cpu->instr.rs2] & 0xffffffff;
+    int32_t dividend = cpu->xreg[cpu->instr->rs1] & 0xffffffff;
+    int32_t divisor = cpu->xreg[cpu->instr->rs2] & 0xffffffff;
 
     if (divisor == 0) {
         /* TODO: set DZ (Divide by Zero) in the FCSR */
 
         // the quotient of division by zero has all bits set
-        cpu->xreg[cpu->instr.rd] = -1;
+        cpu->xreg[cpu->instr->rd] = -1;
     } else if (dividend == INT32_MIN && divisor == -1) {
         /* 1. Signed division overflow occurs only when the most-negative
          * integer is divided by −1
          *
          * 2. The quotient of a signed division with overflow is equal to the
          * dividend*/
-        cpu->xreg[cpu->instr.rd] = dividend;
+        cpu->xreg[cpu->instr->rd] = dividend;
     } else {
-        cpu->xreg[cpu->instr.rd] = dividend / divisor;
+        cpu->xreg[cpu->instr->rd] = dividend / divisor;
     }
 }
 
 static void instr_srlw(riscv_cpu *cpu)
 {
-    uint32_t shamt = (cpu->xreg[cpu->instr.rs2] & 0x1f);
-    cpu->xreg[cpu->instr.rd] =
-        (int32_t) ((uint32_t) cpu->xreg[cpu->instr.rs1] >> shamt);
+    uint32_t shamt = (cpu->xreg[cpu->instr->rs2] & 0x1f);
+    cpu->xreg[cpu->instr->rd] =
+        (int32_t) ((uint32_t) cpu->xreg[cpu->instr->rs1] >> shamt);
 }
 
 static void instr_divuw(riscv_cpu *cpu)
 {
-    uint32_t dividend = cpu->xreg[cpu->instr.rs1];
-    uint32_t divisor = cpu->xreg[cpu->instr.rs2];
+    uint32_t dividend = cpu->xreg[cpu->instr->rs1];
+    uint32_t divisor = cpu->xreg[cpu->instr->rs2];
 
     if (divisor == 0) {
         /* TODO: set DZ (Divide by Zero) in the FCSR */
 
         // the quotient of division by zero has all bits set
-        cpu->xreg[cpu->instr.rd] = -1;
+        cpu->xreg[cpu->instr->rd] = -1;
     } else {
-        cpu->xreg[cpu->instr.rd] = (int32_t) (dividend / divisor);
+        cpu->xreg[cpu->instr->rd] = (int32_t) (dividend / divisor);
     }
 }
 
 static void instr_sraw(riscv_cpu *cpu)
 {
-    uint32_t shamt = (cpu->xreg[cpu->instr.rs2] & 0x1f);
-    cpu->xreg[cpu->instr.rd] =
-        (int32_t) ((uint32_t) cpu->xreg[cpu->instr.rs1]) >> shamt;
+    uint32_t shamt = (cpu->xreg[cpu->instr->rs2] & 0x1f);
+    cpu->xreg[cpu->instr->rd] =
+        (int32_t) ((uint32_t) cpu->xreg[cpu->instr->rs1]) >> shamt;
 }
 
 static void instr_remw(riscv_cpu *cpu)
 {
-    int32_t dividend = cpu->xreg[cpu->instr.rs1] & 0xffffffff;
-    int32_t divisor = cpu->xreg[cpu->instr.rs2] & 0xffffffff;
+    int32_t dividend = cpu->xreg[cpu->instr->rs1] & 0xffffffff;
+    int32_t divisor = cpu->xreg[cpu->instr->rs2] & 0xffffffff;
 
     if (divisor == 0) {
         // the remainder of division by zero equals the dividend
-        cpu->xreg[cpu->instr.rd] = dividend;
+        cpu->xreg[cpu->instr->rd] = dividend;
     } else if (dividend == INT32_MIN && divisor == -1) {
         /* The remainder with overflow is zero. */
-        cpu->xreg[cpu->instr.rd] = 0;
+        cpu->xreg[cpu->instr->rd] = 0;
     } else {
-        cpu->xreg[cpu->instr.rd] = dividend % divisor;
+        cpu->xreg[cpu->instr->rd] = dividend % divisor;
     }
 }
 
 static void instr_remuw(riscv_cpu *cpu)
 {
-    uint32_t dividend = cpu->xreg[cpu->instr.rs1];
-    uint32_t divisor = cpu->xreg[cpu->instr.rs2];
+    uint32_t dividend = cpu->xreg[cpu->instr->rs1];
+    uint32_t divisor = cpu->xreg[cpu->instr->rs2];
 
     // REMUW always sign-extend the 32-bit result to 64 bits, including on a
     // divide by zero.
     if (divisor == 0) {
         // the remainder of division by zero equals the dividend
-        cpu->xreg[cpu->instr.rd] = (int32_t) dividend;
+        cpu->xreg[cpu->instr->rd] = (int32_t) dividend;
     } else {
-        cpu->xreg[cpu->instr.rd] = (int32_t) (dividend % divisor);
+        cpu->xreg[cpu->instr->rd] = (int32_t) (dividend % divisor);
     }
 }
 
 static void instr_beq(riscv_cpu *cpu)
 {
-    if (cpu->xreg[cpu->instr.rs1] == cpu->xreg[cpu->instr.rs2])
-        cpu->pc = cpu->pc + cpu->instr.imm - 4;
+    if (cpu->xreg[cpu->instr->rs1] == cpu->xreg[cpu->instr->rs2])
+        cpu->pc = instr_pc(cpu) + cpu->instr->imm;
 }
 
 static void instr_bne(riscv_cpu *cpu)
 {
-    if (cpu->xreg[cpu->instr.rs1] != cpu->xreg[cpu->instr.rs2])
-        cpu->pc = cpu->pc + cpu->instr.imm - 4;
+    if (cpu->xreg[cpu->instr->rs1] != cpu->xreg[cpu->instr->rs2])
+        cpu->pc = instr_pc(cpu) + cpu->instr->imm;
 }
 
 static void instr_blt(riscv_cpu *cpu)
 {
-    if ((int64_t) cpu->xreg[cpu->instr.rs1] <
-        (int64_t) cpu->xreg[cpu->instr.rs2])
-        cpu->pc = cpu->pc + cpu->instr.imm - 4;
+    if ((int64_t) cpu->xreg[cpu->instr->rs1] <
+        (int64_t) cpu->xreg[cpu->instr->rs2])
+        cpu->pc = instr_pc(cpu) + cpu->instr->imm;
 }
 
 static void instr_bge(riscv_cpu *cpu)
 {
-    if ((int64_t) cpu->xreg[cpu->instr.rs1] >=
-        (int64_t) cpu->xreg[cpu->instr.rs2])
-        cpu->pc = cpu->pc + cpu->instr.imm - 4;
+    if ((int64_t) cpu->xreg[cpu->instr->rs1] >=
+        (int64_t) cpu->xreg[cpu->instr->rs2])
+        cpu->pc = instr_pc(cpu) + cpu->instr->imm;
 }
 
 static void instr_bltu(riscv_cpu *cpu)
 {
-    if (cpu->xreg[cpu->instr.rs1] < cpu->xreg[cpu->instr.rs2])
-        cpu->pc = cpu->pc + cpu->instr.imm - 4;
+    if (cpu->xreg[cpu->instr->rs1] < cpu->xreg[cpu->instr->rs2])
+        cpu->pc = instr_pc(cpu) + cpu->instr->imm;
 }
 
 static void instr_bgeu(riscv_cpu *cpu)
 {
-    if (cpu->xreg[cpu->instr.rs1] >= cpu->xreg[cpu->instr.rs2])
-        cpu->pc = cpu->pc + cpu->instr.imm - 4;
+    if (cpu->xreg[cpu->instr->rs1] >= cpu->xreg[cpu->instr->rs2])
+        cpu->pc = instr_pc(cpu) + cpu->instr->imm;
 }
 
 static void instr_jalr(riscv_cpu *cpu)
@@ -593,19 +606,19 @@ static void instr_jalr(riscv_cpu *cpu)
     uint64_t prev_pc = cpu->pc;
 
     // note that we have to set the least-significant bit of the result to zero
-    cpu->pc = (cpu->xreg[cpu->instr.rs1] + cpu->instr.imm) & ~1;
-    cpu->xreg[cpu->instr.rd] = prev_pc;
+    cpu->pc = (cpu->xreg[cpu->instr->rs1] + cpu->instr->imm) & ~1;
+    cpu->xreg[cpu->instr->rd] = prev_pc;
 }
 
 static void instr_jal(riscv_cpu *cpu)
 {
-    cpu->xreg[cpu->instr.rd] = cpu->pc;
-    cpu->pc = cpu->pc + cpu->instr.imm - 4;
+    cpu->xreg[cpu->instr->rd] = cpu->pc;
+    cpu->pc = instr_pc(cpu) + cpu->instr->imm;
 }
 
 static void instr_ecall(riscv_cpu *cpu)
 {
-    assert(cpu->instr.instr & 0x73);
+    assert(cpu->instr->instr & 0x73);
 
     cpu->exc.value = cpu->pc - 4;
     switch (cpu->mode.mode) {
@@ -648,11 +661,6 @@ static void instr_sret(riscv_cpu *cpu)
     set_csr_bits(&cpu->csr, SSTATUS, SSTATUS_SPIE);
     /* SPP is set to 0 */
     clear_csr_bits(&cpu->csr, SSTATUS, SSTATUS_SPP);
-
-#ifdef ICACHE_CONFIG
-    // flush cache when returning from supervisor mode
-    invalid_icache(&cpu->icache);
-#endif
 }
 
 static void instr_mret(riscv_cpu *cpu)
@@ -665,131 +673,170 @@ static void instr_mret(riscv_cpu *cpu)
               (mstatus & ~MSTATUS_MIE) | ((mstatus & MSTATUS_MPIE) >> 4));
     set_csr_bits(&cpu->csr, MSTATUS, MSTATUS_MPIE);
     clear_csr_bits(&cpu->csr, MSTATUS, MSTATUS_MPP);
+}
 
-#ifdef ICACHE_CONFIG
-    // flush cache when returning from machine mode
-    invalid_icache(&cpu->icache);
-#endif
+static void instr_wfi(riscv_cpu *cpu)
+{
+    cpu->wfi = true;
 }
 
-static void instr_wfi(__attribute__((unused)) riscv_cpu *cpu) {}
+static void flush_tlb(riscv_cpu *cpu)
+{
+    for (int i = 0; i < ACCESS_CNT; i++)
+        invalid_tlb(&cpu->tlb[i]);
+    invalid_pwc(&cpu->pwc);
+}
 
-static void instr_sfencevma(__attribute__((unused)) riscv_cpu *cpu)
+static void instr_sfencevma(riscv_cpu *cpu)
 {
-#ifdef ICACHE_CONFIG
-    /* FIXME: What is ASID? How should we support this? */
+    /* rs1 selects the virtual address and rs2 selects the ASID to be fenced,
+     * where x0 means all of them */
+    bool by_vaddr = cpu->instr->rs1 != 0;
+    bool by_asid = cpu->instr->rs2 != 0;
+    uint64_t vaddr = cpu->xreg[cpu->instr->rs1];
+    uint16_t asid = cpu->xreg[cpu->instr->rs2];
 
-    /* If rs1 = x0, the fence orders all reads and writes made to any level
-     * of the page tables */
-    if (cpu->instr.rs1 == 0) {
-        invalid_icache(&cpu->icache);
-    }
-    /* If rs1 != x0, the fence orders only reads and writes made to
-     * the leaf page table entry corresponding to the virtual address in rs1 */
-    else {
-        invalid_icache_by_vaddr(&cpu->icache, cpu->xreg[cpu->instr.rs1]);
-    }
-#endif
+    for (int i = 0; i < ACCESS_CNT; i++)
+        fence_tlb(&cpu->tlb[i], by_vaddr, vaddr, by_asid, asid);
+
+    /* Only the leaf PTEs of the virtual address are fenced if rs1 is not x0,
+     * so the non-leaf PTEs are kept in that case. The page-walk cache is not
+     * tagged with ASID, so all of it is dropped otherwise. */
+    if (!by_vaddr)
+        invalid_pwc(&cpu->pwc);
+
+    // the links between blocks may go through the stale translation
+    unlink_block_cache(&cpu->block_cache);
 }
 
 static void instr_hfencebvma(__attribute__((unused)) riscv_cpu *cpu) {}
 
 static void instr_hfencegvma(__attribute__((unused)) riscv_cpu *cpu) {}
 
+/* Read the CSR by the CSR instructions. TIME is a read-only shadow of mtime,
+ * so it's computed from the time of bus only when it's read. */
+static uint64_t cpu_read_csr(riscv_cpu *cpu, uint16_t addr)
+{
+    if (addr == TIME)
+        return read_mtime(&cpu->bus);
+
+    return read_csr(&cpu->csr, addr);
+}
+
+/* Write the CSR by the CSR instructions. The translations we keep are tagged
+ * with ASID, and the non-leaf PTEs are tagged with the root page table. The
+ * guest should execute SFENCE.VMA after it changes the page table of an ASID.
+ * So they only need to be dropped if the translation mode is changed. */
+static void cpu_write_csr(riscv_cpu *cpu, uint16_t addr, uint64_t value)
+{
+    if (addr != SATP) {
+        write_csr(&cpu->csr, addr, value);
+        return;
+    }
+
+    uint64_t satp = read_csr(&cpu->csr, SATP);
+    write_csr(&cpu->csr, SATP, value);
+    if ((read_csr(&cpu->csr, SATP) >> SATP_MODE_SHIFT) !=
+        (satp >> SATP_MODE_SHIFT)) {
+        flush_tlb(cpu);
+        unlink_block_cache(&cpu->block_cache);
+    }
+}
+
 static void instr_csrrw(riscv_cpu *cpu)
 {
-    uint64_t tmp = read_csr(&cpu->csr, cpu->instr.imm);
-    write_csr(&cpu->csr, cpu->instr.imm, cpu->xreg[cpu->instr.rs1]);
-    cpu->xreg[cpu->instr.rd] = tmp;
+    uint64_t tmp = cpu_read_csr(cpu, cpu->instr->imm);
+    cpu_write_csr(cpu, cpu->instr->imm, cpu->xreg[cpu->instr->rs1]);
+    cpu->xreg[cpu->instr->rd] = tmp;
 }
 
 static void instr_csrrs(riscv_cpu *cpu)
 {
-    uint64_t tmp = read_csr(&cpu->csr, cpu->instr.imm);
-    write_csr(&cpu->csr, cpu->instr.imm, tmp | cpu->xreg[cpu->instr.rs1]);
-    cpu->xreg[cpu->instr.rd] = tmp;
+    uint64_t tmp = cpu_read_csr(cpu, cpu->instr->imm);
+    cpu_write_csr(cpu, cpu->instr->imm, tmp | cpu->xreg[cpu->instr->rs1]);
+    cpu->xreg[cpu->instr->rd] = tmp;
 }
 
 static void instr_csrrc(riscv_cpu *cpu)
 {
-    uint64_t tmp = read_csr(&cpu->csr, cpu->instr.imm);
-    write_csr(&cpu->csr, cpu->instr.imm, tmp & (~cpu->xreg[cpu->instr.rs1]));
-    cpu->xreg[cpu->instr.rd] = tmp;
+    uint64_t tmp = cpu_read_csr(cpu, cpu->instr->imm);
+    cpu_write_csr(cpu, cpu->instr->imm, tmp & (~cpu->xreg[cpu->instr->rs1]));
+    cpu->xreg[cpu->instr->rd] = tmp;
 }
 
 static void instr_csrrwi(riscv_cpu *cpu)
 {
-    uint64_t zimm = cpu->instr.rs1;
-    cpu->xreg[cpu->instr.rd] = read_csr(&cpu->csr, cpu->instr.imm);
-    write_csr(&cpu->csr, cpu->instr.imm, zimm);
+    uint64_t zimm = cpu->instr->rs1;
+    cpu->xreg[cpu->instr->rd] = cpu_read_csr(cpu, cpu->instr->imm);
+    cpu_write_csr(cpu, cpu->instr->imm, zimm);
 }
 
 static void instr_csrrsi(riscv_cpu *cpu)
 {
-    uint64_t zimm = cpu->instr.rs1;
-    uint64_t tmp = read_csr(&cpu->csr, cpu->instr.imm);
-    write_csr(&cpu->csr, cpu->instr.imm, tmp | zimm);
-    cpu->xreg[cpu->instr.rd] = tmp;
+    uint64_t zimm = cpu->instr->rs1;
+    uint64_t tmp = cpu_read_csr(cpu, cpu->instr->imm);
+    cpu_write_csr(cpu, cpu->instr->imm, tmp | zimm);
+    cpu->xreg[cpu->instr->rd] = tmp;
 }
 
 static void instr_csrrci(riscv_cpu *cpu)
 {
-    uint64_t zimm = cpu->instr.rs1;
-    uint64_t tmp = read_csr(&cpu->csr, cpu->instr.imm);
-    write_csr(&cpu->csr, cpu->instr.imm, tmp & (~zimm));
-    cpu->xreg[cpu->instr.rd] = tmp;
+    uint64_t zimm = cpu->instr->rs1;
+    uint64_t tmp = cpu_read_csr(cpu, cpu->instr->imm);
+    cpu_write_csr(cpu, cpu->instr->imm, tmp & (~zimm));
+    cpu->xreg[cpu->instr->rd] = tmp;
 }
 
 /* TODO: the lock acquire and realease are not implemented now */
 static void instr_amoaddw(riscv_cpu *cpu)
 {
-    uint64_t tmp = read_cpu(cpu, cpu->xreg[cpu->instr.rs1], 32);
+    uint64_t tmp = read_cpu(cpu, cpu->xreg[cpu->instr->rs1], 32);
     if (cpu->exc.exception != NoException) {
         assert(tmp == (uint64_t) -1);
         return;
     }
-    if (!write_cpu(cpu, cpu->xreg[cpu->instr.rs1], 32,
-                   tmp + cpu->xreg[cpu->instr.rs2]))
+    if (!write_cpu(cpu, cpu->xreg[cpu->instr->rs1], 32,
+                   tmp + cpu->xreg[cpu->instr->rs2]))
         return;
     // For RV64, 32-bit AMOs always sign-extend the value placed in rd.
-    cpu->xreg[cpu->instr.rd] = (int32_t) (tmp & 0xffffffff);
+    cpu->xreg[cpu->instr->rd] = (int32_t) (tmp & 0xffffffff);
 }
 
 static void instr_amoswapw(riscv_cpu *cpu)
 {
-    uint64_t tmp = read_cpu(cpu, cpu->xreg[cpu->instr.rs1], 32);
+    uint64_t tmp = read_cpu(cpu, cpu->xreg[cpu->instr->rs1], 32);
     if (cpu->exc.exception != NoException) {
         assert(tmp == (uint64_t) -1);
         return;
     }
-    if (!write_cpu(cpu, cpu->xreg[cpu->instr.rs1], 32,
-                   cpu->xreg[cpu->instr.rs2]))
+    if (!write_cpu(cpu, cpu->xreg[cpu->instr->rs1], 32,
+                   cpu->xreg[cpu->instr->rs2]))
         return;
-    cpu->xreg[cpu->instr.rd] = (int32_t) (tmp & 0xffffffff);
+    cpu->xreg[cpu->instr->rd] = (int32_t) (tmp & 0xffffffff);
 }
 
 static void instr_lrw(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1];
+    uint64_t addr = cpu->xreg[cpu->instr->rs1];
     uint64_t tmp = read_cpu(cpu, addr, 32);
     if (cpu->exc.exception != NoException) {
         assert(tmp == (uint64_t) -1);
         return;
     }
-    cpu->xreg[cpu->instr.rd] = (int32_t) (tmp & 0xffffffff);
+    cpu->xreg[cpu->instr->rd] = (int32_t) (tmp & 0xffffffff);
     cpu->reservation = addr;
 }
 
 static void instr_scw(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1];
+    uint64_t addr = cpu->xreg[cpu->instr->rs1];
 
     if (cpu->reservation == addr) {
-        if (!write_cpu(cpu, addr, 32, cpu->xreg[cpu->instr.rs2]))
+        if (!write_cpu(cpu, addr, 32, cpu->xreg[cpu->instr->rs2]))
             return;
-        cpu->xreg[cpu->instr.rd] = 0;
+        cpu->xreg[cpu->instr->rd] = 0;
     } else {
-        cpu->xreg[cpu->instr.rd] = 1;
+        cpu->xreg[cpu->instr->rd] = 1;
     }
 
     // invalidate the reservation
@@ -798,50 +845,53 @@ static void instr_scw(riscv_cpu *cpu)
 
 static void instr_amoxorw(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1];
+    uint64_t addr = cpu->xreg[cpu->instr->rs1];
     uint64_t tmp = read_cpu(cpu, addr, 32);
     if (cpu->exc.exception != NoException) {
         assert(tmp == (uint64_t) -1);
         return;
     }
 
-    uint64_t value = (int32_t) ((tmp ^ cpu->xreg[cpu->instr.rs2]) & 0xffffffff);
+    uint64_t value =
+        (int32_t) ((tmp ^ cpu->xreg[cpu->instr->rs2]) & 0xffffffff);
     if (!write_cpu(cpu, addr, 32, value))
         return;
 
-    cpu->xreg[cpu->instr.rd] = (int32_t) (tmp & 0xffffffff);
+    cpu->xreg[cpu->instr->rd] = (int32_t) (tmp & 0xffffffff);
 }
 
 static void instr_amoorw(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1];
+    uint64_t addr = cpu->xreg[cpu->instr->rs1];
     uint64_t tmp = read_cpu(cpu, addr, 32);
     if (cpu->exc.exception != NoException) {
         assert(tmp == (uint64_t) -1);
         return;
     }
 
-    uint64_t value = (int32_t) ((tmp | cpu->xreg[cpu->instr.rs2]) & 0xffffffff);
+    uint64_t value =
+        (int32_t) ((tmp | cpu->xreg[cpu->instr->rs2]) & 0xffffffff);
     if (!write_cpu(cpu, addr, 32, value))
         return;
 
-    cpu->xreg[cpu->instr.rd] = (int32_t) (tmp & 0xffffffff);
+    cpu->xreg[cpu->instr->rd] = (int32_t) (tmp & 0xffffffff);
 }
 
 static void instr_amoandw(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1];
+    uint64_t addr = cpu->xreg[cpu->instr->rs1];
     uint64_t tmp = read_cpu(cpu, addr, 32);
     if (cpu->exc.exception != NoException) {
         assert(tmp == (uint64_t) -1);
         return;
     }
 
-    uint64_t value = (int32_t) ((tmp & cpu->xreg[cpu->instr.rs2]) & 0xffffffff);
+    uint64_t value =
+        (int32_t) ((tmp & cpu->xreg[cpu->instr->rs2]) & 0xffffffff);
     if (!write_cpu(cpu, addr, 32, value))
         return;
 
-    cpu->xreg[cpu->instr.rd] = (int32_t) (tmp & 0xffffffff);
+    cpu->xreg[cpu->instr->rd] = (int32_t) (tmp & 0xffffffff);
 }
 
 /*
@@ -851,54 +901,54 @@ static void instr_amomaxw(riscv_cpu *cpu){}
 
 static void instr_amoaddd(riscv_cpu *cpu)
 {
-    uint64_t tmp = read_cpu(cpu, cpu->xreg[cpu->instr.rs1], 64);
+    uint64_t tmp = read_cpu(cpu, cpu->xreg[cpu->instr->rs1], 64);
     if (cpu->exc.exception != NoException) {
         assert(tmp == (uint64_t) -1);
         return;
     }
-    if (!write_cpu(cpu, cpu->xreg[cpu->instr.rs1], 64,
-                   tmp + cpu->xreg[cpu->instr.rs2]))
+    if (!write_cpu(cpu, cpu->xreg[cpu->instr->rs1], 64,
+                   tmp + cpu->xreg[cpu->instr->rs2]))
         return;
-    cpu->xreg[cpu->instr.rd] = tmp;
+    cpu->xreg[cpu->instr->rd] = tmp;
 }
 
 static void instr_amoswapd(riscv_cpu *cpu)
 {
-    uint64_t tmp = read_cpu(cpu, cpu->xreg[cpu->instr.rs1], 64);
+    uint64_t tmp = read_cpu(cpu, cpu->xreg[cpu->instr->rs1], 64);
     if (cpu->exc.exception != NoException) {
         assert(tmp == (uint64_t) -1);
         return;
     }
-    if (!write_cpu(cpu, cpu->xreg[cpu->instr.rs1], 64,
-                   cpu->xreg[cpu->instr.rs2]))
+    if (!write_cpu(cpu, cpu->xreg[cpu->instr->rs1], 64,
+                   cpu->xreg[cpu->instr->rs2]))
         return;
-    cpu->xreg[cpu->instr.rd] = tmp;
+    cpu->xreg[cpu->instr->rd] = tmp;
 }
 
 
 static void instr_lrd(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1];
+    uint64_t addr = cpu->xreg[cpu->instr->rs1];
     uint64_t tmp = read_cpu(cpu, addr, 64);
     if (cpu->exc.exception != NoException) {
         assert(tmp == (uint64_t) -1);
         return;
     }
-    cpu->xreg[cpu->instr.rd] = tmp;
+    cpu->xreg[cpu->instr->rd] = tmp;
     cpu->reservation = addr;
 }
 
 
 static void instr_scd(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1];
+    uint64_t addr = cpu->xreg[cpu->instr->rs1];
 
     if (cpu->reservation == addr) {
-        if (!write_cpu(cpu, addr, 64, cpu->xreg[cpu->instr.rs2]))
+        if (!write_cpu(cpu, addr, 64, cpu->xreg[cpu->instr->rs2]))
             return;
-        cpu->xreg[cpu->instr.rd] = 0;
+        cpu->xreg[cpu->instr->rd] = 0;
     } else {
-        cpu->xreg[cpu->instr.rd] = 1;
+        cpu->xreg[cpu->instr->rd] = 1;
     }
 
     // invalidate the reservation
@@ -908,50 +958,50 @@ static void instr_scd(riscv_cpu *cpu)
 
 static void instr_amoxord(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1];
+    uint64_t addr = cpu->xreg[cpu->instr->rs1];
     uint64_t tmp = read_cpu(cpu, addr, 64);
     if (cpu->exc.exception != NoException) {
         assert(tmp == (uint64_t) -1);
         return;
     }
 
-    uint64_t value = tmp ^ cpu->xreg[cpu->instr.rs2];
+    uint64_t value = tmp ^ cpu->xreg[cpu->instr->rs2];
     if (!write_cpu(cpu, addr, 64, value))
         return;
 
-    cpu->xreg[cpu->instr.rd] = tmp;
+    cpu->xreg[cpu->instr->rd] = tmp;
 }
 
 static void instr_amoord(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1];
+    uint64_t addr = cpu->xreg[cpu->instr->rs1];
     uint64_t tmp = read_cpu(cpu, addr, 64);
     if (cpu->exc.exception != NoException) {
         assert(tmp == (uint64_t) -1);
         return;
     }
 
-    uint64_t value = tmp | cpu->xreg[cpu->instr.rs2];
+    uint64_t value = tmp | cpu->xreg[cpu->instr->rs2];
     if (!write_cpu(cpu, addr, 64, value))
         return;
 
-    cpu->xreg[cpu->instr.rd] = tmp;
+    cpu->xreg[cpu->instr->rd] = tmp;
 }
 
 static void instr_amoandd(riscv_cpu *cpu)
 {
-    uint64_t addr = cpu->xreg[cpu->instr.rs1];
+    uint64_t addr = cpu->xreg[cpu->instr->rs1];
     uint64_t tmp = read_cpu(cpu, addr, 64);
     if (cpu->exc.exception != NoException) {
         assert(tmp == (uint64_t) -1);
         return;
     }
 
-    uint64_t value = tmp & cpu->xreg[cpu->instr.rs2];
+    uint64_t value = tmp & cpu->xreg[cpu->instr->rs2];
     if (!write_cpu(cpu, addr, 64, value))
         return;
 
-    cpu->xreg[cpu->instr.rd] = tmp;
+    cpu->xreg[cpu->instr->rd] = tmp;
 }
 
 /*
@@ -959,359 +1009,79 @@ static void instr_amomind(riscv_cpu *cpu){}
 static void instr_amomaxd(riscv_cpu *cpu){}
 */
 
-static void instr_caddi4spn(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // nzuimm[5:4|9:6|2|3] = inst[12:11|10:7|6|5]
-    uint64_t nzuimm = ((instr >> 1) & 0x3c0) | ((instr >> 7) & 0x30) |
-                      ((instr >> 2) & 0x8) | ((instr >> 4) & 0x4);
-    // C.ADDI4SPN is only valid when nzuimm !=0
-    if (nzuimm != 0) {
-        cpu->xreg[cpu->instr.rd] = cpu->xreg[2] + nzuimm;
-    }
-}
-
-static void instr_clw(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // offset[5:3|2|6] = inst[12:10|6|5]
-    uint8_t offset =
-        ((instr >> 7) & 0x38) | ((instr << 1) & 0x40) | ((instr >> 4) & 0x4);
-
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + offset;
-    uint64_t value = read_cpu(cpu, addr, 32);
-    if (cpu->exc.exception != NoException) {
-        assert(value == (uint64_t) -1);
-        return;
-    }
-    cpu->xreg[cpu->instr.rd] = ((int32_t) value);
-}
-
-static void instr_cld(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // offset[5:3|7:6] = inst[12:10|6:5]
-    uint8_t offset = ((instr >> 7) & 0x38) | ((instr << 1) & 0xc0);
-
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + offset;
-    uint64_t value = read_cpu(cpu, addr, 64);
-    if (cpu->exc.exception != NoException) {
-        assert(value == (uint64_t) -1);
-        return;
-    }
-    cpu->xreg[cpu->instr.rd] = value;
-}
-
-static void instr_cfsd(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // offset[5:3|7:6] = inst[12:10|6:5]
-    uint8_t offset = ((instr >> 7) & 0x38) | ((instr << 1) & 0xc0);
-
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + offset;
-    write_cpu(cpu, addr, 64, cpu->freg[cpu->instr.rs2].u);
-}
-
-static void instr_csw(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // offset[5:3|2|6] = inst[12:10|6|5]
-    uint8_t offset =
-        ((instr >> 7) & 0x38) | ((instr << 1) & 0x40) | ((instr >> 4) & 0x4);
-
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + offset;
-    write_cpu(cpu, addr, 32, cpu->xreg[cpu->instr.rs2]);
-}
-
-static void instr_csd(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // offset[5:3|7:6] = inst[12:10|6:5]
-    uint8_t offset = ((instr >> 7) & 0x38) | ((instr << 1) & 0xc0);
-
-    uint64_t addr = cpu->xreg[cpu->instr.rs1] + offset;
-    write_cpu(cpu, addr, 64, cpu->xreg[cpu->instr.rs2]);
-}
-
-static void instr_caddi(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // imm[5|4:0] = inst[12|6:2], sign-extended 6-bit immediate
-    uint64_t nzimm = ((instr >> 7) & 0x20) | ((instr >> 2) & 0x1f);
-
-    nzimm |= ((nzimm & 0x20) ? 0xFFFFFFFFFFFFFFC0 : 0);
-    // C.ADDI is only valid when rd != x0 and nzimm != 0
-    if (cpu->instr.rd != 0 && nzimm != 0) {
-        cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rd] + nzimm;
-    }
-}
-
-static void instr_caddiw(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // imm[5|4:0] = inst[12|6:2]
-    uint32_t imm = ((instr >> 7) & 0x20) | ((instr >> 2) & 0x1f);
-
-    imm |= ((imm & 0x20) ? 0xFFFFFFC0 : 0);
-
-    // C.ADDIW is only valid when rd != x0
-    if (cpu->instr.rd != 0) {
-        cpu->xreg[cpu->instr.rd] =
-            (int32_t) ((uint32_t) cpu->xreg[cpu->instr.rd] + imm);
-    }
-}
-
-static void instr_cli(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // imm[5|4:0] = inst[12|6:2]
-    uint64_t imm = ((instr >> 7) & 0x20) | ((instr >> 2) & 0x1f);
-
-    imm |= ((imm & 0x20) ? 0xFFFFFFFFFFFFFFC0 : 0);
-
-    if (cpu->instr.rd) {
-        cpu->xreg[cpu->instr.rd] = imm;
-    }
-}
-
-static void instr_clui_caddi16sp(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    uint64_t rd = cpu->instr.rd;
-
-    /* C.LUI loads the non-zero 6-bit immediate field into bits 17–12 of the
-     * destination register, clears the bottom 12 bits, and sign-extends bit 17
-     * into all higher bits of the destination.
-     *
-     * C.LUI is only valid when rd != {x0, x2}, and when the immediate is not
-     * equal to zero. */
-    if (rd != 0 && rd != 2) {
-        // nzimm[17|16:12] = inst[12|6:2]
-        uint64_t nzimm = ((instr << 5) & 0x20000) | ((instr << 10) & 0x1f000);
-        nzimm |= ((nzimm & 0x20000) ? 0xFFFFFFFFFFFC0000 : 0);
-        // The code points with nzimm=0 are reserved
-        if (nzimm != 0)
-            cpu->xreg[rd] = nzimm;
-    }
-    // rd==x2 correspond to the C.ADDI16SP instruction.
-    else if (rd == 2) {
-        // nzimm[9|4|6|8:7|5] = inst[12|6|5|4:3|2]
-        uint64_t nzimm = ((instr >> 3) & 0x200) | ((instr >> 2) & 0x10) |
-                         ((instr << 1) & 0x40) | ((instr << 4) & 0x180) |
-                         ((instr << 3) & 0x20);
-
-        nzimm |= ((nzimm & 0x200) ? 0xFFFFFFFFFFFFFC00 : 0);
-        if (nzimm != 0)
-            cpu->xreg[2] = cpu->xreg[2] + nzimm;
-    }
-}
-
-static void instr_csrli(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // shamt[5|4:0] = inst[12|6:2]
-    uint8_t shamt = ((instr >> 7) & 0x20) | ((instr >> 2) & 0x1f);
-    // the shift amount must be non-zero for RV64C
-    if (shamt != 0) {
-        cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rd] >> shamt;
-    }
-}
-
-static void instr_csrai(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // shamt[5|4:0] = inst[12|6:2]
-    uint8_t shamt = ((instr >> 7) & 0x20) | ((instr >> 2) & 0x1f);
-    // the shift amount must be non-zero for RV64C
-    if (shamt != 0) {
-        cpu->xreg[cpu->instr.rd] = (int64_t) cpu->xreg[cpu->instr.rd] >> shamt;
-    }
-}
-
-static void instr_candi(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // shamt[5|4:0] = inst[12|6:2]
-    uint64_t imm = ((instr >> 7) & 0x20) | ((instr >> 2) & 0x1f);
-    imm |= ((imm & 0x20) ? 0xFFFFFFFFFFFFFFC0 : 0);
-    cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rd] & imm;
-}
-
-static void instr_csub(riscv_cpu *cpu)
-{
-    cpu->xreg[cpu->instr.rd] =
-        cpu->xreg[cpu->instr.rd] - cpu->xreg[cpu->instr.rs2];
-}
-
-static void instr_cxor(riscv_cpu *cpu)
-{
-    cpu->xreg[cpu->instr.rd] =
-        cpu->xreg[cpu->instr.rd] ^ cpu->xreg[cpu->instr.rs2];
-}
-
-static void instr_cor(riscv_cpu *cpu)
-{
-    cpu->xreg[cpu->instr.rd] =
-        cpu->xreg[cpu->instr.rd] | cpu->xreg[cpu->instr.rs2];
-}
-
-static void instr_cand(riscv_cpu *cpu)
-{
-    cpu->xreg[cpu->instr.rd] =
-        cpu->xreg[cpu->instr.rd] & cpu->xreg[cpu->instr.rs2];
-}
-
-static void instr_csubw(riscv_cpu *cpu)
-{
-    cpu->xreg[cpu->instr.rd] = (int32_t) ((uint32_t) cpu->xreg[cpu->instr.rd] -
-                                          (uint32_t) cpu->xreg[cpu->instr.rs2]);
-}
-
-static void instr_caddw(riscv_cpu *cpu)
-{
-    cpu->xreg[cpu->instr.rd] = (int32_t) ((uint32_t) cpu->xreg[cpu->instr.rd] +
-                                          (uint32_t) cpu->xreg[cpu->instr.rs2]);
-}
-
-static void instr_cj(riscv_cpu *cpu)
-{
-    cpu->instr.imm |= ((cpu->instr.imm & 0x800) ? 0xFFFFFFFFFFFFF000 : 0);
-    cpu->pc = cpu->pc + cpu->instr.imm - 2;
-}
-
-static void instr_cbeqz(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // imm[8|4:3|7:6|2:1|5] = inst[12|11:10|6:5|4:3|2]
-    uint64_t imm = ((instr >> 4) & 0x100) | ((instr << 1) & 0xc0) |
-                   ((instr << 3) & 0x20) | ((instr >> 7) & 0x18) |
-                   ((instr >> 2) & 0x6);
-
-    imm |= (imm & 0x100) ? 0xFFFFFFFFFFFFFE00 : 0;
+/* The handlers of the instructions with special operands, which are selected
+ * by the decoder instead of the generic handlers. They don't write x0, and skip
+ * the computation which is meaningless with the operands. */
+static void instr_nop(__attribute__((unused)) riscv_cpu *cpu) {}
 
-    if (cpu->xreg[cpu->instr.rs1] == 0)
-        cpu->pc = cpu->pc + imm - 2;
-}
-
-static void instr_cbnez(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // imm[8|4:3|7:6|2:1|5] = inst[12|11:10|6:5|4:3|2]
-    uint64_t imm = ((instr >> 4) & 0x100) | ((instr << 1) & 0xc0) |
-                   ((instr << 3) & 0x20) | ((instr >> 7) & 0x18) |
-                   ((instr >> 2) & 0x6);
-
-    imm |= (imm & 0x100) ? 0xFFFFFFFFFFFFFE00 : 0;
-
-    if (cpu->xreg[cpu->instr.rs1] != 0)
-        cpu->pc = cpu->pc + imm - 2;
-}
-
-static void instr_cslli(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // shamt[5|4:0] = inst[12|6:2]
-    uint8_t shamt = ((instr >> 7) & 0x20) | ((instr >> 2) & 0x1f);
-
-    if (shamt != 0) {
-        cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rd] << shamt;
-    }
-}
-
-static void instr_clwsp(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // offset[5|4:2|7:6] = inst[12|6:4|3:2]
-    uint16_t offset =
-        ((instr << 4) & 0xc0) | ((instr >> 7) & 0x20) | ((instr >> 2) & 0x1c);
-    uint32_t val = read_cpu(cpu, cpu->xreg[2] + offset, 32);
-    if (cpu->exc.exception != NoException) {
-        assert(val == (uint32_t) -1);
-        return;
-    }
-    // C.LWSP is only valid when rd != x0;
-    if (cpu->instr.rd != 0) {
-        cpu->xreg[cpu->instr.rd] = (int32_t) val;
-    }
-}
-
-static void instr_cldsp(riscv_cpu *cpu)
+static void instr_li(riscv_cpu *cpu)
 {
-    uint32_t instr = cpu->instr.instr;
-    // offset[5|4:3|8:6] = inst[12|6:5|4:2]
-    uint16_t offset =
-        ((instr << 4) & 0x1c0) | ((instr >> 7) & 0x20) | ((instr >> 2) & 0x18);
-    uint64_t val = read_cpu(cpu, cpu->xreg[2] + offset, 64);
-    if (cpu->exc.exception != NoException) {
-        assert(val == (uint64_t) -1);
-        return;
-    }
-    // C.LDSP is only valid when rd != x0;
-    if (cpu->instr.rd != 0) {
-        cpu->xreg[cpu->instr.rd] = val;
-    }
+    cpu->xreg[cpu->instr->rd] = cpu->instr->imm;
 }
 
-static void instr_cjr_cmv(riscv_cpu *cpu)
+static void instr_mv(riscv_cpu *cpu)
 {
-    // C.JR
-    if (cpu->instr.rs2 == 0) {
-        // C.JR is only valid when rs1 != x0
-        if (cpu->instr.rs1 != 0) {
-            cpu->pc = cpu->xreg[cpu->instr.rs1];
-        } else {
-            cpu->exc.exception = IllegalInstruction;
-            return;
-        }
-    }
-    // C.MV
-    else {
-        cpu->xreg[cpu->instr.rd] = cpu->xreg[cpu->instr.rs2];
-    }
+    cpu->xreg[cpu->instr->rd] = cpu->xreg[cpu->instr->rs1];
 }
 
-static void instr_cebreak_cjalr_cadd(riscv_cpu *cpu)
+static void instr_j(riscv_cpu *cpu)
 {
-    if (cpu->instr.rs2 == 0) {
-        // C.EBREAK
-        if (cpu->instr.rs1 == 0) {
-            cpu->exc.exception = Breakpoint;
-        }
-        // C.JALR
-        else {
-            // C.JALR is only valid when rs1 != x0
-            // we don't need to add 2 because the pc already moved on.
-            uint64_t prev_pc = cpu->pc;
-            cpu->pc = cpu->xreg[cpu->instr.rs1];
-            cpu->xreg[1] = prev_pc;
-        }
-    }
-    // C.ADD
-    else {
-        cpu->xreg[cpu->instr.rd] =
-            cpu->xreg[cpu->instr.rd] + cpu->xreg[cpu->instr.rs2];
-    }
+    cpu->pc = instr_pc(cpu) + cpu->instr->imm;
 }
 
-static void instr_cswsp(riscv_cpu *cpu)
+static void instr_jr(riscv_cpu *cpu)
 {
-    uint32_t instr = cpu->instr.instr;
-    // offset[5:2|7:6] = inst[12:9|8:7]
-    uint16_t offset = ((instr >> 1) & 0xc0) | ((instr >> 7) & 0x3c);
-
-    uint64_t addr = cpu->xreg[2] + offset;
-    write_cpu(cpu, addr, 32, cpu->xreg[cpu->instr.rs2]);
+    cpu->pc = (cpu->xreg[cpu->instr->rs1] + cpu->instr->imm) & ~1;
 }
 
-static void instr_csdsp(riscv_cpu *cpu)
-{
-    uint32_t instr = cpu->instr.instr;
-    // offset[5:3|8:6] = inst[12:10|9:7]
-    uint16_t offset = ((instr >> 1) & 0x1c0) | ((instr >> 7) & 0x38);
+static const riscv_exec_func special_func[OP_SPECIAL_CNT] = {
+    [OP_NOP - OP_SPECIAL_START] = instr_nop,
+    [OP_LI - OP_SPECIAL_START] = instr_li,
+    [OP_MV - OP_SPECIAL_START] = instr_mv,
+    [OP_J - OP_SPECIAL_START] = instr_j,
+    [OP_JR - OP_SPECIAL_START] = instr_jr,
+};
 
-    uint64_t addr = cpu->xreg[2] + offset;
-    write_cpu(cpu, addr, 64, cpu->xreg[cpu->instr.rs2]);
-}
+/* The handlers of the fused pairs, which execute the two instructions one by
+ * one. Since the handlers of both instructions are inlined, we save a dispatch
+ * and the compiler has the chance to keep the intermediate result in the host
+ * register. Note that the current instruction is moved to the second one
+ * before executing it, so an exception raised by it is reported at the right
+ * address. */
+#define FUSED_HANDLER(_first, _second)                     \
+    static void instr_##_first##_##_second(riscv_cpu *cpu) \
+    {                                                      \
+        instr_##_first(cpu);                               \
+        cpu->instr++;                                      \
+        cpu->pc += instr_len(cpu->instr);                  \
+        instr_##_second(cpu);                              \
+    }
+
+FUSED_HANDLER(lui, addi)
+FUSED_HANDLER(lui, addiw)
+FUSED_HANDLER(auipc, addi)
+FUSED_HANDLER(auipc, ld)
+FUSED_HANDLER(auipc, jalr)
+FUSED_HANDLER(slli, srli)
+FUSED_HANDLER(slt, beq)
+FUSED_HANDLER(slt, bne)
+FUSED_HANDLER(sltu, beq)
+FUSED_HANDLER(sltu, bne)
+
+#undef FUSED_HANDLER
+
+static const riscv_exec_func fused_func[OP_FUSED_CNT] = {
+    [OP_LUI_ADDI - OP_FUSED_START] = instr_lui_addi,
+    [OP_LUI_ADDIW - OP_FUSED_START] = instr_lui_addiw,
+    [OP_AUIPC_ADDI - OP_FUSED_START] = instr_auipc_addi,
+    [OP_AUIPC_LD - OP_FUSED_START] = instr_auipc_ld,
+    [OP_AUIPC_JALR - OP_FUSED_START] = instr_auipc_jalr,
+    [OP_SLLI_SRLI - OP_FUSED_START] = instr_slli_srli,
+    [OP_SLT_BEQ - OP_FUSED_START] = instr_slt_beq,
+    [OP_SLT_BNE - OP_FUSED_START] = instr_slt_bne,
+    [OP_SLTU_BEQ - OP_FUSED_START] = instr_sltu_beq,
+    [OP_SLTU_BNE - OP_FUSED_START] = instr_sltu_bne,
+};
 
 /* clang-format off */
 #define INIT_RISCV_INSTR_LIST(_type, _instr)  \
@@ -1319,13 +1089,13 @@ static void instr_csdsp(riscv_cpu *cpu)
         {_type}, sizeof(_instr) / sizeof(_instr[0]), _instr}
 
 static riscv_instr_entry instr_load_type[] = {
-    [0x0] = {NULL, instr_lb, NULL, "LB"},
-    [0x1] = {NULL, instr_lh, NULL, "LH"},
-    [0x2] = {NULL, instr_lw, NULL, "LW"},
-    [0x3] = {NULL, instr_ld, NULL, "LD"},
-    [0x4] = {NULL, instr_lbu, NULL, "LBU"},
-    [0x5] = {NULL, instr_lhu, NULL, "LHU"},
-    [0x6] = {NULL, instr_lwu, NULL, "LWU"}
+    [0x0] = {NULL, instr_lb, NULL, "LB", OP_LB},
+    [0x1] = {NULL, instr_lh, NULL, "LH", OP_LH},
+    [0x2] = {NULL, instr_lw, NULL, "LW", OP_LW},
+    [0x3] = {NULL, instr_ld, NULL, "LD", OP_LD},
+    [0x4] = {NULL, instr_lbu, NULL, "LBU", OP_LBU},
+    [0x5] = {NULL, instr_lhu, NULL, "LHU", OP_LHU},
+    [0x6] = {NULL, instr_lwu, NULL, "LWU", OP_LWU}
 };
 INIT_RISCV_INSTR_LIST(FUNC3, instr_load_type);
 
@@ -1337,69 +1107,69 @@ INIT_RISCV_INSTR_LIST(FUNC3, instr_fence_type);
 
 
 static riscv_instr_entry instr_srli_srai_type[] = {
-    [0x0] =  {NULL, instr_srli, NULL, "SRLI"},
-    [0x10] = {NULL, instr_srai, NULL, "SRAI"}
+    [0x0] =  {NULL, instr_srli, NULL, "SRLI", OP_SRLI},
+    [0x10] = {NULL, instr_srai, NULL, "SRAI", OP_SRAI}
 };
 INIT_RISCV_INSTR_LIST(FUNC7_S, instr_srli_srai_type);
 
 static riscv_instr_entry instr_imm_type[] = {
-    [0x0] = {NULL, instr_addi, NULL, "ADDI"},
-    [0x1] = {NULL, instr_slli, NULL, "SLLI"},
-    [0x2] = {NULL, instr_slti, NULL, "SLTI"},
-    [0x3] = {NULL, instr_sltiu, NULL, "SLTIU"},
-    [0x4] = {NULL, instr_xori, NULL, "XORI"},
+    [0x0] = {NULL, instr_addi, NULL, "ADDI", OP_ADDI},
+    [0x1] = {NULL, instr_slli, NULL, "SLLI", OP_SLLI},
+    [0x2] = {NULL, instr_slti, NULL, "SLTI", OP_SLTI},
+    [0x3] = {NULL, instr_sltiu, NULL, "SLTIU", OP_SLTIU},
+    [0x4] = {NULL, instr_xori, NULL, "XORI", OP_XORI},
     [0x5] = {NULL, NULL, &instr_srli_srai_type_list, NULL},
-    [0x6] = {NULL, instr_ori, NULL, "ORI"},
-    [0x7] = {NULL, instr_andi, NULL, "ANDI"}
+    [0x6] = {NULL, instr_ori, NULL, "ORI", OP_ORI},
+    [0x7] = {NULL, instr_andi, NULL, "ANDI", OP_ANDI}
 };
 INIT_RISCV_INSTR_LIST(FUNC3, instr_imm_type);
 
 static riscv_instr_entry instr_add_mul_sub_type[] = {
-    [0x00] = {NULL, instr_add, NULL, "ADD"},
-    [0x01] = {NULL, instr_mul, NULL, "MUL"},
-    [0x20] = {NULL, instr_sub, NULL, "SUB"}
+    [0x00] = {NULL, instr_add, NULL, "ADD", OP_ADD},
+    [0x01] = {NULL, instr_mul, NULL, "MUL", OP_MUL},
+    [0x20] = {NULL, instr_sub, NULL, "SUB", OP_SUB}
 };
 INIT_RISCV_INSTR_LIST(FUNC7, instr_add_mul_sub_type);
 
 static riscv_instr_entry instr_sll_mulh_type[] = {
-    [0x00] = {NULL, instr_sll, NULL, "SLL"},
+    [0x00] = {NULL, instr_sll, NULL, "SLL", OP_SLL},
     [0x01] = {NULL, instr_mulh, NULL, "MULH"}
 };
 INIT_RISCV_INSTR_LIST(FUNC7, instr_sll_mulh_type);
 
 static riscv_instr_entry instr_slt_mulhsu_type[] = {
-    [0x00] = {NULL, instr_slt, NULL, "SLT"},
+    [0x00] = {NULL, instr_slt, NULL, "SLT", OP_SLT},
     [0x01] = {NULL, instr_mulhsu, NULL, "MULHSU"}
 };
 INIT_RISCV_INSTR_LIST(FUNC7, instr_slt_mulhsu_type);
 
 static riscv_instr_entry instr_sltu_mulhu_type[] = {
-    [0x00] = {NULL, instr_sltu, NULL, "SLTU"},
+    [0x00] = {NULL, instr_sltu, NULL, "SLTU", OP_SLTU},
     [0x01] = {NULL, instr_mulhu, NULL, "MULHU"}
 };
 INIT_RISCV_INSTR_LIST(FUNC7, instr_sltu_mulhu_type);
 
 static riscv_instr_entry instr_xor_div_type[] = {
-    [0x00] = {NULL, instr_xor, NULL, "XOR"},
+    [0x00] = {NULL, instr_xor, NULL, "XOR", OP_XOR},
     [0x01] = {NULL, instr_div, NULL, "DIV"}
 };
 INIT_RISCV_INSTR_LIST(FUNC7, instr_xor_div_type);
 
 static riscv_instr_entry instr_srl_divu_sra_type[] = {
-    [0x00] = {NULL, instr_srl, NULL, "SRL"},
+    [0x00] = {NULL, instr_srl, NULL, "SRL", OP_SRL},
     [0x01] = {NULL, instr_divu, NULL, "DIVU"},
-    [0x20] = {NULL, instr_sra, NULL, "SRA"}
+    [0x20] = {NULL, instr_sra, NULL, "SRA", OP_SRA}
 };
 INIT_RISCV_INSTR_LIST(FUNC7, instr_srl_divu_sra_type);
 
 static riscv_instr_entry instr_or_rem_type[] = {
-    [0x00] = {NULL, instr_or, NULL, "OR"},
+    [0x00] = {NULL, instr_or, NULL, "OR", OP_OR},
     [0x01] = {NULL, instr_rem, NULL, "REM"}
 };
 INIT_RISCV_INSTR_LIST(FUNC7, instr_or_rem_type);
 
 static riscv_instr_entry instr_and_remu_type[] = {
-    [0x00] = {NULL, instr_and, NULL, "AND"},
+    [0x00] = {NULL, instr_and, NULL, "AND", OP_AND},
     [0x01] = {NULL, instr_remu, NULL, "REMU"}
 };
 INIT_RISCV_INSTR_LIST(FUNC7, instr_and_remu_type);
@@ -1417,23 +1187,23 @@ static riscv_instr_entry instr_reg_type[] = {
 INIT_RISCV_INSTR_LIST(FUNC3, instr_reg_type);
 
 static riscv_instr_entry instr_srliw_sraiw_type[] = {
-    [0x00] = {NULL, instr_srliw, NULL, "SRLIW"},
-    [0x20] = {NULL, instr_sraiw, NULL, "SRAIW"}
+    [0x00] = {NULL, instr_srliw, NULL, "SRLIW", OP_SRLIW},
+    [0x20] = {NULL, instr_sraiw, NULL, "SRAIW", OP_SRAIW}
 };
 INIT_RISCV_INSTR_LIST(FUNC7, instr_srliw_sraiw_type);
 
 static riscv_instr_entry instr_immw_type[] = {
-    [0x0] = {NULL, instr_addiw, NULL, "ADDIW"},
-    [0x1] = {NULL, instr_slliw, NULL, "SLLIW"},
+    [0x0] = {NULL, instr_addiw, NULL, "ADDIW", OP_ADDIW},
+    [0x1] = {NULL, instr_slliw, NULL, "SLLIW", OP_SLLIW},
     [0x5] = {NULL, NULL, &instr_srliw_sraiw_type_list, NULL}
 };
 INIT_RISCV_INSTR_LIST(FUNC3, instr_immw_type);
 
 static riscv_instr_entry instr_store_type[] = {
-    [0x0] = {NULL, instr_sb, NULL, "SB"},
-    [0x1] = {NULL, instr_sh, NULL, "SH"},
-    [0x2] = {NULL, instr_sw, NULL, "SW"},
-    [0x3] = {NULL, instr_sd, NULL, "SD"},
+    [0x0] = {NULL, instr_sb, NULL, "SB", OP_SB},
+    [0x1] = {NULL, instr_sh, NULL, "SH", OP_SH},
+    [0x2] = {NULL, instr_sw, NULL, "SW", OP_SW},
+    [0x3] = {NULL, instr_sd, NULL, "SD", OP_SD},
 };
 INIT_RISCV_INSTR_LIST(FUNC3, instr_store_type);
 
@@ -1444,14 +1214,14 @@ static riscv_instr_entry instr_store_fp_type[] = {
 INIT_RISCV_INSTR_LIST(WIDTH, instr_store_fp_type);
 
 static riscv_instr_entry instr_addw_mulw_subw_type[] = {
-    [0x00] = {NULL, instr_addw, NULL, "ADDW"},
-    [0x01] = {NULL, instr_mulw, NULL, "MULW"},
-    [0x20] = {NULL, instr_subw, NULL, "SUBW"}
+    [0x00] = {NULL, instr_addw, NULL, "ADDW", OP_ADDW},
+    [0x01] = {NULL, instr_mulw, NULL, "MULW", OP_MULW},
+    [0x20] = {NULL, instr_subw, NULL, "SUBW", OP_SUBW}
 };
 INIT_RISCV_INSTR_LIST(FUNC7, instr_addw_mulw_subw_type);
 
 static riscv_instr_entry instr_sllw_type[] = {
-    [0x00] = {NULL, instr_sllw, NULL, "SLLW"},
+    [0x00] = {NULL, instr_sllw, NULL, "SLLW", OP_SLLW},
 };
 INIT_RISCV_INSTR_LIST(FUNC7, instr_sllw_type);
 
@@ -1461,9 +1231,9 @@ static riscv_instr_entry instr_divw_type[] = {
 INIT_RISCV_INSTR_LIST(FUNC7, instr_divw_type);
 
 static riscv_instr_entry instr_srlw_divuw_sraw_type[] = {
-    [0x00] = {NULL, instr_srlw, NULL, "SRLW"},
+    [0x00] = {NULL, instr_srlw, NULL, "SRLW", OP_SRLW},
     [0x01] = {NULL, instr_divuw, NULL, "DIVUW"},
-    [0x20] = {NULL, instr_sraw, NULL, "SRAW"}
+    [0x20] = {NULL, instr_sraw, NULL, "SRAW", OP_SRAW}
 };
 INIT_RISCV_INSTR_LIST(FUNC7, instr_srlw_divuw_sraw_type);
 
@@ -1488,12 +1258,12 @@ static riscv_instr_entry instr_regw_type[] = {
 INIT_RISCV_INSTR_LIST(FUNC3, instr_regw_type);
 
 static riscv_instr_entry instr_branch_type[] = {
-    [0x0] = {NULL, instr_beq, NULL, "BEQ"},
-    [0x1] = {NULL, instr_bne, NULL, "BNE"},
-    [0x4] = {NULL, instr_blt, NULL, "BLT"},
-    [0x5] = {NULL, instr_bge, NULL, "BGE"},
-    [0x6] = {NULL, instr_bltu, NULL, "BLTU"},
-    [0x7] = {NULL, instr_bgeu, NULL, "BGEU"},
+    [0x0] = {NULL, instr_beq, NULL, "BEQ", OP_BEQ},
+    [0x1] = {NULL, instr_bne, NULL, "BNE", OP_BNE},
+    [0x4] = {NULL, instr_blt, NULL, "BLT", OP_BLT},
+    [0x5] = {NULL, instr_bge, NULL, "BGE", OP_BGE},
+    [0x6] = {NULL, instr_bltu, NULL, "BLTU", OP_BLTU},
+    [0x7] = {NULL, instr_bgeu, NULL, "BGEU", OP_BGEU},
 };
 INIT_RISCV_INSTR_LIST(FUNC3, instr_branch_type);
 
@@ -1562,218 +1332,508 @@ static riscv_instr_entry instr_atomic_type[] = {
 };
 INIT_RISCV_INSTR_LIST(FUNC3, instr_atomic_type);
 
-static riscv_instr_entry instr_c0_type[] = {
-    [0x0] = {CIW_decode, instr_caddi4spn, NULL, "CADDI4SPN"},
-    [0x2] = {CL_decode, instr_clw, NULL, "CLW"},
-    [0x3] = {CL_decode, instr_cld, NULL, "CLD"},
-    [0x5] = {CS_decode, instr_cfsd, NULL, "CFSD"},
-    [0x6] = {CS_decode, instr_csw, NULL, "CSW"},
-    [0x7] = {CS_decode, instr_csd, NULL, "CSD"}
-};
-INIT_RISCV_INSTR_LIST(FUNC3, instr_c0_type);
-
-static riscv_instr_entry instr_ca_type[] = {
-    [0x0] = {NULL, instr_csub, NULL, "CSUB"},
-    [0x1] = {NULL, instr_cxor, NULL, "CXOR"},
-    [0x2] = {NULL, instr_cor, NULL, "COR"},
-    [0x3] = {NULL, instr_cand, NULL, "CAND"},
-    [0x4] = {NULL, instr_csubw, NULL, "CSUBW"},
-    [0x5] = {NULL, instr_caddw, NULL, "CADDW"},
-};
-INIT_RISCV_INSTR_LIST(FUNC2_S, instr_ca_type);
-
-static riscv_instr_entry instr_cb_ca_type[] = {
-    [0x0] = {CB_decode, instr_csrli, NULL, "CSRLI"},
-    [0x1] = {CB_decode, instr_csrai, NULL, "CSRAI"},
-    [0x2] = {CB_decode, instr_candi, NULL, "CANDI"},
-    [0x3] = {CA_decode, NULL, &instr_ca_type_list, NULL},
-};
-INIT_RISCV_INSTR_LIST(FUNC6_S, instr_cb_ca_type);
-
-static riscv_instr_entry instr_c1_type[] = {
-    [0x0] = {CI_decode, instr_caddi, NULL, "CADDI"},
-    [0x1] = {CI_decode, instr_caddiw, NULL, "CADDIW"},
-    [0x2] = {CI_decode, instr_cli, NULL, "CLI"},
-    [0x3] = {CI_decode, instr_clui_caddi16sp, NULL, "CLUI/CADDI16SP"},
-    [0x4] = {Cxx_decode, NULL, &instr_cb_ca_type_list, NULL},
-    [0x5] = {CJ_decode, instr_cj, NULL, "CJ"},
-    [0x6] = {CB_decode, instr_cbeqz, NULL, "CBEQZ"},
-    [0x7] = {CB_decode, instr_cbnez, NULL, "CBNEZ"},
-};
-INIT_RISCV_INSTR_LIST(FUNC3, instr_c1_type);
-
-static riscv_instr_entry instr_cr_type[] = {
-    [0x0] = {NULL, instr_cjr_cmv, NULL, "CJR/CMV"},
-    [0x1] = {NULL, instr_cebreak_cjalr_cadd, NULL, "CEBREAK/CJALR/CADD"},
-};
-INIT_RISCV_INSTR_LIST(FUNC4_S, instr_cr_type);
-
-static riscv_instr_entry instr_c2_type[] = {
-    [0x0] = {CI_decode, instr_cslli, NULL, "CSLLI"},
-    [0x2] = {CI_decode, instr_clwsp, NULL, "CLWSP"},
-    [0x3] = {CI_decode, instr_cldsp, NULL, "CLDSP"},
-    [0x4] = {CR_decode, NULL, &instr_cr_type_list, NULL},
-    [0x6] = {CSS_decode, instr_cswsp, NULL, "CSWSP"},
-    [0x7] = {CSS_decode, instr_csdsp, NULL, "CSDSP"},
-};
-INIT_RISCV_INSTR_LIST(FUNC3, instr_c2_type);
-
 static riscv_instr_entry opcode_type[] = {
-    [0x00] = {Cx_decode, NULL, &instr_c0_type_list, NULL},
-    [0x01] = {Cx_decode, NULL, &instr_c1_type_list, NULL},
-    [0x02] = {Cx_decode, NULL, &instr_c2_type_list, NULL},
     [0x03] = {I_decode, NULL, &instr_load_type_list, NULL},
     [0x0f] = {I_decode, NULL, &instr_fence_type_list, NULL},
     [0x13] = {I_decode, NULL, &instr_imm_type_list, NULL},
-    [0x17] = {U_decode, instr_auipc, NULL, "AUIPC"},
+    [0x17] = {U_decode, instr_auipc, NULL, "AUIPC", OP_AUIPC},
     [0x1b] = {I_decode, NULL, &instr_immw_type_list, NULL},
     [0x23] = {S_decode, NULL, &instr_store_type_list, NULL},
     [0x27] = {FS_decode, NULL, &instr_store_fp_type_list, NULL},
     [0x2f] = {R_decode, NULL, &instr_atomic_type_list, NULL},
     [0x33] = {R_decode, NULL, &instr_reg_type_list, NULL},
-    [0x37] = {U_decode, instr_lui, NULL, "LUI"},
+    [0x37] = {U_decode, instr_lui, NULL, "LUI", OP_LUI},
     [0x3b] = {R_decode, NULL, &instr_regw_type_list, NULL},
     [0x63] = {B_decode, NULL, &instr_branch_type_list, NULL},
-    [0x67] = {I_decode, instr_jalr, NULL, "JALR"},
-    [0x6f] = {J_decode, instr_jal, NULL, "JAL"},
+    [0x67] = {I_decode, instr_jalr, NULL, "JALR", OP_JALR},
+    [0x6f] = {J_decode, instr_jal, NULL, "JAL", OP_JAL},
     [0x73] = {P_decode, NULL, &instr_csr_type_list, NULL},
 };
 INIT_RISCV_INSTR_LIST(OPCODE, opcode_type);
 /* clang-format on */
 
-static bool __decode(riscv_cpu *cpu, riscv_instr_desc *instr_desc)
+/* Walk the instruction description tree to find the entry of the instruction,
+ * and return the last decode function on the path by 'decode_func'. Each level
+ * is indexed by the fields of the raw instruction directly, so the fields are
+ * not required to be kept in the decoded instruction. NULL is returned if the
+ * instruction is invalid or not implemented. */
+static riscv_instr_entry *__decode(riscv_instr *instr,
+                                   riscv_instr_desc *instr_desc,
+                                   void (**decode_func)(riscv_instr *instr))
 {
+    uint32_t raw = instr->instr;
     uint8_t index;
 
     switch (instr_desc->type.type) {
     case OPCODE:
-        index = cpu->instr.opcode;
-        break;
-    case FUNC2_S:
-        index = (cpu->instr.funct6 & 0x4) | cpu->instr.funct2;
+        index = raw & 0x7f;
         break;
     case FUNC3:
-        index = cpu->instr.funct3;
-        break;
-    case FUNC4_S:
-        index = cpu->instr.funct4 & 0x1;
+    case WIDTH:
+        index = (raw >> 12) & 0x7;
         break;
     case FUNC5:
-        index = (cpu->instr.funct7 & 0b1111100) >> 2;
-        break;
-    case FUNC6_S:
-        index = cpu->instr.funct6 & 0x3;
+        index = (raw >> 27) & 0x1f;
         break;
     case FUNC7_S:
-        index = cpu->instr.funct7 >> 1;
+        index = (raw >> 26) & 0x3f;
         break;
     case FUNC7:
-        index = cpu->instr.funct7;
+        index = (raw >> 25) & 0x7f;
         break;
     case RS2:
-        index = cpu->instr.rs2;
-        break;
-    case WIDTH:
-        index = cpu->instr.width;
+        index = (raw >> 20) & 0x1f;
         break;
     default:
         ERROR("Invalid index type\n");
-        /* we don't change the variable of exception number here, since
-         * this should only happens when our emulator's implementation error*/
-        return false;
+        return NULL;
     }
 
-    if (index >= instr_desc->size) {
-        ERROR(
-            "Not implemented or invalid instruction:\n"
-            "opcode = 0x%x funct3 = 0x%x funct7 = 0x%x at pc %lx\n",
-            cpu->instr.opcode, cpu->instr.funct3, cpu->instr.funct7,
-            cpu->pc - 4);
-        cpu->exc.exception = IllegalInstruction;
-        return false;
+    if (index >= instr_desc->size)
+        return NULL;
+
+    riscv_instr_entry *entry = &instr_desc->instr_list[index];
+
+    if (entry->decode_func) {
+        entry->decode_func(instr);
+        *decode_func = entry->decode_func;
     }
 
-    riscv_instr_entry entry = instr_desc->instr_list[index];
+    if (entry->decode_func == NULL && entry->exec_func == NULL &&
+        entry->next == NULL)
+        return NULL;
 
-    if (entry.decode_func)
-        entry.decode_func(&cpu->instr);
+    if (entry->next != NULL)
+        return __decode(instr, entry->next, decode_func);
 
-    if (entry.decode_func == NULL && entry.exec_func == NULL &&
-        entry.next == NULL) {
-        ERROR(
-            "@ Not implemented or invalid instruction:\n"
-            "opcode = 0x%x funct3 = 0x%x funct7 = 0x%x at pc %lx\n",
-            cpu->instr.opcode, cpu->instr.funct3, cpu->instr.funct7,
-            cpu->pc - 4);
-        cpu->exc.exception = IllegalInstruction;
-        return false;
-    }
+    return entry;
+}
 
-    if (entry.next != NULL)
-        return __decode(cpu, entry.next);
-    else
-        cpu->instr.exec_func = entry.exec_func;
+/* The handlers of the instructions. A decoded instruction refers to its
+ * handler by the index of this table instead of a function pointer, which
+ * keeps the decoded instruction small. The index 0 means there's no handler
+ * for an invalid instruction. */
+#define HANDLER_CNT (1 << 8)
 
-    if (entry.entry_name) {
-        LOG_DEBUG("[DEBUG] next INSTR: %s\n", entry.entry_name);
+static riscv_exec_func handler_table[HANDLER_CNT];
+static uint16_t handler_cnt = 1;
+
+// the index of the handlers for specialized instructions and fused pairs
+static uint16_t special_handler[OP_SPECIAL_CNT];
+static uint16_t fused_handler[OP_FUSED_CNT];
+
+static uint16_t register_handler(riscv_exec_func exec_func)
+{
+    if (exec_func == NULL)
+        return 0;
+
+    for (uint16_t i = 1; i < handler_cnt; i++) {
+        if (handler_table[i] == exec_func)
+            return i;
     }
 
-    return true;
+    assert(handler_cnt < HANDLER_CNT);
+    handler_table[handler_cnt] = exec_func;
+    return handler_cnt++;
 }
 
-static sv_t sv39 = (sv_t){
-    .levels = 3,
-    .ptesize = 8,
-    .create_vpn = sv39_create_vpn,
-    .create_ppn = sv39_create_ppn,
-};
+riscv_exec_func instr_exec_func(riscv_instr *instr)
+{
+    return handler_table[instr->handler];
+}
 
-static sv_t sv48 = (sv_t){
-    .levels = 4,
-    .ptesize = 8,
-    .create_vpn = sv48_create_vpn,
-    .create_ppn = sv48_create_ppn,
-};
+/* The flattened decode tables, which are generated from the instruction
+ * description tree when initialization. An instruction can then be decoded by
+ * one or two table lookups, instead of walking the tree with several
+ * dependent memory accesses.
+ *
+ * The primary table is indexed by opcode[6:2] and funct3. If the instructions
+ * under an entry should be distinguished by other bits, the entry points to a
+ * secondary table which is indexed by these bits. */
+typedef struct FLAT_ENTRY {
+    void (*decode_func)(riscv_instr *instr);
+    uint16_t handler;
+    char *entry_name;
+    riscv_op op;
+
+    struct FLAT_ENTRY *next;
+    uint8_t shift;
+    uint32_t mask;
+} riscv_flat_entry;
+
+#define FLAT_CNT (1 << 8)
+
+static riscv_flat_entry flat_type[FLAT_CNT];
+
+/* Since there are only 2^16 encodings for the compressed instructions, all of
+ * them are decoded in advance. Each entry is the decoding result of the
+ * equivalent 32 bits instruction, so a compressed instruction is decoded by
+ * a single table lookup and executed by the handler of the base
+ * instruction. */
+typedef struct {
+    int32_t imm;
+    uint16_t handler;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t op;
+} riscv_c_entry;
+
+#define C_ENTRY_CNT (1 << 16)
+
+static riscv_c_entry *c_entry_table;
+
+/* The bits of instruction which are used to index the description */
+static uint32_t desc_index_bits(riscv_instr_desc *instr_desc)
+{
+    switch (instr_desc->type.type) {
+    case OPCODE:
+        return 0x7f;
+    case FUNC3:
+    case WIDTH:
+        return 0x7000;
+    case FUNC5:
+    case FUNC7:
+    case FUNC7_S:
+        return 0xfe000000;
+    case RS2:
+        return 0x01f00000;
+    default:
+        return 0;
+    }
+}
 
-static sv_t sv57 = (sv_t){
-    .levels = 5,
-    .ptesize = 8,
-    .create_vpn = sv57_create_vpn,
-    .create_ppn = sv57_create_ppn,
-};
+/* The bits of instruction which are used to index the whole subtree */
+static uint32_t desc_used_bits(riscv_instr_desc *instr_desc)
+{
+    uint32_t bits = desc_index_bits(instr_desc);
 
-static bool __addr_translate(riscv_cpu *cpu,
-                             uint64_t addr,
-                             Access access,
-                             sv_t *sv,
-                             uint64_t *result_addr)
+    for (uint64_t i = 0; i < instr_desc->size; i++) {
+        riscv_instr_desc *next = instr_desc->instr_list[i].next;
+        if (next != NULL)
+            bits |= desc_used_bits(next);
+    }
+
+    return bits;
+}
+
+static void init_flat_entry(riscv_flat_entry *flat, uint32_t raw)
 {
-    /* Reference to:
-     * - 4.3.2 Virtual Address Translation Process */
-    uint64_t satp = read_csr(&cpu->csr, SATP);
+    riscv_instr instr = {.instr = raw};
+    void (*decode_func)(riscv_instr *instr) = NULL;
 
-    // the format of SV39 virtual address
-    uint64_t *vpn = sv->create_vpn(addr);
+    riscv_instr_entry *entry =
+        __decode(&instr, &opcode_type_list, &decode_func);
 
-    /* 1. Let a be satp.ppn × PAGESIZE, and let i = LEVELS − 1. */
-    uint64_t a = (satp & SATP_PPN) << PAGE_SHIFT;
-    int i = sv->levels - 1;
+    memset(flat, 0, sizeof(riscv_flat_entry));
+    if (entry == NULL)
+        return;
 
+    flat->decode_func = decode_func;
+    flat->handler = register_handler(entry->exec_func);
+    flat->entry_name = entry->entry_name;
+    flat->op = entry->op;
+}
 
-    pte_t pte;
-    while (1) {
-        /* 2. Let pte be the value of the PTE at address a+va.vpn[i]×PTESIZE. */
-        uint64_t tmp =
-            read_bus(&cpu->bus, a + vpn[i] * sv->ptesize, 64, &cpu->exc);
-        pte = pte_new(tmp);
+/* Initialize the primary entry for the instructions with given opcode and
+ * funct3, which are represented by 'raw' */
+static bool init_flat_primary(riscv_flat_entry *flat, uint32_t raw)
+{
+    uint32_t opcode = raw & 0x7f;
+    uint32_t funct3 = (raw >> 12) & 0x7;
+    uint32_t used_bits = 0;
 
-        if (cpu->exc.exception != NoException)
-            return false;
+    if (opcode < opcode_type_list.size) {
+        riscv_instr_desc *next = opcode_type_list.instr_list[opcode].next;
 
-        /* 3. If pte.v = 0, or if pte.r = 0 and pte.w = 1, stop and raise a
+        /* All of the instructions below the opcode are indexed by funct3
+         * first, so only the subtree of the given funct3 should be
+         * considered */
+        if (next != NULL && funct3 < next->size &&
+            next->instr_list[funct3].next != NULL)
+            used_bits = desc_used_bits(next->instr_list[funct3].next);
+    }
+
+    if (used_bits == 0) {
+        init_flat_entry(flat, raw);
+        return true;
+    }
+
+    uint8_t shift = __builtin_ctz(used_bits);
+    uint32_t mask = (1UL << (32 - __builtin_clz(used_bits) - shift)) - 1;
+
+    memset(flat, 0, sizeof(riscv_flat_entry));
+    flat->next = calloc(mask + 1, sizeof(riscv_flat_entry));
+    if (flat->next == NULL)
+        return false;
+    flat->shift = shift;
+    flat->mask = mask;
+
+    for (uint32_t i = 0; i <= mask; i++)
+        init_flat_entry(&flat->next[i], raw | (i << shift));
+
+    return true;
+}
+
+static inline riscv_flat_entry *flat_lookup(uint32_t raw)
+{
+    riscv_flat_entry *entry =
+        &flat_type[((raw >> 2) & 0x1f) << 3 | ((raw >> 12) & 0x7)];
+
+    if (entry->next != NULL)
+        entry = &entry->next[(raw >> entry->shift) & entry->mask];
+
+    return entry;
+}
+
+static void set_special_op(riscv_instr *instr, riscv_op op)
+{
+    instr->op = op;
+    instr->handler = special_handler[op - OP_SPECIAL_START];
+}
+
+/* Select the specialized handler if the instruction has special operands.
+ * Besides, the write to x0 of the other instructions is redirected to
+ * XREG_DISCARD, so no instruction changes x0 at all. */
+static void specialize_instr(riscv_instr *instr, uint32_t raw)
+{
+    switch (raw & 0x7f) {
+    case 0x13:  // OP-IMM
+    case 0x17:  // AUIPC
+    case 0x1b:  // OP-IMM-32
+    case 0x33:  // OP
+    case 0x37:  // LUI
+    case 0x3b:  // OP-32
+        // there is no side effect except writing to rd
+        if (instr->rd == 0)
+            set_special_op(instr, OP_NOP);
+        break;
+    case 0x6f:  // JAL
+        if (instr->rd == 0)
+            set_special_op(instr, OP_J);
+        break;
+    case 0x67:  // JALR
+        if (instr->rd == 0)
+            set_special_op(instr, OP_JR);
+        break;
+    case 0x03:  // LOAD
+    case 0x2f:  // AMO
+        break;
+    case 0x73:  // SYSTEM, where only the CSR instructions write rd
+        if (((raw >> 12) & 0x7) == 0)
+            return;
+        break;
+    default:
+        return;
+    }
+
+    if (instr->rd == 0) {
+        instr->rd = XREG_DISCARD;
+        return;
+    }
+
+    switch (instr->op) {
+    case OP_ADDI:
+        if (instr->rs1 == 0)
+            set_special_op(instr, OP_LI);
+        else if (instr->imm == 0)
+            set_special_op(instr, OP_MV);
+        break;
+    case OP_ADD:
+        if (instr->rs1 == 0) {
+            instr->rs1 = instr->rs2;
+            set_special_op(instr, OP_MV);
+        } else if (instr->rs2 == 0) {
+            set_special_op(instr, OP_MV);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void init_c_entry(riscv_c_entry *c_entry, uint16_t raw)
+{
+    uint32_t expand = C_expand(raw);
+    riscv_flat_entry *entry = flat_lookup(expand);
+
+    memset(c_entry, 0, sizeof(riscv_c_entry));
+    if (expand == 0 || entry->handler == 0)
+        return;
+
+    riscv_instr instr = {.instr = expand};
+    if (entry->decode_func)
+        entry->decode_func(&instr);
+    instr.handler = entry->handler;
+    instr.op = entry->op;
+    specialize_instr(&instr, expand);
+
+    c_entry->handler = instr.handler;
+    c_entry->imm = instr.imm;
+    c_entry->rd = instr.rd;
+    c_entry->rs1 = instr.rs1;
+    c_entry->rs2 = instr.rs2;
+    c_entry->op = instr.op;
+}
+
+static bool init_flat_decode(void)
+{
+    static bool is_initialized = false;
+
+    if (is_initialized)
+        return true;
+
+    for (uint32_t opcode = 0; opcode < 0x20; opcode++) {
+        for (uint32_t funct3 = 0; funct3 < 0x8; funct3++) {
+            uint32_t raw = (funct3 << 12) | (opcode << 2) | 0x3;
+            if (!init_flat_primary(&flat_type[(opcode << 3) | funct3], raw))
+                return false;
+        }
+    }
+
+    for (int i = 0; i < OP_SPECIAL_CNT; i++)
+        special_handler[i] = register_handler(special_func[i]);
+    for (int i = 0; i < OP_FUSED_CNT; i++)
+        fused_handler[i] = register_handler(fused_func[i]);
+
+    c_entry_table = calloc(C_ENTRY_CNT, sizeof(riscv_c_entry));
+    if (c_entry_table == NULL)
+        return false;
+
+    for (uint32_t raw = 0; raw < C_ENTRY_CNT; raw++) {
+        if ((raw & 0x3) != 0x3)
+            init_c_entry(&c_entry_table[raw], raw);
+    }
+
+    is_initialized = true;
+    return true;
+}
+
+/* Decode the compressed instruction. The raw bits of the instruction are
+ * kept, so the length of instruction is still 2 bytes after decoding. */
+static bool flat_decode_c(riscv_cpu *cpu, riscv_instr *instr)
+{
+    riscv_c_entry *entry = &c_entry_table[instr->instr & 0xffff];
+
+    if (entry->handler == 0) {
+        cpu->exc.exception = IllegalInstruction;
+        return false;
+    }
+
+    instr->rd = entry->rd;
+    instr->rs1 = entry->rs1;
+    instr->rs2 = entry->rs2;
+    instr->imm = entry->imm;
+    instr->handler = entry->handler;
+    instr->op = entry->op;
+
+    return true;
+}
+
+/* Decode the instruction by the flattened decode tables. The error of an
+ * invalid instruction is not reported here, since it is fine to decode an
+ * instruction which is not going to be executed. The caller should report it
+ * if required. */
+static bool flat_decode(riscv_cpu *cpu, riscv_instr *instr)
+{
+    uint32_t raw = instr->instr;
+
+    if ((raw & 0x3) != 0x3)
+        return flat_decode_c(cpu, instr);
+
+    riscv_flat_entry *entry = flat_lookup(raw);
+
+    if (entry->handler == 0) {
+        cpu->exc.exception = IllegalInstruction;
+        return false;
+    }
+
+    if (entry->decode_func)
+        entry->decode_func(instr);
+    instr->handler = entry->handler;
+    instr->op = entry->op;
+    specialize_instr(instr, raw);
+
+    if (entry->entry_name) {
+        LOG_DEBUG("[DEBUG] next INSTR: %s\n", entry->entry_name);
+    }
+
+    return true;
+}
+
+static sv_t sv39 = (sv_t){
+    .levels = 3,
+    .ptesize = 8,
+    .create_vpn = sv39_create_vpn,
+    .create_ppn = sv39_create_ppn,
+};
+
+static sv_t sv48 = (sv_t){
+    .levels = 4,
+    .ptesize = 8,
+    .create_vpn = sv48_create_vpn,
+    .create_ppn = sv48_create_ppn,
+};
+
+static sv_t sv57 = (sv_t){
+    .levels = 5,
+    .ptesize = 8,
+    .create_vpn = sv57_create_vpn,
+    .create_ppn = sv57_create_ppn,
+};
+
+/* Walk the page table for the access. If 'probe' is set, the walk only finds
+ * out the translation for the debugger, so neither the accessed and dirty bits
+ * nor the page-walk cache are updated. */
+static bool __addr_translate(riscv_cpu *cpu,
+                             uint64_t addr,
+                             Access access,
+                             sv_t *sv,
+                             bool probe,
+                             uint64_t *result_addr,
+                             bool *global,
+                             int *level)
+{
+    /* Reference to:
+     * - 4.3.2 Virtual Address Translation Process */
+    uint64_t satp = read_csr(&cpu->csr, SATP);
+
+    // the format of SV39 virtual address
+    uint64_t *vpn = sv->create_vpn(addr);
+
+    /* 1. Let a be satp.ppn × PAGESIZE, and let i = LEVELS − 1. */
+    uint64_t root = (satp & SATP_PPN) << PAGE_SHIFT;
+    uint64_t a = root;
+    int i = sv->levels - 1;
+
+    // the mapping is global if any level of the PTEs is global
+    *global = false;
+
+    /* Skip the levels of the walk whose non-leaf PTEs are known by the
+     * page-walk cache */
+    riscv_pwc_entry *entry = read_pwc(&cpu->pwc, root, addr, sv->levels);
+    if (entry) {
+        a = entry->table;
+        i = entry->level;
+        *global = entry->global;
+    }
+
+    pte_t pte;
+    uint64_t pte_addr, tmp;
+    while (1) {
+        /* 2. Let pte be the value of the PTE at address a+va.vpn[i]×PTESIZE. */
+        pte_addr = a + vpn[i] * sv->ptesize;
+        tmp = read_bus(&cpu->bus, pte_addr, 64, &cpu->exc);
+        pte = pte_new(tmp);
+
+        if (cpu->exc.exception != NoException)
+            return false;
+
+        /* 3. If pte.v = 0, or if pte.r = 0 and pte.w = 1, stop and raise a
          * page-fault exception corresponding to the original access type */
         if (pte.v == 0 || (pte.r == 0 && pte.w == 1))
             return false;
+        *global |= pte.g;
 
         /* 4.
          *
@@ -1794,6 +1854,8 @@ static bool __addr_translate(riscv_cpu *cpu,
             return false;
 
         a = pte.ppn << PAGE_SHIFT;
+        if (!probe)
+            write_pwc(&cpu->pwc, root, addr, i, a, *global);
     }
 
     /* 5. (skip) A leaf PTE has been found. Determine if the requested memory
@@ -1822,14 +1884,29 @@ static bool __addr_translate(riscv_cpu *cpu,
     uint64_t *ppn = sv->create_ppn(pte.ppn);
 
     if (i > 0) {
-        for (int idx = i - 1; idx > 0; idx--) {
+        for (int idx = i - 1; idx >= 0; idx--) {
             if (ppn[idx] != 0)
                 return false;
         }
     }
 
-    /* 7. (Skip) If pte.a = 0, or if the memory access is a store and pte.d = 0,
-     * raise a page-fault exception corresponding to the original access type */
+    /* 7. If pte.a = 0, or if the memory access is a store and pte.d = 0:
+     * - If the Svadu extension is not implemented, stop and raise a page-fault
+     *   exception corresponding to the original access type.
+     * - If the Svadu extension is implemented, set pte.a to 1 and, if the
+     *   memory access is a store, also set pte.d to 1.
+     *
+     * We implement Svadu. Since there is only one hart and no device accesses
+     * the memory during the walk, the PTE is still the same one we read, so
+     * writing it back is atomic as the spec requires. Note that a store only
+     * comes here when it misses in the TLB of store, which holds the pages
+     * whose pte.d is set already. */
+    uint64_t ad = PTE_A | ((access == Access_Store) ? PTE_D : 0);
+    if (!probe && (tmp & ad) != ad) {
+        write_bus(&cpu->bus, pte_addr, 64, tmp | ad, &cpu->exc);
+        if (cpu->exc.exception != NoException)
+            return false;
+    }
 
     /* 8. The translation is successful. The translated physical address is
      * given as follows:
@@ -1844,6 +1921,7 @@ static bool __addr_translate(riscv_cpu *cpu,
     for (; idx < sv->levels; idx++)
         *result_addr |= ppn[idx] << (12 + 9 * idx);
 
+    *level = i;
     return true;
 }
 
@@ -1854,13 +1932,40 @@ enum satp_mode {
     MODE_SV57 = 10,
 };
 
-static uint64_t addr_translate(riscv_cpu *cpu, uint64_t addr, Access access)
+/* Return the host address of the physical address if its whole 4 KiB page is in
+ * DRAM, since the access through it is only bounded by the page */
+static inline uint8_t *page_host_addr(riscv_cpu *cpu, uint64_t paddr)
+{
+    uint64_t page = paddr & ~PAGE_OFFSET_MASK;
+    uint8_t *host = mem_host_addr(&cpu->bus.memory, page, 1UL << PAGE_SHIFT);
+
+    return (host != NULL) ? host + (paddr & PAGE_OFFSET_MASK) : NULL;
+}
+
+/* Fill the TLB entry of the 4 KiB page which contains the address, along with
+ * the host address of the page if it is in DRAM */
+static riscv_tlb_entry *fill_tlb(riscv_cpu *cpu,
+                                 riscv_tlb *tlb,
+                                 uint64_t addr,
+                                 uint16_t asid,
+                                 bool global,
+                                 uint8_t level,
+                                 uint64_t paddr)
+{
+    uint64_t page = paddr & ~PAGE_OFFSET_MASK;
+    uint8_t *host = page_host_addr(cpu, page);
+
+    return write_tlb(tlb, addr, asid, global, level, page, host);
+}
+
+// Return the translation mode of the access, which is MODE_BARE if disabled
+static int translate_mode(riscv_cpu *cpu, Access access)
 {
     uint64_t satp = read_csr(&cpu->csr, SATP);
     int mode = satp >> 60;
     // if not enable page table translation
     if (mode == MODE_BARE)
-        return addr;
+        return MODE_BARE;
 
     /*  When MPRV=0, translation and protection behave as normal.
      *  Whem MPRV=1, load and store memory addresses are translated
@@ -1869,27 +1974,85 @@ static uint64_t addr_translate(riscv_cpu *cpu, uint64_t addr, Access access)
         if ((access == Access_Instr) ||
             (!check_csr_bit(&cpu->csr, MSTATUS, MSTATUS_MPRV)) ||
             ((read_csr(&cpu->csr, MSTATUS) >> 11) == MACHINE))
-            return addr;
+            return MODE_BARE;
 
-    bool result = false;
-    uint64_t result_addr;
+    return mode;
+}
+
+static bool walk_page_table(riscv_cpu *cpu,
+                            uint64_t addr,
+                            Access access,
+                            int mode,
+                            bool probe,
+                            uint64_t *result_addr,
+                            bool *global,
+                            int *level)
+{
     switch (mode) {
     case MODE_SV39:
-        result = __addr_translate(cpu, addr, access, &sv39, &result_addr);
-        break;
+        return __addr_translate(cpu, addr, access, &sv39, probe, result_addr,
+                                global, level);
     case MODE_SV48:
-        result = __addr_translate(cpu, addr, access, &sv48, &result_addr);
-        break;
+        return __addr_translate(cpu, addr, access, &sv48, probe, result_addr,
+                                global, level);
     case MODE_SV57:
-        result = __addr_translate(cpu, addr, access, &sv57, &result_addr);
-        break;
+        return __addr_translate(cpu, addr, access, &sv57, probe, result_addr,
+                                global, level);
     default:
-        result = false;
         assert(0);
-        break;
+        return false;
+    }
+}
+
+/* Translate the virtual address of the access. Besides, the host address of the
+ * physical address is returned by 'host' if it is in DRAM, otherwise 'host' is
+ * set to NULL. */
+static uint64_t addr_translate_host(riscv_cpu *cpu,
+                                    uint64_t addr,
+                                    Access access,
+                                    uint8_t **host)
+{
+    int mode = translate_mode(cpu, access);
+    if (mode == MODE_BARE) {
+        *host = page_host_addr(cpu, addr);
+        return addr;
     }
 
-    if (result) {
+    uint64_t satp = read_csr(&cpu->csr, SATP);
+
+    riscv_tlb *tlb = &cpu->tlb[access];
+    uint16_t asid = (satp & SATP_ASID) >> SATP_ASID_SHIFT;
+    uint64_t offset = addr & PAGE_OFFSET_MASK;
+    riscv_tlb_entry *entry = read_tlb(tlb, addr, asid);
+
+    if (entry == NULL) {
+        // the page could be a part of the superpage which is translated before
+        riscv_tlb_entry *super = read_tlb_super(tlb, addr, asid);
+        if (super != NULL) {
+            uint64_t super_mask = (1UL << tlb_page_shift(super->level)) - 1;
+            entry = fill_tlb(cpu, tlb, addr, asid, super->global, super->level,
+                             super->page | (addr & super_mask));
+        }
+    }
+
+    if (entry != NULL) {
+        *host = (entry->host != NULL) ? entry->host + offset : NULL;
+        return entry->page | offset;
+    }
+
+    uint64_t result_addr;
+    bool global;
+    int level;
+    if (walk_page_table(cpu, addr, access, mode, false, &result_addr, &global,
+                        &level)) {
+        if (level > 0) {
+            uint64_t super_mask = (1UL << tlb_page_shift(level)) - 1;
+            write_tlb_super(tlb, addr, asid, global, level,
+                            result_addr & ~super_mask);
+        }
+
+        entry = fill_tlb(cpu, tlb, addr, asid, global, level, result_addr);
+        *host = (entry->host != NULL) ? entry->host + offset : NULL;
         return result_addr;
     }
 
@@ -1905,9 +2068,16 @@ static uint64_t addr_translate(riscv_cpu *cpu, uint64_t addr, Access access)
         break;
     }
     cpu->exc.value = addr;
+    *host = NULL;
     return -1;
 }
 
+static uint64_t addr_translate(riscv_cpu *cpu, uint64_t addr, Access access)
+{
+    uint8_t *host;
+    return addr_translate_host(cpu, addr, access, &host);
+}
+
 static Trap handle_exception(riscv_cpu *cpu, uint64_t exc_pc)
 {
     riscv_mode prev_mode = cpu->mode;
@@ -2008,6 +2178,10 @@ static void interrput_take_trap(riscv_cpu *cpu, riscv_mode new_mode)
     uint8_t cause = cpu->irq.irq;
 
     cpu->mode = new_mode;
+    // the next block is not the one linked by the last block
+    cpu->link = NULL;
+    // the hart waiting for interrupt is resumed by the trap
+    cpu->wfi = false;
 
     if (cpu->mode.mode == SUPERVISOR) {
         uint64_t stvec = read_csr(&cpu->csr, STVEC);
@@ -2089,10 +2263,6 @@ static bool irq_enable(riscv_cpu *cpu, uint8_t cause)
     cpu->irq.irq = cause;
     cpu->irq.value = cpu->pc;
     interrput_take_trap(cpu, new_mode);
-#ifdef ICACHE_CONFIG
-    // flush cache when jumping in trap handler
-    invalid_icache(&cpu->icache);
-#endif
     return true;
 }
 
@@ -2104,6 +2274,10 @@ static void handle_interrupt(riscv_cpu *cpu)
      * should dig in more to perform better emulation.
      */
 
+    /* If an interrupt is taken, the registers are written again, so it will be
+     * checked at the next step whether another one should be taken */
+    cpu->csr.irq_changed = false;
+
     uint64_t pending = read_csr(&cpu->csr, MIE) & read_csr(&cpu->csr, MIP);
 
     if (pending & MIP_MEIP) {
@@ -2157,49 +2331,122 @@ static void handle_interrupt(riscv_cpu *cpu)
 #endif
 }
 
-bool init_cpu(riscv_cpu *cpu, const char *filename, const char *rfs_name)
+// Set the state of the hart as it is just powered on
+static void reset_hart(riscv_cpu *cpu)
 {
-    if (!init_bus(&cpu->bus, filename, rfs_name))
-        return false;
-
-    if (!init_csr(&cpu->csr))
-        return false;
-
-#ifdef ICACHE_CONFIG
-    if (!init_icache(&cpu->icache))
-        return false;
-#endif
+    cpu->link = NULL;
+    cpu->link_gen = 0;
+    flush_tlb(cpu);
+    memset(cpu->ras, 0, sizeof(cpu->ras));
+    cpu->ras_top = 0;
 
     cpu->mode.mode = MACHINE;
     cpu->exc.exception = NoException;
     cpu->irq.irq = NoInterrupt;
+    cpu->wfi = false;
 
-    memset(&cpu->instr, 0, sizeof(riscv_instr));
-    memset(&cpu->xreg[0], 0, sizeof(uint64_t) * 32);
+    memset(&cpu->instr_buf, 0, sizeof(riscv_instr));
+    memset(cpu->xreg, 0, sizeof(cpu->xreg));
     for (int i = 0; i < 32; i++) {
         cpu->freg[i].u = 0;
         cpu->freg[i].f = 0;
     }
+    cpu->reservation = 0;
 
     cpu->pc = BOOT_ROM_BASE;
-    cpu->xreg[2] = DRAM_BASE + DRAM_SIZE;
-    cpu->instr.exec_func = NULL;
+    cpu->xreg[2] = mem_end(&cpu->bus.memory);
+    cpu->instr = &cpu->instr_buf;
+}
 
+bool init_cpu(riscv_cpu *cpu,
+              const char *filename,
+              const char *rfs_name,
+              const riscv_config *config)
+{
+    if (!init_bus(&cpu->bus, filename, rfs_name, config->memory_size,
+                  config->host_clock))
+        return false;
+
+    if (!init_csr(&cpu->csr))
+        return false;
+
+#ifdef ICACHE_CONFIG
+    if (!init_icache(&cpu->icache, config->icache_sets, config->icache_ways))
+        return false;
+#endif
+
+    if (!init_flat_decode())
+        return false;
+
+    if (!init_block_cache(&cpu->block_cache, config->memory_size))
+        return false;
+
+    cpu->threaded_mode = config->threaded;
+    cpu->fusion_mode = config->fusion;
+    cpu->warp_mode = config->time_warp;
+    cpu->fusion_stats = config->fusion_stats;
+    memset(cpu->fusion_cnt, 0, sizeof(cpu->fusion_cnt));
+    cpu->fused_exec_cnt = 0;
+    cpu->instr_cnt = 0;
+
+    cpu->jit_mode = config->jit;
+    if (cpu->jit_mode && !init_jit(&cpu->jit))
+        return false;
+
+    reset_hart(cpu);
     cpu_set_debug_mode(cpu, false);
 
     return true;
 }
 
+/* Restore the emulator to the state after init_cpu, where DRAM should have
+ * been kept by snapshot_mem. The decoded and translated code is dropped, since
+ * the code in DRAM may be different now. */
+bool restore_cpu(riscv_cpu *cpu)
+{
+    if (!restore_bus(&cpu->bus))
+        return false;
+
+    if (!init_csr(&cpu->csr))
+        return false;
+
+#ifdef ICACHE_CONFIG
+    invalid_icache(&cpu->icache);
+#endif
+    if (cpu->jit_mode)
+        invalid_jit(&cpu->jit);
+    invalid_block_cache(&cpu->block_cache);
+
+    // the statistics are reported for the last run only
+    memset(cpu->fusion_cnt, 0, sizeof(cpu->fusion_cnt));
+    cpu->fused_exec_cnt = 0;
+    cpu->instr_cnt = 0;
+
+    reset_hart(cpu);
+    return true;
+}
+
 void cpu_set_debug_mode(riscv_cpu *cpu, bool debug_mode)
 {
     cpu->debug_mode = debug_mode;
+    cpu->link = NULL;
 }
 
 /* these two functions are the indirect layer of read / write bus from cpu,
  * which will do address translation before actually read / write the bus */
+/* Whether the access can be done by the host address directly. If the access
+ * is across the page, the next page may not be in DRAM. */
+static inline bool access_host(uint8_t *host, uint64_t addr, uint8_t size)
+{
+    return host != NULL &&
+           (addr & PAGE_OFFSET_MASK) <= (1UL << PAGE_SHIFT) - (size >> 3);
+}
+
 uint64_t read_cpu(riscv_cpu *cpu, uint64_t addr, uint8_t size)
 {
-    addr = addr_translate(cpu, addr, Access_Load);
+    uint8_t *host;
+
+    addr = addr_translate_host(cpu, addr, Access_Load, &host);
     if (cpu->exc.exception != NoException) {
         /* Restore the exception state for debug mode */
         if (cpu->debug_mode)
@@ -2207,37 +2454,115 @@ uint64_t read_cpu(riscv_cpu *cpu, uint64_t addr, uint8_t size)
 
         return -1;
     }
+
+    if (access_host(host, addr, size))
+        return load_host(host, size);
     return read_bus(&cpu->bus, addr, size, &cpu->exc);
 }
 
 bool write_cpu(riscv_cpu *cpu, uint64_t addr, uint8_t size, uint64_t value)
 {
-    addr = addr_translate(cpu, addr, Access_Store);
+    uint8_t *host;
+
+    addr = addr_translate_host(cpu, addr, Access_Store, &host);
     if (cpu->exc.exception != NoException) {
         /* Restore the exception state for debug mode */
         if (cpu->debug_mode)
             cpu->exc.exception = NoException;
         return false;
     }
+
+    // drop the decoded blocks if their instructions are overwritten
+    invalid_block_cache_by_paddr(&cpu->block_cache, addr, size >> 3);
+
+    if (access_host(host, addr, size)) {
+        mark_mem_dirty(&cpu->bus.memory, addr, size >> 3);
+        store_host(host, size, value);
+        return true;
+    }
     return write_bus(&cpu->bus, addr, size, value, &cpu->exc);
 }
 
+/* Translate the address for the debugger without changing the guest state,
+ * which neither sets the accessed and dirty bits of PTE nor fills the TLB */
+static bool debug_translate(riscv_cpu *cpu,
+                            uint64_t addr,
+                            Access access,
+                            uint64_t *paddr)
+{
+    int mode = translate_mode(cpu, access);
+    if (mode == MODE_BARE) {
+        *paddr = addr;
+        return true;
+    }
+
+    bool global;
+    int level;
+    return walk_page_table(cpu, addr, access, mode, true, paddr, &global,
+                           &level);
+}
+
+/* These two functions access the memory for the debugger. The exception state
+ * of the hart is kept, and -1 or false is returned if the access fails. */
+uint64_t read_cpu_debug(riscv_cpu *cpu, uint64_t addr, uint8_t size)
+{
+    riscv_exception exc = cpu->exc;
+    uint64_t paddr, value = -1;
+
+    if (debug_translate(cpu, addr, Access_Load, &paddr)) {
+        cpu->exc.exception = NoException;
+        value = read_bus(&cpu->bus, paddr, size, &cpu->exc);
+        if (cpu->exc.exception != NoException)
+            value = -1;
+    }
+
+    cpu->exc = exc;
+    return value;
+}
+
+bool write_cpu_debug(riscv_cpu *cpu,
+                     uint64_t addr,
+                     uint8_t size,
+                     uint64_t value)
+{
+    riscv_exception exc = cpu->exc;
+    uint64_t paddr;
+    bool ret = false;
+
+    if (debug_translate(cpu, addr, Access_Store, &paddr)) {
+        // drop the decoded blocks if their instructions are overwritten
+        invalid_block_cache_by_paddr(&cpu->block_cache, paddr, size >> 3);
+        cpu->exc.exception = NoException;
+        ret = write_bus(&cpu->bus, paddr, size, value, &cpu->exc);
+    }
+
+    cpu->exc = exc;
+    return ret;
+}
+
 #ifdef ICACHE_CONFIG
-static bool fetch_icache(riscv_cpu *cpu)
+/* Look up the decoded instruction in the I-cache, which is used in place if
+ * it is found */
+static bool fetch_icache(riscv_cpu *cpu, uint64_t paddr)
 {
-    riscv_instr *icache_instr = read_icache(&cpu->icache, cpu->pc);
+    /* The cached instructions are dropped if the code in DRAM is overwritten
+     * since the last time we are here */
+    if (cpu->icache.epoch != cpu->block_cache.epoch) {
+        invalid_icache(&cpu->icache);
+        cpu->icache.epoch = cpu->block_cache.epoch;
+    }
+
+    riscv_instr *icache_instr = read_icache(&cpu->icache, paddr);
 
     if (icache_instr != NULL) {
-        memcpy(&cpu->instr, icache_instr, sizeof(riscv_instr));
-        cpu->pc += (cpu->instr.instr & 0x3) == 0x3 ? 4 : 2;
+        cpu->instr = icache_instr;
+        cpu->pc += instr_len(cpu->instr);
 
         LOG_DEBUG("[DEBUG] cache hit \n");
 
-        LOG_DEBUG(
-            "[DEBUG] instr: 0x%x\n"
-            "opcode = 0x%x funct3 = 0x%x funct7 = 0x%x rs2 = 0x%x\n",
-            cpu->instr.instr, cpu->instr.opcode, cpu->instr.funct3,
-            cpu->instr.funct7, cpu->instr.rs2);
+        LOG_DEBUG("[DEBUG] instr: 0x%x rs1 = 0x%x rs2 = 0x%x rd = 0x%x\n",
+                  cpu->instr->instr, cpu->instr->rs1, cpu->instr->rs2,
+                  cpu->instr->rd);
 
         return true;
     }
@@ -2246,61 +2571,74 @@ static bool fetch_icache(riscv_cpu *cpu)
 }
 #endif
 
-static bool fetch(riscv_cpu *cpu)
+/* Fetch the instruction from the given physical address */
+static bool __fetch(riscv_cpu *cpu, uint64_t paddr, riscv_instr *instr)
 {
-    uint64_t pc = addr_translate(cpu, cpu->pc, Access_Instr);
-    if (cpu->exc.exception != NoException)
-        return false;
-
-    uint32_t instr = read_bus(&cpu->bus, pc, 32, &cpu->exc);
+    uint32_t raw = read_bus(&cpu->bus, paddr, 32, &cpu->exc);
+    /* A compressed instruction can be at the last halfword of DRAM, where the
+     * 32 bits read is across the end */
+    if (cpu->exc.exception == LoadAccessFault) {
+        cpu->exc.exception = NoException;
+        raw = read_bus(&cpu->bus, paddr, 16, &cpu->exc);
+        if (cpu->exc.exception == NoException && (raw & 0x3) == 0x3) {
+            cpu->exc.exception = LoadAccessFault;
+            cpu->exc.value = paddr;
+        }
+    }
     if (cpu->exc.exception != NoException)
         return false;
 
-    int pc_shift = 0;
-
-    if ((instr & 0x3) != 0x3) {
-        pc_shift = 2;
+    if ((raw & 0x3) != 0x3) {
+        raw &= 0xffff;
 
-        instr &= 0xffff;
-
-        if (instr == 0) {
+        if (raw == 0) {
             cpu->exc.exception = IllegalInstruction;
             return false;
         }
+    }
 
-        cpu->instr.instr = instr;
-        cpu->instr.opcode = instr & 0x3;
-    } else {
-        pc_shift = 4;
+    instr->instr = raw;
+    return true;
+}
 
-        cpu->instr.instr = instr;
-        cpu->instr.opcode = instr & 0x7f;
-    }
+static bool fetch(riscv_cpu *cpu, uint64_t paddr)
+{
+    cpu->instr = &cpu->instr_buf;
+    if (!__fetch(cpu, paddr, cpu->instr))
+        return false;
 
-    LOG_DEBUG("[DEBUG] mode %d, pc: %lx instr: 0x%x\n", cpu->mode, pc,
-              cpu->instr.instr);
+    LOG_DEBUG("[DEBUG] mode %d, pc: %lx instr: 0x%x\n", cpu->mode, paddr,
+              cpu->instr->instr);
 
-    cpu->pc += pc_shift;
+    cpu->pc += instr_len(cpu->instr);
     return true;
 }
 
-static bool decode(riscv_cpu *cpu)
+static void report_invalid_instr(riscv_instr *instr, uint64_t instr_addr)
+{
+    ERROR("Not implemented or invalid instruction:\ninstr = 0x%x at pc %lx\n",
+          instr->instr, instr_addr);
+}
+
+static bool decode(riscv_cpu *cpu, __attribute__((unused)) uint64_t paddr)
 {
-    bool ret = __decode(cpu, &opcode_type_list);
+    uint64_t instr_addr = cpu->pc - instr_len(cpu->instr);
+    bool ret = flat_decode(cpu, cpu->instr);
 
-    LOG_DEBUG(
-        "[DEBUG] instr: 0x%x opcode = 0x%x funct3 = 0x%x funct7 = 0x%x\n"
-        "        rs1 = 0x%x rs2 = 0x%x rd = 0x%x\n",
-        cpu->instr.instr, cpu->instr.opcode, cpu->instr.funct3,
-        cpu->instr.funct7, cpu->instr.rs1, cpu->instr.rs2, cpu->instr.rd);
+    if (!ret && cpu->exc.exception == IllegalInstruction)
+        report_invalid_instr(cpu->instr, instr_addr);
+
+    LOG_DEBUG("[DEBUG] instr: 0x%x rs1 = 0x%x rs2 = 0x%x rd = 0x%x\n",
+              cpu->instr->instr, cpu->instr->rs1, cpu->instr->rs2,
+              cpu->instr->rd);
 
 #ifdef ICACHE_CONFIG
-    // cache the decoding result
+    /* Cache the decoding result, and mark the instruction as code so we can
+     * notice if it is overwritten */
     if (ret) {
-        if ((cpu->instr.instr & 0x3) != 0x3)
-            write_icache(&cpu->icache, cpu->pc - 2, cpu->instr);
-        else
-            write_icache(&cpu->icache, cpu->pc - 4, cpu->instr);
+        write_icache(&cpu->icache, paddr, cpu->instr);
+        mark_block_cache_code(&cpu->block_cache, paddr,
+                              instr_len(cpu->instr));
     }
 #endif
 
@@ -2309,24 +2647,291 @@ static bool decode(riscv_cpu *cpu)
 
 static bool exec(riscv_cpu *cpu)
 {
-    cpu->instr.exec_func(cpu);
-
-    // Emulate register x0 to 0
-    cpu->xreg[0] = 0;
+    handler_table[cpu->instr->handler](cpu);
 
     if (cpu->exc.exception != NoException)
         return false;
 
         /* If all of our implementation are right, we don't actually need to
          * clean up the structure below. But for easily debugging purpose, we'll
-         * reset all of the instruction-relatd structure now. */
+         * reset the reference to the instruction-relatd structure now. Note
+         * that the structure itself may be cached, so it can't be reset. */
 #ifdef DEBUG
-    memset(&cpu->instr, 0, sizeof(riscv_instr));
-    cpu->instr.exec_func = NULL;
+    cpu->instr = NULL;
 #endif
     return true;
 }
 
+/* Whether the instruction should be the last one of a block, which are the
+ * instructions that may change the control flow or the privileged state */
+static bool instr_ends_block(riscv_instr *instr)
+{
+    uint32_t raw = instr->instr;
+
+    if ((raw & 0x3) != 0x3) {
+        uint8_t funct3 = (raw >> 13) & 0x7;
+
+        switch (raw & 0x3) {
+        case 0x1:
+            // C.J, C.BEQZ, C.BNEZ
+            return funct3 >= 0x5;
+        case 0x2:
+            // C.JR, C.JALR, C.EBREAK
+            return funct3 == 0x4 && ((raw >> 2) & 0x1f) == 0;
+        default:
+            return false;
+        }
+    }
+
+    switch (raw & 0x7f) {
+    case 0x63:  // BRANCH
+    case 0x67:  // JALR
+    case 0x6f:  // JAL
+    case 0x73:  // SYSTEM
+        return true;
+    case 0x0f:  // FENCE.I
+        return ((raw >> 12) & 0x7) == 0x1;
+    default:
+        return false;
+    }
+}
+
+/* The blocks are tagged with the translation mode, ASID and the privilege
+ * level, so a block is only reused under the same context where it is
+ * built. */
+static uint64_t block_tag(riscv_cpu *cpu)
+{
+    return (read_csr(&cpu->csr, SATP) & ~SATP_PPN) | cpu->mode.mode;
+}
+
+/* Return the fused operation of the adjacent instructions, or OP_CALL if they
+ * can't be fused. Only the common idioms emitted by the compilers are fused,
+ * where the second instruction consumes the result of the first one:
+ * - lui + addi(w): load a 32 bits constant
+ * - auipc + addi/ld: load a PC-relative address or value
+ * - auipc + jalr: call a far function
+ * - slli + srli: zero-extend a value
+ * - slt(u) + beqz/bnez: compare and branch */
+static riscv_op fuse_op(riscv_instr *first, riscv_instr *second)
+{
+    if (second->rs1 != first->rd)
+        return OP_CALL;
+
+    bool same_rd = second->rd == first->rd;
+
+    switch (first->op) {
+    case OP_LUI:
+        if (second->op == OP_ADDI && same_rd)
+            return OP_LUI_ADDI;
+        if (second->op == OP_ADDIW && same_rd)
+            return OP_LUI_ADDIW;
+        break;
+    case OP_AUIPC:
+        if (second->op == OP_ADDI && same_rd)
+            return OP_AUIPC_ADDI;
+        if (second->op == OP_LD && same_rd)
+            return OP_AUIPC_LD;
+        if (second->op == OP_JALR || second->op == OP_JR)
+            return OP_AUIPC_JALR;
+        break;
+    case OP_SLLI:
+        if (second->op == OP_SRLI && same_rd)
+            return OP_SLLI_SRLI;
+        break;
+    case OP_SLT:
+    case OP_SLTU:
+        if (second->rs2 != 0)
+            break;
+        if (second->op == OP_BEQ)
+            return first->op == OP_SLT ? OP_SLT_BEQ : OP_SLTU_BEQ;
+        if (second->op == OP_BNE)
+            return first->op == OP_SLT ? OP_SLT_BNE : OP_SLTU_BNE;
+        break;
+    default:
+        break;
+    }
+
+    return OP_CALL;
+}
+
+static bool is_link_reg(uint8_t reg)
+{
+    return reg == 1 || reg == 5;
+}
+
+/* How the block is left, which is decided by its last instruction */
+static riscv_block_exit block_exit(riscv_instr *instr)
+{
+    if (!instr_ends_block(instr))
+        return BLOCK_EXIT_FALL;
+
+    switch (instr->op) {
+    case OP_BEQ:
+    case OP_BNE:
+    case OP_BLT:
+    case OP_BGE:
+    case OP_BLTU:
+    case OP_BGEU:
+        return BLOCK_EXIT_BRANCH;
+    case OP_JAL:
+        return is_link_reg(instr->rd) ? BLOCK_EXIT_CALL : BLOCK_EXIT_JUMP;
+    case OP_J:
+        return BLOCK_EXIT_JUMP;
+    case OP_JALR:
+    case OP_JR:
+        if (is_link_reg(instr->rd))
+            return BLOCK_EXIT_CALL;
+        return is_link_reg(instr->rs1) ? BLOCK_EXIT_RETURN : BLOCK_EXIT_JUMP;
+    default:
+        // the others may change the privileged state or the translation
+        return BLOCK_EXIT_NONE;
+    }
+}
+
+static riscv_block *decode_block(riscv_cpu *cpu, uint64_t paddr, uint64_t tag)
+{
+    riscv_block *block = alloc_block(&cpu->block_cache);
+    uint64_t addr = paddr;
+    int cnt = 0;
+    // whether the previous instruction is the second one of a fused pair
+    bool fused = false;
+    int fused_cnt = 0;
+
+    while (cnt < BLOCK_MAX_INSTR) {
+        riscv_instr *instr = &block->instr[cnt];
+
+        if (!__fetch(cpu, addr, instr) ||
+            !flat_decode(cpu, instr)) {
+            if (cnt == 0) {
+                if (cpu->exc.exception == IllegalInstruction)
+                    report_invalid_instr(instr, cpu->pc);
+                return NULL;
+            }
+            /* The instruction which can't be fetched or decoded is left for
+             * the next block, so the exception is only raised if we actually
+             * execute it. */
+            cpu->exc.exception = NoException;
+            break;
+        }
+
+        riscv_op op = OP_CALL;
+        if (cpu->fusion_mode && cnt > 0 && !fused)
+            op = fuse_op(instr - 1, instr);
+        if (op != OP_CALL) {
+            (instr - 1)->op = op;
+            (instr - 1)->handler = fused_handler[op - OP_FUSED_START];
+            cpu->fusion_cnt[op - OP_FUSED_START]++;
+            fused_cnt++;
+        }
+        fused = (op != OP_CALL);
+
+        cnt++;
+        addr += instr_len(instr);
+
+        if (instr_ends_block(instr))
+            break;
+
+        // the next instruction could be in another virtual page
+        if ((addr >> PAGE_SHIFT) != (paddr >> PAGE_SHIFT))
+            break;
+    }
+
+    block->paddr = paddr;
+    block->tag = tag;
+    block->size = addr - paddr;
+    block->instr_cnt = cnt;
+    block->fused_cnt = fused_cnt;
+    block->exit = block_exit(&block->instr[cnt - 1]);
+    memset(block->link, 0, sizeof(block->link));
+    block->exec_cnt = 0;
+    block->jit_code = NULL;
+    write_block_cache(&cpu->block_cache, block);
+
+    return block;
+}
+
+static riscv_block *fetch_block(riscv_cpu *cpu)
+{
+    riscv_block_cache *cache = &cpu->block_cache;
+    riscv_block_link *link = cpu->link;
+    uint64_t gen = cpu->link_gen;
+
+    cpu->link = NULL;
+    // the block which the link belongs to may be dropped and reused
+    if (gen != cache->link_gen)
+        link = NULL;
+
+    /* The switch of ASID doesn't drop the links, so the linked block should
+     * also be built under the current context */
+    uint64_t tag = block_tag(cpu);
+    if (link != NULL && link->block != NULL && link->gen == gen &&
+        link->pc == cpu->pc && link->block->valid && link->block->tag == tag)
+        return link->block;
+
+    uint64_t paddr = addr_translate(cpu, cpu->pc, Access_Instr);
+    if (cpu->exc.exception != NoException)
+        return NULL;
+
+    riscv_block *block = read_block_cache(cache, paddr, tag);
+    if (block == NULL)
+        block = decode_block(cpu, paddr, tag);
+
+    // decoding the block could drop all of the blocks
+    if (block != NULL && link != NULL && gen == cache->link_gen) {
+        link->pc = cpu->pc;
+        link->gen = gen;
+        link->block = block;
+    }
+
+    return block;
+}
+
+/* Find out the link where the next block is found from, after the block which
+ * starts at 'pc' is executed completely */
+static void link_block(riscv_cpu *cpu, riscv_block *block, uint64_t pc)
+{
+    riscv_block_cache *cache = &cpu->block_cache;
+    uint64_t next_pc = pc + block->size;
+    riscv_block_link *link = NULL;
+
+    // the space of the dropped block could be reused by the other blocks
+    if (!block->valid)
+        return;
+
+    switch (block->exit) {
+    case BLOCK_EXIT_FALL:
+        link = &block->link[1];
+        break;
+    case BLOCK_EXIT_BRANCH:
+        link = (cpu->pc == next_pc) ? &block->link[1] : &block->link[0];
+        break;
+    case BLOCK_EXIT_JUMP:
+        link = &block->link[0];
+        break;
+    case BLOCK_EXIT_CALL:
+        cpu->ras[cpu->ras_top++ & (RAS_SIZE - 1)] = (riscv_ras_entry){
+            .link = &block->link[1],
+            .gen = cache->link_gen,
+        };
+        link = &block->link[0];
+        break;
+    case BLOCK_EXIT_RETURN: {
+        riscv_ras_entry *entry = &cpu->ras[--cpu->ras_top & (RAS_SIZE - 1)];
+        // use the link of the jump as an inline cache if we can't predict
+        if (entry->link != NULL && entry->gen == cache->link_gen)
+            link = entry->link;
+        else
+            link = &block->link[0];
+        break;
+    }
+    default:
+        break;
+    }
+
+    cpu->link = link;
+    cpu->link_gen = cache->link_gen;
+}
+
 static void dump_reg(riscv_cpu *cpu)
 {
     static char *abi_name[] = {
@@ -2356,58 +2961,405 @@ static void dump_csr(riscv_cpu *cpu)
     printf("%-10s = 0x%-16lx\n", "SCAUSE", read_csr(&cpu->csr, SCAUSE));
 }
 
-bool step_cpu(riscv_cpu *cpu)
+static bool take_trap(riscv_cpu *cpu, uint64_t instr_addr)
 {
-    // TODO: sync mtime in Clint and TIME in CSR
-    // Increment the value for Time in CSR
-    tick_csr(&cpu->csr);
-    // Increment the value for mtime in Clint
-    tick_bus(&cpu->bus, &cpu->csr);
-    handle_interrupt(cpu);
+    uint64_t next_pc = cpu->pc;
+    Trap trap = handle_exception(cpu, instr_addr);
+    if (trap == Trap_Fatal) {
+        dump_reg(cpu);
+        dump_csr(cpu);
+        ERROR("CPU mode: %d, exception %x happen before pc %lx\n",
+              cpu->mode.mode, cpu->exc.exception, next_pc);
+        return false;
+    }
+    // reset exception flag if recovery from trap
+    cpu->exc.exception = NoException;
+    return true;
+}
 
+/* Execute a single instruction, which is used under debug mode so the debugger
+ * can stop at any instruction */
+static bool step_instr(riscv_cpu *cpu, uint64_t *cycles)
+{
     uint64_t instr_addr = cpu->pc;
-    bool ret = true;
+
+    *cycles = 1;
+
+    uint64_t paddr = addr_translate(cpu, cpu->pc, Access_Instr);
+    if (cpu->exc.exception != NoException)
+        return take_trap(cpu, instr_addr);
 
 #ifdef ICACHE_CONFIG
-    if (!fetch_icache(cpu))
+    if (!fetch_icache(cpu, paddr))
 #endif
     {
-        ret = fetch(cpu);
-        if (!ret)
-            goto get_trap;
+        if (!fetch(cpu, paddr) || !decode(cpu, paddr))
+            return take_trap(cpu, instr_addr);
+    }
 
-        ret = decode(cpu);
-        if (!ret)
-            goto get_trap;
-    }
-
-    ret = exec(cpu);
-get_trap:
-    if (!ret) {
-        uint64_t next_pc = cpu->pc;
-        Trap trap = handle_exception(cpu, instr_addr);
-        if (trap == Trap_Fatal) {
-            dump_reg(cpu);
-            dump_csr(cpu);
-            ERROR("CPU mode: %d, exception %x happen before pc %lx\n",
-                  cpu->mode.mode, cpu->exc.exception, next_pc);
-            return false;
+    if (!exec(cpu))
+        return take_trap(cpu, instr_addr);
+
+    return true;
+}
+
+/* Translate the block if it is executed frequently enough */
+static void jit_block(riscv_cpu *cpu, riscv_block *block)
+{
+    if (++block->exec_cnt < JIT_HOT_THRESHOLD)
+        return;
+
+    block->jit_code = translate_jit(&cpu->jit, block);
+    if (block->jit_code == NULL) {
+        /* Run out of the space for translated code, so drop all of the
+         * translated code and the blocks which reference to them. This block
+         * is still fine to be interpreted now. */
+        invalid_jit(&cpu->jit);
+        invalid_block_cache(&cpu->block_cache);
+    }
+}
+
+static bool exec_jit_block(riscv_cpu *cpu,
+                           riscv_block *block,
+                           uint64_t *cycles)
+{
+    uint64_t instr_addr = cpu->pc;
+    uint64_t cnt = ((jit_func) block->jit_code)(cpu);
+
+    *cycles += cnt;
+    if (cpu->exc.exception == NoException) {
+        link_block(cpu, block, instr_addr);
+        return true;
+    }
+
+    // find the address of the faulting instruction
+    for (uint64_t i = 0; i < cnt - 1; i++)
+        instr_addr += instr_len(&block->instr[i]);
+
+    return take_trap(cpu, instr_addr);
+}
+
+/* The threaded interpreter, which jumps from the handler of an instruction to
+ * the handler of next instruction directly with the GCC extension "labels as
+ * values". The hot instructions are inlined into their handlers, so no function
+ * call is required for them. Each handler ends with its own indirect jump,
+ * which is easier for the host to predict than a single shared one. */
+static bool exec_block_threaded(riscv_cpu *cpu,
+                                riscv_block *block,
+                                uint64_t *cycles)
+{
+    static void *const dispatch_table[] = {
+        [OP_CALL] = &&op_call,
+        [OP_LUI] = &&op_lui,
+        [OP_AUIPC] = &&op_auipc,
+        [OP_ADDI] = &&op_addi,
+        [OP_SLTI] = &&op_slti,
+        [OP_SLTIU] = &&op_sltiu,
+        [OP_XORI] = &&op_xori,
+        [OP_ORI] = &&op_ori,
+        [OP_ANDI] = &&op_andi,
+        [OP_SLLI] = &&op_slli,
+        [OP_SRLI] = &&op_srli,
+        [OP_SRAI] = &&op_srai,
+        [OP_ADD] = &&op_add,
+        [OP_SUB] = &&op_sub,
+        [OP_SLL] = &&op_sll,
+        [OP_SLT] = &&op_slt,
+        [OP_SLTU] = &&op_sltu,
+        [OP_XOR] = &&op_xor,
+        [OP_SRL] = &&op_srl,
+        [OP_SRA] = &&op_sra,
+        [OP_OR] = &&op_or,
+        [OP_AND] = &&op_and,
+        [OP_MUL] = &&op_mul,
+        [OP_ADDIW] = &&op_addiw,
+        [OP_SLLIW] = &&op_slliw,
+        [OP_SRLIW] = &&op_srliw,
+        [OP_SRAIW] = &&op_sraiw,
+        [OP_ADDW] = &&op_addw,
+        [OP_SUBW] = &&op_subw,
+        [OP_SLLW] = &&op_sllw,
+        [OP_SRLW] = &&op_srlw,
+        [OP_SRAW] = &&op_sraw,
+        [OP_MULW] = &&op_mulw,
+        [OP_LB] = &&op_lb,
+        [OP_LH] = &&op_lh,
+        [OP_LW] = &&op_lw,
+        [OP_LD] = &&op_ld,
+        [OP_LBU] = &&op_lbu,
+        [OP_LHU] = &&op_lhu,
+        [OP_LWU] = &&op_lwu,
+        [OP_SB] = &&op_sb,
+        [OP_SH] = &&op_sh,
+        [OP_SW] = &&op_sw,
+        [OP_SD] = &&op_sd,
+        [OP_BEQ] = &&op_beq,
+        [OP_BNE] = &&op_bne,
+        [OP_BLT] = &&op_blt,
+        [OP_BGE] = &&op_bge,
+        [OP_BLTU] = &&op_bltu,
+        [OP_BGEU] = &&op_bgeu,
+        [OP_JAL] = &&op_jal,
+        [OP_JALR] = &&op_jalr,
+        [OP_NOP] = &&op_nop,
+        [OP_LI] = &&op_li,
+        [OP_MV] = &&op_mv,
+        [OP_J] = &&op_j,
+        [OP_JR] = &&op_jr,
+        [OP_LUI_ADDI] = &&op_lui_addi,
+        [OP_LUI_ADDIW] = &&op_lui_addiw,
+        [OP_AUIPC_ADDI] = &&op_auipc_addi,
+        [OP_AUIPC_LD] = &&op_auipc_ld,
+        [OP_AUIPC_JALR] = &&op_auipc_jalr,
+        [OP_SLLI_SRLI] = &&op_slli_srli,
+        [OP_SLT_BEQ] = &&op_slt_beq,
+        [OP_SLT_BNE] = &&op_slt_bne,
+        [OP_SLTU_BEQ] = &&op_sltu_beq,
+        [OP_SLTU_BNE] = &&op_sltu_bne,
+    };
+
+    riscv_instr *instr = block->instr;
+    riscv_instr *end = block->instr + block->instr_cnt;
+    uint64_t block_pc = cpu->pc;
+    uint64_t instr_addr = cpu->pc;
+
+/* Note that the handler of fused pair moves the current instruction to the
+ * second one of the pair, so we continue from the next of it */
+#define DISPATCH()                             \
+    do {                                       \
+        if (cpu->exc.exception != NoException) \
+            goto trap;                         \
+        instr = cpu->instr + 1;                \
+        if (instr == end)                      \
+            goto done;                         \
+        instr_addr = cpu->pc;                  \
+        cpu->instr = instr;                    \
+        cpu->pc += instr_len(instr);           \
+        goto *dispatch_table[instr->op];       \
+    } while (0)
+
+#define THREADED_OP(_label, _func) \
+    _label:                        \
+    _func(cpu);                    \
+    DISPATCH();
+
+    cpu->instr = instr;
+    cpu->pc += instr_len(instr);
+    goto *dispatch_table[instr->op];
+
+op_call:
+    handler_table[cpu->instr->handler](cpu);
+    DISPATCH();
+
+    THREADED_OP(op_lui, instr_lui)
+    THREADED_OP(op_auipc, instr_auipc)
+    THREADED_OP(op_addi, instr_addi)
+    THREADED_OP(op_slti, instr_slti)
+    THREADED_OP(op_sltiu, instr_sltiu)
+    THREADED_OP(op_xori, instr_xori)
+    THREADED_OP(op_ori, instr_ori)
+    THREADED_OP(op_andi, instr_andi)
+    THREADED_OP(op_slli, instr_slli)
+    THREADED_OP(op_srli, instr_srli)
+    THREADED_OP(op_srai, instr_srai)
+    THREADED_OP(op_add, instr_add)
+    THREADED_OP(op_sub, instr_sub)
+    THREADED_OP(op_sll, instr_sll)
+    THREADED_OP(op_slt, instr_slt)
+    THREADED_OP(op_sltu, instr_sltu)
+    THREADED_OP(op_xor, instr_xor)
+    THREADED_OP(op_srl, instr_srl)
+    THREADED_OP(op_sra, instr_sra)
+    THREADED_OP(op_or, instr_or)
+    THREADED_OP(op_and, instr_and)
+    THREADED_OP(op_mul, instr_mul)
+    THREADED_OP(op_addiw, instr_addiw)
+    THREADED_OP(op_slliw, instr_slliw)
+    THREADED_OP(op_srliw, instr_srliw)
+    THREADED_OP(op_sraiw, instr_sraiw)
+    THREADED_OP(op_addw, instr_addw)
+    THREADED_OP(op_subw, instr_subw)
+    THREADED_OP(op_sllw, instr_sllw)
+    THREADED_OP(op_srlw, instr_srlw)
+    THREADED_OP(op_sraw, instr_sraw)
+    THREADED_OP(op_mulw, instr_mulw)
+    THREADED_OP(op_lb, instr_lb)
+    THREADED_OP(op_lh, instr_lh)
+    THREADED_OP(op_lw, instr_lw)
+    THREADED_OP(op_ld, instr_ld)
+    THREADED_OP(op_lbu, instr_lbu)
+    THREADED_OP(op_lhu, instr_lhu)
+    THREADED_OP(op_lwu, instr_lwu)
+    THREADED_OP(op_sb, instr_sb)
+    THREADED_OP(op_sh, instr_sh)
+    THREADED_OP(op_sw, instr_sw)
+    THREADED_OP(op_sd, instr_sd)
+    THREADED_OP(op_beq, instr_beq)
+    THREADED_OP(op_bne, instr_bne)
+    THREADED_OP(op_blt, instr_blt)
+    THREADED_OP(op_bge, instr_bge)
+    THREADED_OP(op_bltu, instr_bltu)
+    THREADED_OP(op_bgeu, instr_bgeu)
+    THREADED_OP(op_jal, instr_jal)
+    THREADED_OP(op_jalr, instr_jalr)
+    THREADED_OP(op_nop, instr_nop)
+    THREADED_OP(op_li, instr_li)
+    THREADED_OP(op_mv, instr_mv)
+    THREADED_OP(op_j, instr_j)
+    THREADED_OP(op_jr, instr_jr)
+    THREADED_OP(op_lui_addi, instr_lui_addi)
+    THREADED_OP(op_lui_addiw, instr_lui_addiw)
+    THREADED_OP(op_auipc_addi, instr_auipc_addi)
+    THREADED_OP(op_auipc_ld, instr_auipc_ld)
+    THREADED_OP(op_auipc_jalr, instr_auipc_jalr)
+    THREADED_OP(op_slli_srli, instr_slli_srli)
+    THREADED_OP(op_slt_beq, instr_slt_beq)
+    THREADED_OP(op_slt_bne, instr_slt_bne)
+    THREADED_OP(op_sltu_beq, instr_sltu_beq)
+    THREADED_OP(op_sltu_bne, instr_sltu_bne)
+
+#undef THREADED_OP
+#undef DISPATCH
+
+done:
+    *cycles += block->instr_cnt;
+    link_block(cpu, block, block_pc);
+    return true;
+
+trap:
+    // an exception can only be raised by the second instruction of fused pair
+    if (cpu->instr != instr)
+        instr_addr += instr_len(instr);
+    *cycles += cpu->instr - block->instr + 1;
+    return take_trap(cpu, instr_addr);
+}
+
+static bool step_block(riscv_cpu *cpu, uint64_t *cycles)
+{
+    uint64_t block_pc = cpu->pc;
+    riscv_block *block = fetch_block(cpu);
+
+    if (block == NULL) {
+        *cycles = 1;
+        return take_trap(cpu, block_pc);
+    }
+
+    /* Count the fused pairs by the block instead of by their handlers, so all
+     * of the ways to execute the block are covered without the cost on each
+     * pair. The pairs after an exception in the block are counted too. */
+    cpu->fused_exec_cnt += block->fused_cnt;
+
+    if (cpu->jit_mode) {
+        if (block->jit_code == NULL)
+            jit_block(cpu, block);
+
+        if (block->jit_code != NULL)
+            return exec_jit_block(cpu, block, cycles);
+    }
+
+    if (cpu->threaded_mode)
+        return exec_block_threaded(cpu, block, cycles);
+
+    for (int i = 0; i < block->instr_cnt; i++) {
+        riscv_instr *instr = &block->instr[i];
+        uint64_t instr_addr = cpu->pc;
+
+        cpu->instr = instr;
+        cpu->pc += instr_len(instr);
+        (*cycles)++;
+
+        bool ret = exec(cpu);
+
+        /* The fused pair is executed at once, and only the second instruction
+         * of the pair may raise an exception */
+        if (is_fused_op(instr->op)) {
+            instr_addr += instr_len(instr);
+            i++;
+            (*cycles)++;
         }
-        // reset exception flag if recovery from trap
-        cpu->exc.exception = NoException;
-#ifdef ICACHE_CONFIG
-        // flush cache when jumping in trap handler
-        invalid_icache(&cpu->icache);
-#endif
+
+        if (!ret)
+            return take_trap(cpu, instr_addr);
     }
 
+    link_block(cpu, block, block_pc);
     return true;
 }
 
+/* The hart stalled by WFI is resumed when any interrupt enabled in MIE is
+ * pending, even if the interrupts are disabled globally. Instead of running
+ * the idle loop of the guest, the host waits until the next device event, or
+ * the time jumps to the event directly under time warp. The time passed is
+ * returned. */
+static uint64_t idle_cpu(riscv_cpu *cpu)
+{
+    if (read_csr(&cpu->csr, MIE) & read_csr(&cpu->csr, MIP)) {
+        cpu->wfi = false;
+        return 0;
+    }
+
+    return idle_bus(&cpu->bus, cpu->warp_mode);
+}
+
+bool step_cpu(riscv_cpu *cpu)
+{
+    uint64_t cycles = 0;
+    bool ret = true;
+
+    /* The pending interrupts can only be taken after MIP, MIE, the status
+     * registers or the privilege mode are changed */
+    if (cpu->csr.irq_changed)
+        handle_interrupt(cpu);
+
+    if (cpu->wfi) {
+        cycles = idle_cpu(cpu);
+    } else {
+        if (cpu->debug_mode)
+            ret = step_instr(cpu, &cycles);
+        else
+            ret = step_block(cpu, &cycles);
+
+        cpu->instr_cnt += cycles;
+    }
+
+    /* Advance the time, which is shared by mtime in Clint and TIME in CSR, and
+     * handle the device events */
+    tick_bus(&cpu->bus, &cpu->csr, cycles);
+
+    return ret;
+}
+
+static void dump_fusion(riscv_cpu *cpu)
+{
+    static char *fused_name[OP_FUSED_CNT] = {
+        [OP_LUI_ADDI - OP_FUSED_START] = "lui + addi",
+        [OP_LUI_ADDIW - OP_FUSED_START] = "lui + addiw",
+        [OP_AUIPC_ADDI - OP_FUSED_START] = "auipc + addi",
+        [OP_AUIPC_LD - OP_FUSED_START] = "auipc + ld",
+        [OP_AUIPC_JALR - OP_FUSED_START] = "auipc + jalr",
+        [OP_SLLI_SRLI - OP_FUSED_START] = "slli + srli",
+        [OP_SLT_BEQ - OP_FUSED_START] = "slt + beqz",
+        [OP_SLT_BNE - OP_FUSED_START] = "slt + bnez",
+        [OP_SLTU_BEQ - OP_FUSED_START] = "sltu + beqz",
+        [OP_SLTU_BNE - OP_FUSED_START] = "sltu + bnez",
+    };
+
+    fprintf(stderr, "%lu of %lu executed instructions are fused\n",
+            cpu->fused_exec_cnt * 2, cpu->instr_cnt);
+    fprintf(stderr, "the fused pairs in the decoded blocks:\n");
+    for (int i = 0; i < OP_FUSED_CNT; i++)
+        fprintf(stderr, "%-14s: %lu\n", fused_name[i], cpu->fusion_cnt[i]);
+}
+
 void free_cpu(riscv_cpu *cpu)
 {
+    if (cpu->fusion_stats)
+        dump_fusion(cpu);
+
     free_bus(&cpu->bus);
 #ifdef ICACHE_CONFIG
     free_icache(&cpu->icache);
 #endif
+    free_block_cache(&cpu->block_cache);
+    free_jit(&cpu->jit);
 }
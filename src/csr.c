@@ -39,6 +39,7 @@ bool init_csr(riscv_csr *csr)
                         (1 << 2) |     // Compressed extension)
                         1;             // Atomic extension
     write_csr(csr, MISA, misa_val);
+    csr->irq_changed = true;
     return true;
 }
 
@@ -61,6 +62,23 @@ uint64_t read_csr(riscv_csr *csr, uint16_t addr)
     }
 }
 
+static inline bool is_irq_csr(uint16_t addr)
+{
+    switch (addr) {
+    case SSTATUS:
+    case SIDELEG:
+    case SIE:
+    case SIP:
+    case MSTATUS:
+    case MIDELEG:
+    case MIE:
+    case MIP:
+        return true;
+    default:
+        return false;
+    }
+}
+
 void write_csr(riscv_csr *csr, uint16_t addr, uint64_t value)
 {
     if (addr >= CSR_CAPACITY) {
@@ -68,6 +86,9 @@ void write_csr(riscv_csr *csr, uint16_t addr, uint64_t value)
         return;
     }
 
+    if (is_irq_csr(addr))
+        csr->irq_changed = true;
+
     switch (addr) {
     case SSTATUS: {
         uint64_t *mstatus = &csr->reg[MSTATUS];
@@ -104,8 +125,3 @@ void write_csr(riscv_csr *csr, uint16_t addr, uint64_t value)
         csr->reg[addr] = value;
     }
 }
-
-void tick_csr(riscv_csr *csr)
-{
-    csr->reg[TIME]++;
-}
@@ -1,5 +1,7 @@
 #include <assert.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -14,9 +16,10 @@
  */
 
 // TODO: don't mash all codes together for flexibility
-static bool make_dtb(const char *dtb_filename)
+static bool make_dtb(const char *dtb_filename, uint64_t mem_size)
 {
-    char dts_str[] =
+    // the size of memory is filled in by the high and low 32 bits
+    const char dts_fmt[] =
         "/dts-v1/; \n"
         "\n"
         "/ {\n"
@@ -33,14 +36,14 @@ static bool make_dtb(const char *dtb_filename)
         "    cpus {\n"
         "      #address-cells = <0x01>;\n"
         "      #size-cells = <0x00>;\n"
-        "      timebase-frequency = <0x989680>;\n"
+        "      timebase-frequency = <0x%x>;\n"
         "\n"
         "      CPU0: cpu@0 {\n"
         "        device_type = \"cpu\";\n"
         "        reg = <0x00>;\n"
         "        status = \"okay\";\n"
         "        compatible = \"riscv\";\n"
-        "        riscv,isa = \"rv64imac\";\n"
+        "        riscv,isa = \"rv64imac_svadu\";\n"
         "        mmu-type = \"riscv,sv39\";\n"
         "        CPU0_intc: interrupt-controller {\n"
         "            #interrupt-cells = <0x01>;\n"
@@ -52,7 +55,7 @@ static bool make_dtb(const char *dtb_filename)
         "\n"
         "    memory@80000000 {\n"
         "      device_type = \"memory\";\n"
-        "      reg = <0x0 0x80000000 0x0 0x8000000>;\n"
+        "      reg = <0x0 0x80000000 0x%x 0x%x>;\n"
         "    };\n"
         "\n"
         "    soc {\n"
@@ -95,7 +98,10 @@ static bool make_dtb(const char *dtb_filename)
         "\n"
         "};\n";
 
-    size_t dts_len = sizeof(dts_str);
+    char dts_str[sizeof(dts_fmt) + 16];
+    snprintf(dts_str, sizeof(dts_str), dts_fmt, CLINT_FREQ,
+             (uint32_t) (mem_size >> 32), (uint32_t) mem_size);
+    size_t dts_len = strlen(dts_str) + 1;
 
     // Convert the DTS to DTB
     int dts_pipe[2];
@@ -156,13 +162,15 @@ static bool make_dtb(const char *dtb_filename)
     return true;
 }
 
-riscv_emu *create_emu(const char *filename, const char *rfs_name)
+riscv_emu *create_emu(const char *filename,
+                      const char *rfs_name,
+                      const riscv_config *config)
 {
     /* Generate dtb file first before creating riscv_emu object, so
      * we can simply avoid to fork a process with a large number of
      * allocated memories (although it could be fine because of the
      * copy-on-write mechanism) */
-    if (!make_dtb(DTB_FILENAME)) {
+    if (!make_dtb(DTB_FILENAME, config->memory_size)) {
         ERROR("Fail to create dtb file!\n");
         return NULL;
     }
@@ -171,7 +179,12 @@ riscv_emu *create_emu(const char *filename, const char *rfs_name)
     if (!emu)
         return NULL;
 
-    if (!init_cpu(&emu->cpu, filename, rfs_name)) {
+    if (!init_cpu(&emu->cpu, filename, rfs_name, config)) {
+        free_emu(emu);
+        return NULL;
+    }
+
+    if (config->snapshot && !snapshot_mem(&emu->cpu.bus.memory)) {
         free_emu(emu);
         return NULL;
     }
@@ -179,9 +192,36 @@ riscv_emu *create_emu(const char *filename, const char *rfs_name)
     return emu;
 }
 
+/* Reset the emulator to the state just after it is created, which requires
+ * the snapshot to be kept at creation. It is much cheaper than creating the
+ * emulator again, since only the memory written since then is restored. */
+bool reset_emu(riscv_emu *emu)
+{
+    return restore_cpu(&emu->cpu);
+}
+
+static volatile sig_atomic_t emu_stopped = false;
+
+static void stop_emu(__attribute__((unused)) int sig)
+{
+    emu_stopped = true;
+}
+
+/* Fetch and clear the bitmap of the DRAM pages written since the last fetch,
+ * where each bit is for a 4 KiB page. The bitmap should be large enough for
+ * the DRAM size given by riscv_config. */
+void fetch_dirty_emu(riscv_emu *emu, uint64_t *bitmap)
+{
+    fetch_dirty_mem(&emu->cpu.bus.memory, bitmap);
+}
+
 void run_emu(riscv_emu *emu)
 {
-    while (step_cpu(&emu->cpu))
+    /* Stop the emulator gracefully on Ctrl-C, so the emulator can be cleaned
+     * up and report the statistics */
+    signal(SIGINT, stop_emu);
+
+    while (!emu_stopped && step_cpu(&emu->cpu))
         ;
 }
 
@@ -21,9 +21,10 @@ static void gdbstub_write_reg(void *args, int regno, size_t data)
     if (regno > 32)
         return;
 
+    // x0 is hardwired to zero
     if (regno == 32)
         emu->cpu.pc = data;
-    else
+    else if (regno != 0)
         emu->cpu.xreg[regno] = data;
 }
 
@@ -32,7 +33,7 @@ static void gdbstub_read_mem(void *args, size_t addr, size_t len, void *val)
     riscv_emu *emu = (riscv_emu *) args;
 
     for (size_t i = 0; i < len; i++)
-        *((uint8_t *) val + i) = read_cpu(&emu->cpu, addr + i, 8);
+        *((uint8_t *) val + i) = read_cpu_debug(&emu->cpu, addr + i, 8);
 }
 
 static void gdbstub_write_mem(void *args, size_t addr, size_t len, void *val)
@@ -40,7 +41,7 @@ static void gdbstub_write_mem(void *args, size_t addr, size_t len, void *val)
     riscv_emu *emu = (riscv_emu *) args;
 
     for (size_t i = 0; i < len; i++)
-        write_cpu(&emu->cpu, addr + i, 8, *((uint8_t *) val + i));
+        write_cpu_debug(&emu->cpu, addr + i, 8, *((uint8_t *) val + i));
 }
 
 static inline bool is_interrupted(riscv_emu *emu)
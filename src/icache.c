@@ -5,139 +5,108 @@
 
 #include "icache.h"
 
-bool init_icache(riscv_icache *icache)
+#define CACHE_LINE_SIZE 64
+
+bool init_icache(riscv_icache *icache, uint32_t set_cnt, uint32_t way_cnt)
 {
-    for (int set = 0; set < CACHE_SET_CNT; set++) {
-        riscv_icache_entry *prev = NULL;
+    if (set_cnt == 0 || (set_cnt & (set_cnt - 1)) != 0) {
+        ERROR("The number of I-cache sets should be a power of 2\n");
+        return false;
+    }
 
-        for (int i = 0; i < CACHE_WAY_CNT; i++) {
-            riscv_icache_entry *entry = malloc(sizeof(riscv_icache_entry));
-            if (entry == NULL)
-                return false;
+    if (way_cnt == 0 || way_cnt > ICACHE_MAX_WAY_CNT) {
+        ERROR("The number of I-cache ways should be in 1 to %d\n",
+              ICACHE_MAX_WAY_CNT);
+        return false;
+    }
 
-            entry->valid = false;
+    uint64_t size = (uint64_t) set_cnt * way_cnt * sizeof(riscv_icache_entry);
+    // the size of aligned_alloc should be a multiple of the alignment
+    size = (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1UL);
 
-            if (i == 0)
-                icache->set[set].head = entry;
-            else
-                prev->next = entry;
+    icache->entry = aligned_alloc(CACHE_LINE_SIZE, size);
+    if (icache->entry == NULL)
+        return false;
 
-            prev = entry;
-        }
-        prev->next = NULL;
+    icache->mru = malloc(set_cnt * sizeof(uint64_t));
+    if (icache->mru == NULL) {
+        free(icache->entry);
+        return false;
     }
 
+    icache->set_cnt = set_cnt;
+    icache->way_cnt = way_cnt;
+    icache->epoch = 0;
+    invalid_icache(icache);
+
     return true;
 }
 
-riscv_instr *read_icache(riscv_icache *icache, uint64_t addr)
+static inline uint64_t icache_index(riscv_icache *icache, uint64_t paddr)
 {
     // since the address is a least 2 bytes, 1 bit is for offset
-    uint64_t index = (addr >> 1) & (CACHE_SET_CNT - 1);
-    uint64_t tag = (addr >> (1 + CACHE_INDEX_BIT));
-
-    riscv_icache_entry *entry = icache->set[index].head;
-    riscv_icache_entry *prev = NULL;
-
-    for (int i = 0; i < CACHE_WAY_CNT; i++) {
-        if (entry->valid == true && entry->tag == tag) {
-            // pending the recently used entry to head
-            if (prev != NULL) {
-                prev->next = entry->next;
-                entry->next = icache->set[index].head;
-                icache->set[index].head = entry;
-            }
-            return &entry->instr;
-        }
+    return (paddr >> 1) & (icache->set_cnt - 1);
+}
 
-        prev = entry;
-        entry = entry->next;
-    }
+static inline void touch_icache(riscv_icache *icache, uint64_t set, int way)
+{
+    uint64_t all =
+        (icache->way_cnt == 64) ? ~0UL : (1UL << icache->way_cnt) - 1;
 
-    return NULL;
+    icache->mru[set] |= 1UL << way;
+    if (icache->mru[set] == all)
+        icache->mru[set] = 1UL << way;
 }
 
-void write_icache(riscv_icache *icache, uint64_t addr, riscv_instr instr)
+riscv_instr *read_icache(riscv_icache *icache, uint64_t paddr)
 {
-    /* According to our policy, the last node in linked list should be the least
-     * recently used, so it is the candidate to be replaced. The 'tail' pointer
-     * can help us to access it faster */
-
-    uint64_t index = (addr >> 1) & (CACHE_SET_CNT - 1);
-    uint64_t tag = (addr >> (1 + CACHE_INDEX_BIT));
-
-    riscv_icache_entry *entry = icache->set[index].head;
-    riscv_icache_entry *prev = NULL;
-
-    for (int i = 0; i < CACHE_WAY_CNT; i++) {
-        if (entry->valid == true && entry->tag == tag) {
-            if (prev != NULL)
-                goto update_cache;
-            else
-                return;
-        }
+    uint64_t set = icache_index(icache, paddr);
+    riscv_icache_entry *entry = &icache->entry[set * icache->way_cnt];
 
-        // avoid update in last iteration
-        if (i == CACHE_WAY_CNT - 1) {
-            prev = entry;
-            entry = entry->next;
+    for (uint32_t way = 0; way < icache->way_cnt; way++) {
+        if (entry[way].valid && entry[way].tag == paddr) {
+            touch_icache(icache, set, way);
+            return &entry[way].instr;
         }
     }
 
-    // if tag doesn't match any tag in cache, the candidate wiil be the last
-    // entry
-    entry->valid = true;
-    entry->tag = tag;
-    memcpy(&entry->instr, &instr, sizeof(riscv_instr));
-
-update_cache:
-    // after replacement, pending the entry to head
-    prev->next = entry->next;
-    entry->next = icache->set[index].head;
-    icache->set[index].head = entry;
+    return NULL;
 }
 
-void invalid_icache(riscv_icache *icache)
+void write_icache(riscv_icache *icache, uint64_t paddr, riscv_instr *instr)
 {
-    for (int set = 0; set < CACHE_SET_CNT; set++) {
-        riscv_icache_entry *entry = icache->set[set].head;
-
-        for (int i = 0; i < CACHE_WAY_CNT; i++) {
-            entry->valid = false;
-            entry = entry->next;
+    uint64_t set = icache_index(icache, paddr);
+    riscv_icache_entry *entry = &icache->entry[set * icache->way_cnt];
+    uint32_t victim = icache->way_cnt;
+
+    for (uint32_t way = 0; way < icache->way_cnt; way++) {
+        // prefer the way which holds the same instruction or is unused
+        if (!entry[way].valid || entry[way].tag == paddr) {
+            victim = way;
+            break;
         }
     }
+
+    if (victim == icache->way_cnt)
+        victim = __builtin_ctzl(~icache->mru[set]);
+
+    entry[victim].instr = *instr;
+    entry[victim].tag = paddr;
+    entry[victim].valid = true;
+    touch_icache(icache, set, victim);
 }
 
-void invalid_icache_by_vaddr(riscv_icache *icache, uint64_t vaddr)
+void invalid_icache(riscv_icache *icache)
 {
-    uint64_t vpn = vaddr >> 12;
-
-    for (int set = 0; set < CACHE_SET_CNT; set++) {
-        riscv_icache_entry *entry = icache->set[set].head;
-
-        for (int i = 0; i < CACHE_WAY_CNT; i++) {
-            // reconstruct the vaadr by index and tag
-            uint64_t cur_vaddr =
-                (entry->tag << (1 + CACHE_INDEX_BIT)) | (set << 1);
-            if (cur_vaddr >> 12 == vpn)
-                entry->valid = false;
-            entry = entry->next;
-        }
-    }
+    for (uint64_t i = 0; i < (uint64_t) icache->set_cnt * icache->way_cnt; i++)
+        icache->entry[i].valid = false;
+    memset(icache->mru, 0, icache->set_cnt * sizeof(uint64_t));
 }
 
 void free_icache(riscv_icache *icache)
 {
-    for (int set = 0; set < CACHE_SET_CNT; set++) {
-        riscv_icache_entry *entry = icache->set[set].head;
-
-        for (int i = 0; i < CACHE_WAY_CNT; i++) {
-            riscv_icache_entry *next = entry->next;
-            free(entry);
-            entry = next;
-        }
-    }
+    free(icache->entry);
+    free(icache->mru);
 }
 
 #endif
@@ -5,8 +5,6 @@ void R_decode(riscv_instr *instr)
     instr->rd = (instr->instr >> 7) & 0x1f;
     instr->rs1 = ((instr->instr >> 15) & 0x1f);
     instr->rs2 = ((instr->instr >> 20) & 0x1f);
-    instr->funct3 = (instr->instr >> 12) & 0x7;
-    instr->funct7 = (instr->instr >> 25) & 0x7f;
 }
 
 void I_decode(riscv_instr *instr)
@@ -14,8 +12,6 @@ void I_decode(riscv_instr *instr)
     instr->rd = (instr->instr >> 7) & 0x1f;
     instr->rs1 = ((instr->instr >> 15) & 0x1f);
     instr->imm = (int32_t) (instr->instr & 0xfff00000) >> 20;
-    instr->funct3 = (instr->instr >> 12) & 0x7;
-    instr->funct7 = (instr->instr >> 25) & 0x7f;
 }
 
 /* This function is used for priviledge instruction. It is
@@ -29,8 +25,6 @@ void P_decode(riscv_instr *instr)
     instr->rs1 = ((instr->instr >> 15) & 0x1f);
     instr->rs2 = ((instr->instr >> 20) & 0x1f);
     instr->imm = (instr->instr & 0xfff00000) >> 20;
-    instr->funct3 = (instr->instr >> 12) & 0x7;
-    instr->funct7 = (instr->instr >> 25) & 0x7f;
 }
 
 void S_decode(riscv_instr *instr)
@@ -42,7 +36,6 @@ void S_decode(riscv_instr *instr)
      * decoding */
     instr->imm = (((int32_t) (instr->instr & 0xfe000000) >> 20) |
                   (int32_t) ((instr->instr >> 7) & 0x1f));
-    instr->funct3 = (instr->instr >> 12) & 0x7;
 }
 
 void B_decode(riscv_instr *instr)
@@ -54,7 +47,6 @@ void B_decode(riscv_instr *instr)
                  | (int32_t) ((instr->instr & 0x80) << 4)       // 11
                  | (int32_t) ((instr->instr >> 20) & 0x7e0)     // 10:5
                  | (int32_t) ((instr->instr >> 7) & 0x1e);      // 4:1
-    instr->funct3 = (instr->instr >> 12) & 0x7;
 }
 
 void U_decode(riscv_instr *instr)
@@ -74,94 +66,229 @@ void J_decode(riscv_instr *instr)
                  | (int32_t) ((instr->instr >> 20) & 0x7fe);    // 10:1
 }
 
-/* For C extension instruction decoding:
- * 1. Same opcode can relate to different type of instructions, so only funct*
- * is calculated first in Cx_decode.
- * 2. Since some immediate has distinct format on different instrutions,
- * decoding value will be delayed for actual instrution.
- */
-void Cx_decode(riscv_instr *instr)
+/* The compressed instructions are expanded to their equivalent 32 bits
+ * instructions, then they can share the same decode and execution path with
+ * the base instructions. The following helpers encode the 32 bits
+ * instructions for the expansion. */
+static inline uint32_t R_encode(uint8_t opcode,
+                                uint8_t funct3,
+                                uint8_t funct7,
+                                uint8_t rd,
+                                uint8_t rs1,
+                                uint8_t rs2)
 {
-    instr->instr &= 0xffff;
-    instr->funct3 = (instr->instr >> 13) & 0x7;
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) |
+           (rd << 7) | opcode;
 }
 
-void Cxx_decode(riscv_instr *instr)
+static inline uint32_t I_encode(uint8_t opcode,
+                                uint8_t funct3,
+                                uint8_t rd,
+                                uint8_t rs1,
+                                uint32_t imm)
 {
-    instr->instr &= 0xffff;
-    instr->funct6 = (instr->instr >> 10) & 0x3f;
-    instr->funct2 = (instr->instr >> 5) & 0x3;
+    return ((imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) |
+           opcode;
 }
 
-void CIW_decode(riscv_instr *instr)
+static inline uint32_t S_encode(uint8_t opcode,
+                                uint8_t funct3,
+                                uint8_t rs1,
+                                uint8_t rs2,
+                                uint32_t imm)
 {
-    instr->instr &= 0xffff;
-    instr->rd = ((instr->instr >> 2) & 0x7) + 8;
+    return ((imm & 0xfe0) << 20) | (rs2 << 20) | (rs1 << 15) |
+           (funct3 << 12) | ((imm & 0x1f) << 7) | opcode;
 }
 
-void CL_decode(riscv_instr *instr)
+static inline uint32_t B_encode(uint8_t funct3,
+                                uint8_t rs1,
+                                uint8_t rs2,
+                                uint32_t imm)
 {
-    instr->instr &= 0xffff;
-    instr->rd = ((instr->instr >> 2) & 0x7) + 8;
-    instr->rs1 = ((instr->instr >> 7) & 0x7) + 8;
+    // imm[12|10:5|4:1|11] = inst[31|30:25|11:8|7]
+    return ((imm & 0x1000) << 19) | ((imm & 0x7e0) << 20) | (rs2 << 20) |
+           (rs1 << 15) | (funct3 << 12) | ((imm & 0x1e) << 7) |
+           ((imm & 0x800) >> 4) | 0x63;
 }
 
-void CS_decode(riscv_instr *instr)
+static inline uint32_t J_encode(uint8_t rd, uint32_t imm)
 {
-    instr->instr &= 0xffff;
-    instr->rs2 = ((instr->instr >> 2) & 0x7) + 8;
-    instr->rs1 = ((instr->instr >> 7) & 0x7) + 8;
+    // imm[20|10:1|11|19:12] = inst[31|30:21|20|19:12]
+    return ((imm & 0x100000) << 11) | ((imm & 0x7fe) << 20) |
+           ((imm & 0x800) << 9) | (imm & 0xff000) | (rd << 7) | 0x6f;
 }
 
-void CI_decode(riscv_instr *instr)
+// sign-extend the lowest 'bits' bits of the value
+static inline int32_t sext(uint32_t value, int bits)
 {
-    instr->instr &= 0xffff;
-    // note that 'rd' could also be used as 'rs1'
-    instr->rd = (instr->instr >> 7) & 0x1f;
+    return (int32_t) (value << (32 - bits)) >> (32 - bits);
 }
 
-void CSS_decode(riscv_instr *instr)
+/* Return the equivalent 32 bits instruction of the compressed instruction, or
+ * zero if the instruction is reserved or not implemented. Reference to:
+ * - 16.8 RVC Instruction Set Listings */
+uint32_t C_expand(uint16_t instr)
 {
-    instr->instr &= 0xffff;
-    instr->rs2 = (instr->instr >> 2) & 0x1f;
-}
+    uint8_t funct3 = (instr >> 13) & 0x7;
+    // the registers of CI and CR format
+    uint8_t rd = (instr >> 7) & 0x1f;
+    uint8_t rs2 = (instr >> 2) & 0x1f;
+    // the registers x8-x15 of CIW, CL, CS, CA and CB format
+    uint8_t rd_p = ((instr >> 2) & 0x7) + 8;
+    uint8_t rs1_p = ((instr >> 7) & 0x7) + 8;
+    // imm[5|4:0] = inst[12|6:2]
+    int32_t imm6 = sext(((instr >> 7) & 0x20) | ((instr >> 2) & 0x1f), 6);
+    uint32_t offset;
 
-void CJ_decode(riscv_instr *instr)
-{
-    instr->instr &= 0xffff;
-    // offset[11|4|9:8|10|6|7|3:1|5] = inst[12|11|10:9|8|7|6|5:3|2]
-    instr->imm = ((instr->instr >> 1) & 0x800) | ((instr->instr << 2) & 0x400) |
-                 ((instr->instr >> 1) & 0x300) | ((instr->instr << 1) & 0x80) |
-                 ((instr->instr >> 1) & 0x40) | ((instr->instr << 3) & 0x20) |
-                 ((instr->instr >> 7) & 0x10) | ((instr->instr >> 2) & 0xe);
-}
+    switch (((instr & 0x3) << 3) | funct3) {
+    case 0x00:
+        // C.ADDI4SPN: nzuimm[5:4|9:6|2|3] = inst[12:11|10:7|6|5]
+        offset = ((instr >> 1) & 0x3c0) | ((instr >> 7) & 0x30) |
+                 ((instr >> 2) & 0x8) | ((instr >> 4) & 0x4);
+        if (offset == 0)
+            return 0;
+        return I_encode(0x13, 0x0, rd_p, 2, offset);
+    case 0x02:
+    case 0x06:
+        // C.LW, C.SW: offset[5:3|2|6] = inst[12:10|6|5]
+        offset = ((instr >> 7) & 0x38) | ((instr << 1) & 0x40) |
+                 ((instr >> 4) & 0x4);
+        if (funct3 == 0x2)
+            return I_encode(0x03, 0x2, rd_p, rs1_p, offset);
+        return S_encode(0x23, 0x2, rs1_p, rd_p, offset);
+    case 0x03:
+    case 0x05:
+    case 0x07:
+        // C.LD, C.FSD, C.SD: offset[5:3|7:6] = inst[12:10|6:5]
+        offset = ((instr >> 7) & 0x38) | ((instr << 1) & 0xc0);
+        if (funct3 == 0x3)
+            return I_encode(0x03, 0x3, rd_p, rs1_p, offset);
+        if (funct3 == 0x5)
+            return S_encode(0x27, 0x3, rs1_p, rd_p, offset);
+        return S_encode(0x23, 0x3, rs1_p, rd_p, offset);
+    case 0x08:
+        // C.ADDI, which is C.NOP when rd = x0
+        return I_encode(0x13, 0x0, rd, rd, imm6);
+    case 0x09:
+        // C.ADDIW is reserved when rd = x0
+        if (rd == 0)
+            return 0;
+        return I_encode(0x1b, 0x0, rd, rd, imm6);
+    case 0x0a:
+        // C.LI
+        return I_encode(0x13, 0x0, rd, 0, imm6);
+    case 0x0b:
+        // the code points with zero immediate are reserved
+        if (imm6 == 0)
+            return 0;
+        // C.LUI
+        if (rd != 2)
+            return (((uint32_t) imm6 << 12) & 0xfffff000) | (rd << 7) | 0x37;
+        // C.ADDI16SP: nzimm[9|4|6|8:7|5] = inst[12|6|5|4:3|2]
+        offset = ((instr >> 3) & 0x200) | ((instr >> 2) & 0x10) |
+                 ((instr << 1) & 0x40) | ((instr << 4) & 0x180) |
+                 ((instr << 3) & 0x20);
+        return I_encode(0x13, 0x0, 2, 2, sext(offset, 10));
+    case 0x0c:
+        switch ((instr >> 10) & 0x3) {
+        case 0x0:
+            // C.SRLI
+            return I_encode(0x13, 0x5, rs1_p, rs1_p, imm6 & 0x3f);
+        case 0x1:
+            // C.SRAI
+            return I_encode(0x13, 0x5, rs1_p, rs1_p, 0x400 | (imm6 & 0x3f));
+        case 0x2:
+            // C.ANDI
+            return I_encode(0x13, 0x7, rs1_p, rs1_p, imm6);
+        default:
+            break;
+        }
 
-void CB_decode(riscv_instr *instr)
-{
-    instr->instr &= 0xffff;
-    instr->rs1 = ((instr->instr >> 7) & 0x7) + 8;
-    instr->rd = instr->rs1;
-}
-
-void CA_decode(riscv_instr *instr)
-{
-    instr->instr &= 0xffff;
-    instr->rd = ((instr->instr >> 7) & 0x7) + 8;
-    instr->rs2 = ((instr->instr >> 2) & 0x7) + 8;
-}
+        // C.SUB, C.XOR, C.OR, C.AND, C.SUBW, C.ADDW
+        switch (((instr >> 10) & 0x4) | ((instr >> 5) & 0x3)) {
+        case 0x0:
+            return R_encode(0x33, 0x0, 0x20, rs1_p, rs1_p, rd_p);
+        case 0x1:
+            return R_encode(0x33, 0x4, 0x00, rs1_p, rs1_p, rd_p);
+        case 0x2:
+            return R_encode(0x33, 0x6, 0x00, rs1_p, rs1_p, rd_p);
+        case 0x3:
+            return R_encode(0x33, 0x7, 0x00, rs1_p, rs1_p, rd_p);
+        case 0x4:
+            return R_encode(0x3b, 0x0, 0x20, rs1_p, rs1_p, rd_p);
+        case 0x5:
+            return R_encode(0x3b, 0x0, 0x00, rs1_p, rs1_p, rd_p);
+        default:
+            return 0;
+        }
+    case 0x0d:
+        // C.J: offset[11|4|9:8|10|6|7|3:1|5] = inst[12|11|10:9|8|7|6|5:3|2]
+        offset = ((instr >> 1) & 0x800) | ((instr << 2) & 0x400) |
+                 ((instr >> 1) & 0x300) | ((instr << 1) & 0x80) |
+                 ((instr >> 1) & 0x40) | ((instr << 3) & 0x20) |
+                 ((instr >> 7) & 0x10) | ((instr >> 2) & 0xe);
+        return J_encode(0, sext(offset, 12));
+    case 0x0e:
+    case 0x0f:
+        // C.BEQZ, C.BNEZ: offset[8|4:3|7:6|2:1|5] = inst[12|11:10|6:5|4:3|2]
+        offset = ((instr >> 4) & 0x100) | ((instr << 1) & 0xc0) |
+                 ((instr << 3) & 0x20) | ((instr >> 7) & 0x18) |
+                 ((instr >> 2) & 0x6);
+        return B_encode(funct3 & 0x1, rs1_p, 0, sext(offset, 9));
+    case 0x10:
+        // C.SLLI
+        return I_encode(0x13, 0x1, rd, rd, imm6 & 0x3f);
+    case 0x12:
+        // C.LWSP is reserved when rd = x0
+        if (rd == 0)
+            return 0;
+        // offset[5|4:2|7:6] = inst[12|6:4|3:2]
+        offset = ((instr << 4) & 0xc0) | ((instr >> 7) & 0x20) |
+                 ((instr >> 2) & 0x1c);
+        return I_encode(0x03, 0x2, rd, 2, offset);
+    case 0x13:
+        // C.LDSP is reserved when rd = x0
+        if (rd == 0)
+            return 0;
+        // offset[5|4:3|8:6] = inst[12|6:5|4:2]
+        offset = ((instr << 4) & 0x1c0) | ((instr >> 7) & 0x20) |
+                 ((instr >> 2) & 0x18);
+        return I_encode(0x03, 0x3, rd, 2, offset);
+    case 0x14:
+        if (!(instr & 0x1000)) {
+            // C.MV
+            if (rs2 != 0)
+                return R_encode(0x33, 0x0, 0x00, rd, 0, rs2);
+            // C.JR is reserved when rs1 = x0
+            if (rd == 0)
+                return 0;
+            return I_encode(0x67, 0x0, 0, rd, 0);
+        }
 
-void CR_decode(riscv_instr *instr)
-{
-    instr->instr &= 0xffff;
-    instr->funct4 = (instr->instr >> 12) & 0xf;
-    instr->rs1 = (instr->instr >> 7) & 0x1f;
-    instr->rd = instr->rs1;
-    instr->rs2 = (instr->instr >> 2) & 0x1f;
+        // C.ADD
+        if (rs2 != 0)
+            return R_encode(0x33, 0x0, 0x00, rd, rd, rs2);
+        // C.EBREAK
+        if (rd == 0)
+            return 0x00100073;
+        // C.JALR
+        return I_encode(0x67, 0x0, 1, rd, 0);
+    case 0x16:
+        // C.SWSP: offset[5:2|7:6] = inst[12:9|8:7]
+        offset = ((instr >> 1) & 0xc0) | ((instr >> 7) & 0x3c);
+        return S_encode(0x23, 0x2, 2, rs2, offset);
+    case 0x17:
+        // C.SDSP: offset[5:3|8:6] = inst[12:10|9:7]
+        offset = ((instr >> 1) & 0x1c0) | ((instr >> 7) & 0x38);
+        return S_encode(0x23, 0x3, 2, rs2, offset);
+    default:
+        return 0;
+    }
 }
 
 void FS_decode(riscv_instr *instr)
 {
-    instr->width = (instr->instr >> 12) & 0x7;
     instr->rs1 = (instr->instr >> 15) & 0x1f;
     instr->rs2 = (instr->instr >> 20) & 0x1f;
     // offset[11:5|4:0] = inst[31:25|11:7]
@@ -0,0 +1,505 @@
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+/* The translated code keeps all the architectural state in riscv_cpu, so the
+ * interpreter is able to take over at any instruction boundary. The host
+ * registers are used as below:
+ *  - rbx: the pointer to riscv_cpu
+ *  - r12: the pc when entering the block
+ *  - rax, rcx: the scratch registers
+ *
+ * Since the pc in the block is always computed from r12, the same block can be
+ * reused when the physical page is mapped to another virtual address. */
+
+// the maximum size of host instructions for an instruction
+#define JIT_MAX_INSTR_SIZE 128
+
+#define RAX 0
+#define RCX 1
+
+#define CPU_PC_OFFSET offsetof(riscv_cpu, pc)
+#define CPU_INSTR_OFFSET offsetof(riscv_cpu, instr)
+#define CPU_EXC_OFFSET \
+    (offsetof(riscv_cpu, exc) + offsetof(riscv_exception, exception))
+#define CPU_XREG_OFFSET(i) (offsetof(riscv_cpu, xreg) + (i) * sizeof(uint64_t))
+
+typedef struct {
+    uint8_t *cur;
+    uint8_t *end;
+} jit_buf;
+
+static inline void emit_byte(jit_buf *buf, uint8_t byte)
+{
+    *buf->cur++ = byte;
+}
+
+static inline void emit_u32(jit_buf *buf, uint32_t value)
+{
+    memcpy(buf->cur, &value, sizeof(uint32_t));
+    buf->cur += sizeof(uint32_t);
+}
+
+static inline void emit_u64(jit_buf *buf, uint64_t value)
+{
+    memcpy(buf->cur, &value, sizeof(uint64_t));
+    buf->cur += sizeof(uint64_t);
+}
+
+// mov reg, qword [rbx + offset]
+static void emit_load_cpu(jit_buf *buf, int reg, uint32_t offset)
+{
+    emit_byte(buf, 0x48);
+    emit_byte(buf, 0x8b);
+    emit_byte(buf, 0x83 | (reg << 3));
+    emit_u32(buf, offset);
+}
+
+// mov qword [rbx + offset], rax
+static void emit_store_cpu(jit_buf *buf, uint32_t offset)
+{
+    emit_byte(buf, 0x48);
+    emit_byte(buf, 0x89);
+    emit_byte(buf, 0x83);
+    emit_u32(buf, offset);
+}
+
+// mov reg, imm
+static void emit_mov_imm(jit_buf *buf, int reg, uint64_t imm)
+{
+    if ((int64_t) imm == (int32_t) imm) {
+        emit_byte(buf, 0x48);
+        emit_byte(buf, 0xc7);
+        emit_byte(buf, 0xc0 | reg);
+        emit_u32(buf, imm);
+    } else {
+        emit_byte(buf, 0x48);
+        emit_byte(buf, 0xb8 | reg);
+        emit_u64(buf, imm);
+    }
+}
+
+// rax = r12 + offset
+static void emit_pc(jit_buf *buf, uint32_t offset)
+{
+    // mov rax, r12
+    emit_byte(buf, 0x4c);
+    emit_byte(buf, 0x89);
+    emit_byte(buf, 0xe0);
+    // add rax, imm32
+    emit_byte(buf, 0x48);
+    emit_byte(buf, 0x05);
+    emit_u32(buf, offset);
+}
+
+// movsxd rax, eax
+static void emit_sext32(jit_buf *buf)
+{
+    emit_byte(buf, 0x48);
+    emit_byte(buf, 0x63);
+    emit_byte(buf, 0xc0);
+}
+
+/* The arithmetic instruction between rax and rcx, the result is in rax. The
+ * 32 bits form will sign-extend the result to 64 bits. */
+static void emit_alu(jit_buf *buf, uint8_t opcode, bool is_32)
+{
+    if (!is_32)
+        emit_byte(buf, 0x48);
+    emit_byte(buf, opcode);
+    emit_byte(buf, 0xc8);
+    if (is_32)
+        emit_sext32(buf);
+}
+
+#define ALU_ADD 0x01
+#define ALU_OR 0x09
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+
+/* Shift rax by cl. The shift amount is masked by the host in the same way as
+ * RISC-V does: 6 bits for 64 bits form and 5 bits for 32 bits form. */
+static void emit_shift(jit_buf *buf, uint8_t ext, bool is_32)
+{
+    if (!is_32)
+        emit_byte(buf, 0x48);
+    emit_byte(buf, 0xd3);
+    emit_byte(buf, 0xc0 | (ext << 3));
+    if (is_32)
+        emit_sext32(buf);
+}
+
+#define SHIFT_SHL 4
+#define SHIFT_SHR 5
+#define SHIFT_SAR 7
+
+// rax = (rax < rcx) ? 1 : 0
+static void emit_set_less(jit_buf *buf, bool is_signed)
+{
+    // cmp rax, rcx
+    emit_byte(buf, 0x48);
+    emit_byte(buf, 0x39);
+    emit_byte(buf, 0xc8);
+    // setl al / setb al
+    emit_byte(buf, 0x0f);
+    emit_byte(buf, is_signed ? 0x9c : 0x92);
+    emit_byte(buf, 0xc0);
+    // movzx eax, al
+    emit_byte(buf, 0x0f);
+    emit_byte(buf, 0xb6);
+    emit_byte(buf, 0xc0);
+}
+
+// rax = rax * rcx
+static void emit_mul(jit_buf *buf, bool is_32)
+{
+    if (!is_32)
+        emit_byte(buf, 0x48);
+    emit_byte(buf, 0x0f);
+    emit_byte(buf, 0xaf);
+    emit_byte(buf, 0xc1);
+    if (is_32)
+        emit_sext32(buf);
+}
+
+static void emit_prologue(jit_buf *buf)
+{
+    // push rbx; push r12; push r13 (keep the stack 16 bytes aligned)
+    emit_byte(buf, 0x53);
+    emit_byte(buf, 0x41);
+    emit_byte(buf, 0x54);
+    emit_byte(buf, 0x41);
+    emit_byte(buf, 0x55);
+    // mov rbx, rdi
+    emit_byte(buf, 0x48);
+    emit_byte(buf, 0x89);
+    emit_byte(buf, 0xfb);
+    // mov r12, qword [rbx + pc]
+    emit_byte(buf, 0x4c);
+    emit_byte(buf, 0x8b);
+    emit_byte(buf, 0xa3);
+    emit_u32(buf, CPU_PC_OFFSET);
+}
+
+#define EPILOGUE_SIZE 11
+
+static void emit_epilogue(jit_buf *buf, uint32_t instr_cnt)
+{
+    // mov eax, instr_cnt
+    emit_byte(buf, 0xb8);
+    emit_u32(buf, instr_cnt);
+    // pop r13; pop r12; pop rbx; ret
+    emit_byte(buf, 0x41);
+    emit_byte(buf, 0x5d);
+    emit_byte(buf, 0x41);
+    emit_byte(buf, 0x5c);
+    emit_byte(buf, 0x5b);
+    emit_byte(buf, 0xc3);
+}
+
+static bool is_native_op(riscv_op op)
+{
+    switch (op) {
+    case OP_LUI:
+    case OP_AUIPC:
+    case OP_ADDI:
+    case OP_SLTI:
+    case OP_SLTIU:
+    case OP_XORI:
+    case OP_ORI:
+    case OP_ANDI:
+    case OP_SLLI:
+    case OP_SRLI:
+    case OP_SRAI:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_SLL:
+    case OP_SLT:
+    case OP_SLTU:
+    case OP_XOR:
+    case OP_SRL:
+    case OP_SRA:
+    case OP_OR:
+    case OP_AND:
+    case OP_MUL:
+    case OP_ADDIW:
+    case OP_SLLIW:
+    case OP_SRLIW:
+    case OP_SRAIW:
+    case OP_ADDW:
+    case OP_SUBW:
+    case OP_SLLW:
+    case OP_SRLW:
+    case OP_SRAW:
+    case OP_MULW:
+    case OP_NOP:
+    case OP_LI:
+    case OP_MV:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Translate the instruction into host instructions directly, return false if
+ * the operation is not supported */
+static bool emit_native(jit_buf *buf, riscv_instr *instr, uint32_t offset)
+{
+    uint64_t imm = instr->imm;
+
+    if (!is_native_op(instr->op))
+        return false;
+
+    switch (instr->op) {
+    case OP_NOP:
+        return true;
+    case OP_LUI:
+    case OP_LI:
+        emit_mov_imm(buf, RAX, imm);
+        break;
+    case OP_MV:
+        emit_load_cpu(buf, RAX, CPU_XREG_OFFSET(instr->rs1));
+        break;
+    case OP_AUIPC:
+        emit_pc(buf, offset);
+        emit_mov_imm(buf, RCX, imm);
+        emit_alu(buf, ALU_ADD, false);
+        break;
+    default:
+        emit_load_cpu(buf, RAX, CPU_XREG_OFFSET(instr->rs1));
+        switch (instr->op) {
+        case OP_ADDI:
+        case OP_SLTI:
+        case OP_SLTIU:
+        case OP_XORI:
+        case OP_ORI:
+        case OP_ANDI:
+        case OP_ADDIW:
+            emit_mov_imm(buf, RCX, imm);
+            break;
+        case OP_SLLI:
+        case OP_SRLI:
+        case OP_SRAI:
+            emit_mov_imm(buf, RCX, imm & 0x3f);
+            break;
+        case OP_SLLIW:
+        case OP_SRLIW:
+        case OP_SRAIW:
+            emit_mov_imm(buf, RCX, imm & 0x1f);
+            break;
+        default:
+            emit_load_cpu(buf, RCX, CPU_XREG_OFFSET(instr->rs2));
+            break;
+        }
+
+        switch (instr->op) {
+        case OP_ADDI:
+        case OP_ADD:
+            emit_alu(buf, ALU_ADD, false);
+            break;
+        case OP_SUB:
+            emit_alu(buf, ALU_SUB, false);
+            break;
+        case OP_XORI:
+        case OP_XOR:
+            emit_alu(buf, ALU_XOR, false);
+            break;
+        case OP_ORI:
+        case OP_OR:
+            emit_alu(buf, ALU_OR, false);
+            break;
+        case OP_ANDI:
+        case OP_AND:
+            emit_alu(buf, ALU_AND, false);
+            break;
+        case OP_SLTI:
+        case OP_SLT:
+            emit_set_less(buf, true);
+            break;
+        case OP_SLTIU:
+        case OP_SLTU:
+            emit_set_less(buf, false);
+            break;
+        case OP_SLLI:
+        case OP_SLL:
+            emit_shift(buf, SHIFT_SHL, false);
+            break;
+        case OP_SRLI:
+        case OP_SRL:
+            emit_shift(buf, SHIFT_SHR, false);
+            break;
+        case OP_SRAI:
+        case OP_SRA:
+            emit_shift(buf, SHIFT_SAR, false);
+            break;
+        case OP_MUL:
+            emit_mul(buf, false);
+            break;
+        case OP_ADDIW:
+        case OP_ADDW:
+            emit_alu(buf, ALU_ADD, true);
+            break;
+        case OP_SUBW:
+            emit_alu(buf, ALU_SUB, true);
+            break;
+        case OP_SLLIW:
+        case OP_SLLW:
+            emit_shift(buf, SHIFT_SHL, true);
+            break;
+        case OP_SRLIW:
+        case OP_SRLW:
+            emit_shift(buf, SHIFT_SHR, true);
+            break;
+        case OP_SRAIW:
+        case OP_SRAW:
+            emit_shift(buf, SHIFT_SAR, true);
+            break;
+        case OP_MULW:
+            emit_mul(buf, true);
+            break;
+        default:
+            return false;
+        }
+        break;
+    }
+
+    emit_store_cpu(buf, CPU_XREG_OFFSET(instr->rd));
+    return true;
+}
+
+/* Execute the instruction by calling its handler, just like what the
+ * interpreter does, and leave the block if an exception is raised */
+static void emit_call(jit_buf *buf,
+                      riscv_instr *instr,
+                      uint32_t offset,
+                      uint32_t instr_idx)
+{
+    // cpu->pc = the address of next instruction
+    emit_pc(buf, offset + instr_len(instr));
+    emit_store_cpu(buf, CPU_PC_OFFSET);
+    // cpu->instr = instr
+    emit_mov_imm(buf, RAX, (uint64_t) instr);
+    emit_store_cpu(buf, CPU_INSTR_OFFSET);
+    // mov rdi, rbx
+    emit_byte(buf, 0x48);
+    emit_byte(buf, 0x89);
+    emit_byte(buf, 0xdf);
+    // call the handler
+    emit_mov_imm(buf, RAX, (uint64_t) instr_exec_func(instr));
+    emit_byte(buf, 0xff);
+    emit_byte(buf, 0xd0);
+    // cmp dword [rbx + exc.exception], NoException
+    emit_byte(buf, 0x83);
+    emit_byte(buf, 0xbb);
+    emit_u32(buf, CPU_EXC_OFFSET);
+    emit_byte(buf, NoException);
+    // je over the epilogue
+    emit_byte(buf, 0x74);
+    emit_byte(buf, EPILOGUE_SIZE);
+    emit_epilogue(buf, instr_idx + 1);
+}
+
+bool init_jit(riscv_jit *jit)
+{
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        jit->code = NULL;
+        ERROR("Fail to allocate the memory for JIT\n");
+        return false;
+    }
+    jit->used = 0;
+
+    return true;
+}
+
+/* Translate the block into host instructions. NULL is returned if there is no
+ * enough space for the translated code, in which case the caller should drop
+ * all the translated code by invalid_jit. */
+jit_func translate_jit(riscv_jit *jit, riscv_block *block)
+{
+    uint8_t *start = jit->code + jit->used;
+    jit_buf buf = {
+        .cur = start,
+        .end = jit->code + JIT_CODE_SIZE,
+    };
+
+    if (buf.end - buf.cur < JIT_MAX_INSTR_SIZE)
+        return NULL;
+    emit_prologue(&buf);
+
+    uint32_t offset = 0;
+    bool is_native = false;
+
+    for (int i = 0; i < block->instr_cnt; i++) {
+        riscv_instr *instr = &block->instr[i];
+        riscv_instr first;
+
+        /* The instructions of a fused pair are translated one by one, since
+         * there is no dispatch between them in the translated code anyway.
+         * Note that the first instruction of the pair is always native. */
+        if (is_fused_op(instr->op)) {
+            first = *instr;
+            first.op = fused_first_op(instr->op);
+            instr = &first;
+        }
+
+        if (buf.end - buf.cur < 2 * JIT_MAX_INSTR_SIZE)
+            return NULL;
+
+        is_native = emit_native(&buf, instr, offset);
+        if (!is_native)
+            emit_call(&buf, instr, offset, i);
+
+        offset += instr_len(instr);
+    }
+
+    // the pc is only updated by the called handler
+    if (is_native) {
+        emit_pc(&buf, offset);
+        emit_store_cpu(&buf, CPU_PC_OFFSET);
+    }
+    emit_epilogue(&buf, block->instr_cnt);
+
+    // align the start of next translated block
+    jit->used = ((buf.cur - jit->code) + 15) & ~15UL;
+
+    return (jit_func) start;
+}
+
+void invalid_jit(riscv_jit *jit)
+{
+    jit->used = 0;
+}
+
+void free_jit(riscv_jit *jit)
+{
+    if (jit->code != NULL)
+        munmap(jit->code, JIT_CODE_SIZE);
+}
+
+#else
+
+bool init_jit(__attribute__((unused)) riscv_jit *jit)
+{
+    ERROR("JIT is only supported on x86-64 host\n");
+    return false;
+}
+
+jit_func translate_jit(__attribute__((unused)) riscv_jit *jit,
+                       __attribute__((unused)) riscv_block *block)
+{
+    return NULL;
+}
+
+void invalid_jit(__attribute__((unused)) riscv_jit *jit) {}
+
+void free_jit(__attribute__((unused)) riscv_jit *jit) {}
+
+#endif
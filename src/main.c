@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "emu.h"
+#include "memmap.h"
 
 #define MAX_FILE_LEN 256
 static char input_file[MAX_FILE_LEN];
@@ -14,6 +15,18 @@ static char signature_out_file[MAX_FILE_LEN];
 static char opt_input = false;
 static char opt_rfsimg = false;
 
+static riscv_config config = {
+    .jit = false,
+    .threaded = false,
+    .fusion = true,
+    .fusion_stats = false,
+    .memory_size = DRAM_DEFAULT_SIZE,
+    .time_warp = false,
+    .host_clock = false,
+    .icache_sets = 256,
+    .icache_ways = 4,
+};
+
 enum run_mode {
     NORMAL = 0,
     COMPLIANCE = 1,
@@ -21,6 +34,36 @@ enum run_mode {
     GDBSTUB = 3,
 };
 static int opt_run_mode = NORMAL;
+// the times to run the binary, where the emulator is reset between the runs
+static uint32_t opt_repeat = 1;
+
+/* Parse the size with an optional suffix K, M or G, return 0 if the size is
+ * invalid */
+static uint64_t parse_size(const char *str)
+{
+    char *end;
+    uint64_t size = strtoull(str, &end, 0);
+
+    switch (*end) {
+    case 'G':
+    case 'g':
+        size <<= 10;
+        /* fall through */
+    case 'M':
+    case 'm':
+        size <<= 10;
+        /* fall through */
+    case 'K':
+    case 'k':
+        size <<= 10;
+        end++;
+        break;
+    default:
+        break;
+    }
+
+    return (*end == '\0') ? size : 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -33,12 +76,17 @@ int main(int argc, char *argv[])
     struct option opts[] = {
         {"binary", 1, NULL, 'B'},     {"rfsimg", 1, NULL, 'R'},
         {"compliance", 1, NULL, 'C'}, {"riscv-test", 0, NULL, 'T'},
-        {"gdbstub", 0, NULL, 'G'},
+        {"gdbstub", 0, NULL, 'G'},    {"jit", 0, NULL, 'J'},
+        {"threaded", 0, NULL, 'H'},   {"icache-sets", 1, NULL, 'S'},
+        {"icache-ways", 1, NULL, 'W'}, {"no-fusion", 0, NULL, 'F'},
+        {"memory", 1, NULL, 'M'},     {"repeat", 1, NULL, 'N'},
+        {"time-warp", 0, NULL, 'X'},  {"host-clock", 0, NULL, 'K'},
+        {"fusion-stats", 0, NULL, 'U'}, {0, 0, 0, 0},
     };
 
     int c;
-    while ((c = getopt_long(argc, argv, "B:R:C:TG", opts, &option_index)) !=
-           -1) {
+    while ((c = getopt_long(argc, argv, "B:R:C:TGJHS:W:FM:N:XKU", opts,
+                            &option_index)) != -1) {
         switch (c) {
         case 'B':
             opt_input = true;
@@ -61,6 +109,36 @@ int main(int argc, char *argv[])
         case 'G':
             opt_run_mode = GDBSTUB;
             break;
+        case 'J':
+            config.jit = true;
+            break;
+        case 'H':
+            config.threaded = true;
+            break;
+        case 'S':
+            config.icache_sets = strtoul(optarg, NULL, 0);
+            break;
+        case 'W':
+            config.icache_ways = strtoul(optarg, NULL, 0);
+            break;
+        case 'F':
+            config.fusion = false;
+            break;
+        case 'M':
+            config.memory_size = parse_size(optarg);
+            break;
+        case 'N':
+            opt_repeat = strtoul(optarg, NULL, 0);
+            break;
+        case 'X':
+            config.time_warp = true;
+            break;
+        case 'K':
+            config.host_clock = true;
+            break;
+        case 'U':
+            config.fusion_stats = true;
+            break;
         default:
             ERROR("Unknown option\n");
         }
@@ -75,28 +153,41 @@ int main(int argc, char *argv[])
     if (!opt_rfsimg)
         rfsimg_file[0] = '\0';
 
+    // the debugger controls the emulator by itself, so it is never repeated
+    if (opt_run_mode == GDBSTUB)
+        opt_repeat = 1;
+    config.snapshot = opt_repeat > 1;
+
     int ret = 0;
-    riscv_emu *emu = create_emu(input_file, rfsimg_file);
+    riscv_emu *emu = create_emu(input_file, rfsimg_file, &config);
     if (!emu) {
         ERROR("Fail to create the emulator\n");
         ret = -1;
         goto clean_up;
     }
 
-    switch (opt_run_mode) {
-    case COMPLIANCE:
-        test_emu(emu);
-        ret = take_signature_emu(emu, signature_out_file);
-        break;
-    case RISCV_TEST:
-        ret = test_emu(emu);
-        break;
-    case GDBSTUB:
-        run_emu_debug(emu);
-        break;
-    default:
-        run_emu(emu);
-        break;
+    for (uint32_t i = 0; i < opt_repeat && ret == 0; i++) {
+        if (i > 0 && !reset_emu(emu)) {
+            ERROR("Fail to reset the emulator\n");
+            ret = -1;
+            break;
+        }
+
+        switch (opt_run_mode) {
+        case COMPLIANCE:
+            test_emu(emu);
+            ret = take_signature_emu(emu, signature_out_file);
+            break;
+        case RISCV_TEST:
+            ret = test_emu(emu);
+            break;
+        case GDBSTUB:
+            run_emu_debug(emu);
+            break;
+        default:
+            run_emu(emu);
+            break;
+        }
     }
 
 clean_up:
@@ -1,15 +1,49 @@
+#include <fcntl.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "exception.h"
 #include "macros.h"
 #include "memmap.h"
 #include "memory.h"
 
+// the size of transparent huge page on the host
+#define HUGE_PAGE_SIZE (2UL << 20)
+
 static uint64_t entry_addr = DRAM_BASE;
 
-static void load_elf(riscv_mem *mem, uint8_t *elf_file)
+/* Map the DRAM with anonymous memory, so the host pages are allocated and
+ * zeroed lazily when the guest touches them. The region is aligned to the huge
+ * page and advised to be backed by transparent huge pages, which reduces the
+ * host TLB misses of accessing the guest memory. */
+static uint8_t *map_dram(uint64_t size)
+{
+    uint64_t map_size = size + HUGE_PAGE_SIZE;
+    uint8_t *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    // drop the unaligned head and the rest of the tail
+    uint8_t *dram = (uint8_t *) (((uintptr_t) map + HUGE_PAGE_SIZE - 1) &
+                                 ~(HUGE_PAGE_SIZE - 1));
+    if (dram != map)
+        munmap(map, dram - map);
+    if (map + map_size != dram + size)
+        munmap(dram + size, (map + map_size) - (dram + size));
+
+#ifdef MADV_HUGEPAGE
+    madvise(dram, size, MADV_HUGEPAGE);
+#endif
+    return dram;
+}
+
+static bool load_elf(riscv_mem *mem, uint8_t *elf_file, size_t sz)
 {
     Elf64_Shdr *tohost_shdr;
     if (elf_lookup_shdr(&mem->elf, ".tohost", &tohost_shdr) == 0) {
@@ -33,8 +67,20 @@ static void load_elf(riscv_mem *mem, uint8_t *elf_file)
         uint64_t start = phdr->p_paddr - entry_addr;
         uint64_t size = phdr->p_filesz;
         uint64_t offset = phdr->p_offset;
+        if (start > mem->size || size > mem->size - start) {
+            ERROR("The ELF segment is out of DRAM\n");
+            return false;
+        }
+        if (offset > sz || size > sz - offset) {
+            ERROR("The ELF segment is out of the file\n");
+            return false;
+        }
         memcpy(mem->mem + start, elf_file + offset, size);
+        if (start + size > mem->image_size)
+            mem->image_size = start + size;
     }
+
+    return true;
 }
 
 uint64_t get_entry_addr()
@@ -42,7 +88,7 @@ uint64_t get_entry_addr()
     return entry_addr;
 }
 
-bool init_mem(riscv_mem *mem, const char *filename)
+bool init_mem(riscv_mem *mem, const char *filename, uint64_t size)
 {
     // load binary file to memory
     if (!filename) {
@@ -50,50 +96,136 @@ bool init_mem(riscv_mem *mem, const char *filename)
         return false;
     }
 
-    // create memory with default size
-    mem->mem = calloc(DRAM_SIZE, sizeof(uint8_t));
+    if (size == 0 || (size & ((1UL << 12) - 1)) != 0) {
+        ERROR("The size of memory should be a multiple of 4 KiB\n");
+        return false;
+    }
+
+    mem->size = size;
+    mem->image_size = 0;
+    mem->snapshot = false;
+    mem->mem = map_dram(size);
     if (!mem->mem) {
-        ERROR("Error when allocating space through malloc for DRAM\n");
+        ERROR("Error when mapping space through mmap for DRAM\n");
         return false;
     }
 
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        ERROR("Invalid binary path.\n");
+    mem->dirty_map = calloc(mem_dirty_words(mem), sizeof(uint64_t));
+    if (!mem->dirty_map) {
+        ERROR("Error when allocating space through malloc for dirty bitmap\n");
+        free_memory(mem);
         return false;
     }
 
-    fseek(fp, 0, SEEK_END);
-    size_t sz = ftell(fp) * sizeof(uint8_t);
-    rewind(fp);
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        ERROR("Invalid binary path.\n");
+        free_memory(mem);
+        return false;
+    }
 
-    uint8_t *buf = malloc(sz);
-    if (buf == NULL) {
-        ERROR(
-            "Error when allocating space through malloc for ELF file buffer\n");
-        fclose(fp);
-        free(mem->mem);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        ERROR("Error when getting the size of binary.\n");
+        close(fd);
+        free_memory(mem);
         return false;
     }
+    size_t sz = st.st_size;
 
-    size_t read_size = fread(buf, sizeof(uint8_t), sz, fp);
-    fclose(fp);
-    if (read_size != sz) {
-        ERROR("Error when reading binary through fread.\n");
-        free(buf);
-        free(mem->mem);
+    /* The binary is mapped instead of read into a buffer, so the headers are
+     * parsed in place and the content is only copied once into DRAM */
+    uint8_t *buf = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        ERROR("Error when mapping binary through mmap.\n");
+        free_memory(mem);
         return false;
     }
 
+    bool ret = true;
     if (elf_init(&mem->elf, buf, sz) == -1) {
-        memcpy(mem->mem, buf, sz);
+        if (sz > mem->size) {
+            ERROR("The binary is larger than DRAM\n");
+            ret = false;
+        } else {
+            memcpy(mem->mem, buf, sz);
+            mem->image_size = sz;
+        }
     } else {
-        load_elf(mem, buf);
-        elf_close(&mem->elf);
+        ret = load_elf(mem, buf, sz);
+    }
+    elf_close(&mem->elf);
+
+    munmap(buf, sz);
+    if (!ret)
+        free_memory(mem);
+    return ret;
+}
+
+/* Keep the loaded image as the snapshot of DRAM, which can be restored by
+ * restore_mem. The image is moved into a memory file, and DRAM is mapped again
+ * as a private mapping of the file. Since the pages written by the guest are
+ * copied on write, restoring the snapshot only needs to drop these pages. Note
+ * that the pages can't be backed by transparent huge pages anymore. */
+bool snapshot_mem(riscv_mem *mem)
+{
+    // memfd_create is only declared with _GNU_SOURCE
+    int fd = syscall(SYS_memfd_create, "riscv-dram", 0);
+    if (fd < 0) {
+        ERROR("Error when creating the memory file for DRAM snapshot\n");
+        return false;
     }
 
-    free(buf);
+    if (ftruncate(fd, mem->size) < 0)
+        goto fail;
+
+    // only the image is written, the rest of the file reads as zero
+    uint64_t done = 0;
+    while (done < mem->image_size) {
+        ssize_t n = pwrite(fd, mem->mem + done, mem->image_size - done, done);
+        if (n <= 0)
+            goto fail;
+        done += n;
+    }
+
+    if (mmap(mem->mem, mem->size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+        goto fail;
+
+    close(fd);
+    mem->snapshot = true;
     return true;
+
+fail:
+    ERROR("Error when taking the snapshot of DRAM\n");
+    close(fd);
+    return false;
+}
+
+/* Restore DRAM to the snapshot, which costs only the pages written since then.
+ * We don't know which pages are restored exactly, so all of them are taken as
+ * dirty. */
+bool restore_mem(riscv_mem *mem)
+{
+    if (!mem->snapshot) {
+        ERROR("There is no snapshot of DRAM to be restored\n");
+        return false;
+    }
+
+    mark_mem_dirty(mem, DRAM_BASE, mem->size);
+    return madvise(mem->mem, mem->size, MADV_DONTNEED) == 0;
+}
+
+/* Copy the dirty bitmap to 'bitmap' and clear it, so the next call returns the
+ * pages written after this call. The bitmap should have mem_dirty_words(mem)
+ * words, where bit n of word i is for page (i * 64 + n) of DRAM. */
+void fetch_dirty_mem(riscv_mem *mem, uint64_t *bitmap)
+{
+    uint64_t size = mem_dirty_words(mem) * sizeof(uint64_t);
+
+    memcpy(bitmap, mem->dirty_map, size);
+    memset(mem->dirty_map, 0, size);
 }
 
 uint64_t read_mem(riscv_mem *mem,
@@ -133,6 +265,7 @@ bool write_mem(riscv_mem *mem,
 {
     uint64_t index = (addr - DRAM_BASE);
 
+    mark_mem_dirty(mem, addr, size >> 3);
     switch (size) {
     case 8:
         mem->mem[index] = (uint8_t) value;
@@ -157,5 +290,9 @@ bool write_mem(riscv_mem *mem,
 
 void free_memory(riscv_mem *mem)
 {
-    free(mem->mem);
+    if (mem->mem != NULL)
+        munmap(mem->mem, mem->size);
+    mem->mem = NULL;
+    free(mem->dirty_map);
+    mem->dirty_map = NULL;
 }
@@ -0,0 +1,130 @@
+#include <time.h>
+
+#include "clint.h"
+#include "sched.h"
+
+// the nanoseconds for a tick of the time
+#define SCHED_TICK_NS (1000000000UL / CLINT_FREQ)
+
+static uint64_t host_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void init_sched(riscv_sched *sched, bool host_clock)
+{
+    sched->now = 0;
+    sched->host_clock = host_clock;
+    sched->host_base = host_time();
+    sched->cnt = 0;
+    for (int i = 0; i < EVENT_CNT; i++)
+        sched->pos[i] = -1;
+}
+
+// Set the time by the host clock, which is only used under the host clock
+void sync_sched(riscv_sched *sched)
+{
+    sched->now = (host_time() - sched->host_base) / SCHED_TICK_NS;
+}
+
+/* Skip the time by the ticks without waiting. The time counted by the executed
+ * instructions is advanced by the caller as usual, so only the host clock
+ * needs to be moved. */
+void warp_sched(riscv_sched *sched, uint64_t ticks)
+{
+    if (sched->host_clock)
+        sched->host_base -= ticks * SCHED_TICK_NS;
+}
+
+static inline void swap_event(riscv_sched *sched, int a, int b)
+{
+    riscv_event tmp = sched->heap[a];
+    sched->heap[a] = sched->heap[b];
+    sched->heap[b] = tmp;
+    sched->pos[sched->heap[a].type] = a;
+    sched->pos[sched->heap[b].type] = b;
+}
+
+static void sift_up(riscv_sched *sched, int idx)
+{
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (sched->heap[parent].deadline <= sched->heap[idx].deadline)
+            break;
+        swap_event(sched, parent, idx);
+        idx = parent;
+    }
+}
+
+static void sift_down(riscv_sched *sched, int idx)
+{
+    while (1) {
+        int min = idx;
+        int left = idx * 2 + 1;
+        int right = idx * 2 + 2;
+
+        if (left < sched->cnt &&
+            sched->heap[left].deadline < sched->heap[min].deadline)
+            min = left;
+        if (right < sched->cnt &&
+            sched->heap[right].deadline < sched->heap[min].deadline)
+            min = right;
+        if (min == idx)
+            break;
+
+        swap_event(sched, min, idx);
+        idx = min;
+    }
+}
+
+static void remove_event(riscv_sched *sched, int idx)
+{
+    sched->pos[sched->heap[idx].type] = -1;
+    sched->cnt--;
+    if (idx == sched->cnt)
+        return;
+
+    sched->heap[idx] = sched->heap[sched->cnt];
+    sched->pos[sched->heap[idx].type] = idx;
+    sift_up(sched, idx);
+    sift_down(sched, idx);
+}
+
+/* Schedule the event at the deadline. If the event is scheduled already, it is
+ * moved to the new deadline. */
+void schedule_event(riscv_sched *sched,
+                    riscv_event_type type,
+                    uint64_t deadline)
+{
+    int idx = sched->pos[type];
+
+    if (idx < 0) {
+        idx = sched->cnt++;
+        sched->heap[idx].type = type;
+        sched->pos[type] = idx;
+    }
+
+    sched->heap[idx].deadline = deadline;
+    sift_up(sched, idx);
+    sift_down(sched, sched->pos[type]);
+}
+
+void cancel_event(riscv_sched *sched, riscv_event_type type)
+{
+    if (sched->pos[type] >= 0)
+        remove_event(sched, sched->pos[type]);
+}
+
+/* Take out the earliest event if its deadline is reached, return false if
+ * there is no such event */
+bool pop_event(riscv_sched *sched, riscv_event_type *type)
+{
+    if (sched->cnt == 0 || sched->heap[0].deadline > sched->now)
+        return false;
+
+    *type = sched->heap[0].type;
+    remove_event(sched, 0);
+    return true;
+}
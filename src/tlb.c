@@ -0,0 +1,169 @@
+#include "tlb.h"
+
+void invalid_tlb(riscv_tlb *tlb)
+{
+    for (int i = 0; i < TLB_CNT; i++)
+        tlb->entry[i].vpn = TLB_INVALID_VPN;
+    for (int i = 0; i < TLB_SUPER_CNT; i++) {
+        tlb->super[i].vpn = TLB_INVALID_VPN;
+        tlb->super[i].level = 0;
+    }
+    tlb->super_victim = 0;
+}
+
+riscv_tlb_entry *read_tlb_super(riscv_tlb *tlb, uint64_t vaddr, uint16_t asid)
+{
+    for (int i = 0; i < TLB_SUPER_CNT; i++) {
+        riscv_tlb_entry *entry = &tlb->super[i];
+
+        if (entry->vpn == (vaddr >> tlb_page_shift(entry->level)) &&
+            (entry->global || entry->asid == asid))
+            return entry;
+    }
+
+    return NULL;
+}
+
+void write_tlb_super(riscv_tlb *tlb,
+                     uint64_t vaddr,
+                     uint16_t asid,
+                     bool global,
+                     uint8_t level,
+                     uint64_t page)
+{
+    riscv_tlb_entry *entry = &tlb->super[tlb->super_victim];
+
+    tlb->super_victim = (tlb->super_victim + 1) % TLB_SUPER_CNT;
+
+    entry->vpn = vaddr >> tlb_page_shift(level);
+    entry->page = page;
+    // the host address is decided for each 4 KiB page when it is accessed
+    entry->host = NULL;
+    entry->asid = asid;
+    entry->global = global;
+    entry->level = level;
+}
+
+// the global mappings are not dropped if an ASID is specified
+static inline bool fence_match(riscv_tlb_entry *entry,
+                               bool by_asid,
+                               uint16_t asid)
+{
+    return !by_asid || (!entry->global && entry->asid == asid);
+}
+
+/* Drop the 4 KiB pages which are copied from a superpage covering 'vaddr'.
+ * They could be at any index, and may outlive the superpage entry itself, so
+ * all of the direct-mapped entries are checked. */
+static void fence_tlb_super(riscv_tlb *tlb,
+                            uint64_t vaddr,
+                            bool by_asid,
+                            uint16_t asid)
+{
+    for (int i = 0; i < TLB_CNT; i++) {
+        riscv_tlb_entry *entry = &tlb->entry[i];
+
+        if (entry->vpn != TLB_INVALID_VPN && entry->level > 0 &&
+            (entry->vpn >> (9 * entry->level)) ==
+                (vaddr >> tlb_page_shift(entry->level)) &&
+            fence_match(entry, by_asid, asid))
+            entry->vpn = TLB_INVALID_VPN;
+    }
+}
+
+/* Drop the entries selected by SFENCE.VMA. If 'by_vaddr' is set, only the
+ * entry of 'vaddr' is dropped. If 'by_asid' is set, only the entries of 'asid'
+ * are dropped. */
+void fence_tlb(riscv_tlb *tlb,
+               bool by_vaddr,
+               uint64_t vaddr,
+               bool by_asid,
+               uint16_t asid)
+{
+    if (by_vaddr) {
+        uint64_t vpn = vaddr >> PAGE_SHIFT;
+        riscv_tlb_entry *entry = &tlb->entry[vpn & (TLB_CNT - 1)];
+
+        if (entry->vpn == vpn && fence_match(entry, by_asid, asid))
+            entry->vpn = TLB_INVALID_VPN;
+
+        for (int i = 0; i < TLB_SUPER_CNT; i++) {
+            riscv_tlb_entry *super = &tlb->super[i];
+
+            if (super->vpn == (vaddr >> tlb_page_shift(super->level)) &&
+                fence_match(super, by_asid, asid))
+                super->vpn = TLB_INVALID_VPN;
+        }
+        fence_tlb_super(tlb, vaddr, by_asid, asid);
+        return;
+    }
+
+    for (int i = 0; i < TLB_CNT; i++) {
+        if (fence_match(&tlb->entry[i], by_asid, asid))
+            tlb->entry[i].vpn = TLB_INVALID_VPN;
+    }
+    for (int i = 0; i < TLB_SUPER_CNT; i++) {
+        if (fence_match(&tlb->super[i], by_asid, asid))
+            tlb->super[i].vpn = TLB_INVALID_VPN;
+    }
+}
+
+void invalid_pwc(riscv_pwc *pwc)
+{
+    for (int i = 0; i < PWC_CNT; i++)
+        pwc->entry[i].valid = false;
+}
+
+// the virtual address shifted by the range covered by the table at the level
+static inline uint64_t pwc_prefix(uint64_t vaddr, uint8_t level)
+{
+    return vaddr >> tlb_page_shift(level + 1);
+}
+
+static inline riscv_pwc_entry *pwc_entry(riscv_pwc *pwc,
+                                         uint64_t prefix,
+                                         uint8_t level)
+{
+    // the level is mixed into the top bits of the index
+    uint64_t index = prefix ^ ((uint64_t) level << (PWC_INDEX_BIT - 2));
+    return &pwc->entry[index & (PWC_CNT - 1)];
+}
+
+/* Find out the table at the lowest level for the virtual address, where
+ * 'levels' is the number of levels of the translation mode. NULL is returned
+ * if none of the tables is cached. */
+riscv_pwc_entry *read_pwc(riscv_pwc *pwc,
+                          uint64_t root,
+                          uint64_t vaddr,
+                          int levels)
+{
+    // the table at the highest level is the root, which is not cached
+    for (int level = 0; level < levels - 1; level++) {
+        uint64_t prefix = pwc_prefix(vaddr, level);
+        riscv_pwc_entry *entry = pwc_entry(pwc, prefix, level);
+
+        if (entry->valid && entry->root == root && entry->prefix == prefix &&
+            entry->level == level)
+            return entry;
+    }
+
+    return NULL;
+}
+
+void write_pwc(riscv_pwc *pwc,
+               uint64_t root,
+               uint64_t vaddr,
+               uint8_t level,
+               uint64_t table,
+               bool global)
+{
+    uint64_t prefix = pwc_prefix(vaddr, level);
+    riscv_pwc_entry *entry = pwc_entry(pwc, prefix, level);
+
+    entry->root = root;
+    entry->prefix = prefix;
+    entry->table = table;
+    entry->level = level;
+    entry->global = global;
+    entry->valid = true;
+}
@@ -42,7 +42,17 @@ static int uart_readable(riscv_uart *uart, int timeout)
         .fd = uart->infd,
         .events = POLLIN,
     };
-    return (poll(&pollfd, 1, timeout) > 0) && (pollfd.revents & POLLIN);
+
+    if (poll(&pollfd, 1, timeout) <= 0)
+        return false;
+
+    /* If the input is hung up, it is never readable again. The negative fd
+     * is ignored by poll, so it doesn't wake up the waiting anymore. */
+    if (!(pollfd.revents & POLLIN)) {
+        uart->infd = -1;
+        return false;
+    }
+    return true;
 }
 
 void tick_uart(riscv_uart *uart)
@@ -52,9 +62,16 @@ void tick_uart(riscv_uart *uart)
 
     while (!fifo_is_full(&uart->rx_buf) && uart_readable(uart, 0)) {
         char c;
-        if (read(uart->infd, &c, 1) == -1)
+        ssize_t ret = read(uart->infd, &c, 1);
+        if (ret == -1)
             break;
 
+        // the end of input is reached, so stop polling it
+        if (ret == 0) {
+            uart->infd = -1;
+            break;
+        }
+
         if (!fifo_put(&uart->rx_buf, c))
             break;
 
@@ -63,6 +80,14 @@ void tick_uart(riscv_uart *uart)
     }
 }
 
+/* Wait until there is any input or the timeout in milliseconds expires, and
+ * return whether the input is ready, which is left to be received by
+ * tick_uart */
+bool wait_uart(riscv_uart *uart, int timeout)
+{
+    return uart_readable(uart, timeout);
+}
+
 uint64_t read_uart(riscv_uart *uart,
                    uint64_t addr,
                    uint8_t size,
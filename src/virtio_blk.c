@@ -1,7 +1,11 @@
 #include <assert.h>
+#include <fcntl.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "cpu.h"
 #include "macros.h"
@@ -26,6 +30,7 @@ static void reset_virtio_blk(riscv_virtio_blk *virtio_blk)
 }
 
 #define MEM_GUEST_TO_HOST(mem, addr) ((mem) + ((addr) -DRAM_BASE))
+#define MEM_HOST_TO_GUEST(mem, ptr) (((uint8_t *) (ptr) - (mem)) + DRAM_BASE)
 static void virtqueue_update(riscv_virtio_blk *virtio_blk)
 {
     /* FIXME: It is actually not a great idea to access pointer
@@ -84,9 +89,10 @@ static void access_disk(riscv_virtio_blk *virtio_blk)
 
         // the desc address should map to memory and we can then use memcpy
         // directly
-        assert(desc1->addr >= DRAM_BASE && desc1->addr < DRAM_END);
+        uint64_t dram_end = mem_end(&cpu->bus.memory);
+        assert(desc1->addr >= DRAM_BASE && desc1->addr < dram_end);
         assert((desc1->addr + desc1->len) >= DRAM_BASE &&
-               (desc1->addr + desc1->len) < DRAM_END);
+               (desc1->addr + desc1->len) < dram_end);
 
         // take value of type and sector in field of struct virtio_blk_req
         riscv_virtio_blk_req *req =
@@ -108,6 +114,9 @@ static void access_disk(riscv_virtio_blk *virtio_blk)
             memcpy(mem + (desc1->addr - DRAM_BASE),
                    virtio_blk->rfsimg + (blk_req_sector * SECTOR_SIZE),
                    desc1->len);
+            invalid_block_cache_by_paddr(&cpu->block_cache, desc1->addr,
+                                         desc1->len);
+            mark_mem_dirty(&cpu->bus.memory, desc1->addr, desc1->len);
         }
 
         assert(desc2->flags & VIRTQ_DESC_F_WRITE);
@@ -115,12 +124,18 @@ static void access_disk(riscv_virtio_blk *virtio_blk)
         /* The final status byte is written by the device: VIRTIO_BLK_S_OK for
          * success */
         *MEM_GUEST_TO_HOST(mem, desc2->addr) = VIRTIO_BLK_S_OK;
+        mark_mem_dirty(&cpu->bus.memory, desc2->addr, 1);
 
         /* (for used) idx field indicates where the device would put the next
          * descriptor entry in the ring (modulo the queue size). This starts at
          * 0, and increases */
-        used->ring[used_idx % queue_size].id = desc_offset;
+        riscv_virtq_used_elem *elem = &used->ring[used_idx % queue_size];
+        elem->id = desc_offset;
         used->idx = ++used_idx;
+        mark_mem_dirty(&cpu->bus.memory, MEM_HOST_TO_GUEST(mem, elem),
+                       sizeof(*elem));
+        mark_mem_dirty(&cpu->bus.memory, MEM_HOST_TO_GUEST(mem, &used->idx),
+                       sizeof(used->idx));
 
         idx++;
     }
@@ -129,7 +144,7 @@ static void access_disk(riscv_virtio_blk *virtio_blk)
     virtio_blk->vq[0].used_idx = used_idx;
 }
 
-bool init_virtio_blk(riscv_virtio_blk *virtio_blk, const char *rfs_name)
+static void init_virtio_blk_reg(riscv_virtio_blk *virtio_blk)
 {
     memset(virtio_blk, 0, sizeof(riscv_virtio_blk));
     // notify is set to -1 for no event happen
@@ -139,35 +154,61 @@ bool init_virtio_blk(riscv_virtio_blk *virtio_blk, const char *rfs_name)
 
     virtio_blk->config[1] = 0x20;
     virtio_blk->config[2] = 0x03;
+}
+
+bool init_virtio_blk(riscv_virtio_blk *virtio_blk, const char *rfs_name)
+{
+    init_virtio_blk_reg(virtio_blk);
 
     if (rfs_name[0] == '\0') {
         virtio_blk->rfsimg = NULL;
         return true;
     }
 
-    FILE *fp = fopen(rfs_name, "rb");
-    if (!fp) {
+    int fd = open(rfs_name, O_RDONLY);
+    if (fd < 0) {
         ERROR("Invalid root filesystem path.\n");
         return false;
     }
 
-    fseek(fp, 0, SEEK_END);
-    size_t sz = ftell(fp) * sizeof(uint8_t);
-    rewind(fp);
-
-    virtio_blk->rfsimg = malloc(sz);
-    size_t read_size = fread(virtio_blk->rfsimg, sizeof(uint8_t), sz, fp);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        ERROR("Error when getting the size of root filesystem.\n");
+        close(fd);
+        return false;
+    }
 
-    if (read_size != sz) {
-        ERROR("Error when reading binary through fread.\n");
-        fclose(fp);
+    /* The image is mapped privately, so the writes of guest are never written
+     * back to the file, and the image can be restored by dropping the written
+     * pages */
+    virtio_blk->rfsimg = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (virtio_blk->rfsimg == MAP_FAILED) {
+        ERROR("Error when mapping root filesystem through mmap.\n");
+        virtio_blk->rfsimg = NULL;
         return false;
     }
-    fclose(fp);
+    virtio_blk->rfsimg_size = st.st_size;
 
     return true;
 }
 
+// Reset the device and restore the disk to the content of the image file
+bool restore_virtio_blk(riscv_virtio_blk *virtio_blk)
+{
+    uint8_t *rfsimg = virtio_blk->rfsimg;
+    uint64_t rfsimg_size = virtio_blk->rfsimg_size;
+
+    init_virtio_blk_reg(virtio_blk);
+    virtio_blk->rfsimg = rfsimg;
+    virtio_blk->rfsimg_size = rfsimg_size;
+
+    if (rfsimg == NULL)
+        return true;
+    return madvise(rfsimg, rfsimg_size, MADV_DONTNEED) == 0;
+}
+
 uint64_t read_virtio_blk(riscv_virtio_blk *virtio_blk,
                          uint64_t addr,
                          uint8_t size,
@@ -276,7 +317,6 @@ bool write_virtio_blk(riscv_virtio_blk *virtio_blk,
     case VIRTIO_MMIO_QUEUE_NOTIFY:
         assert(value == 0);
         virtio_blk->queue_notify = value;
-        virtio_blk->notify_clock = virtio_blk->clock;
         break;
     case VIRTIO_MMIO_INTERRUPT_ACK:
         /* clear bits by given bitmask to represent that the events causing
@@ -312,20 +352,21 @@ bool virtio_is_interrupted(riscv_virtio_blk *virtio_blk)
     return (virtio_blk->isr & 0x1) == 1;
 }
 
-void tick_virtio_blk(riscv_virtio_blk *virtio_blk)
+/* Complete the requests in the queue, which is called after DISK_DELAY since
+ * the queue is notified */
+void complete_virtio_blk(riscv_virtio_blk *virtio_blk)
 {
-    if (virtio_blk->queue_notify != 0xFFFFFFFF &&
-        virtio_blk->clock == virtio_blk->notify_clock + DISK_DELAY) {
+    if (virtio_blk->queue_notify != 0xFFFFFFFF) {
         /* the interrupt was asserted because the device has used a buffer
          * in at least one of the active virtual queues. */
         virtio_blk->isr |= 0x1;
         access_disk(virtio_blk);
         virtio_blk->queue_notify = 0xFFFFFFFF;
     }
-    virtio_blk->clock++;
 }
 
 void free_virtio_blk(riscv_virtio_blk *virtio_blk)
 {
-    free(virtio_blk->rfsimg);
+    if (virtio_blk->rfsimg != NULL)
+        munmap(virtio_blk->rfsimg, virtio_blk->rfsimg_size);
 }